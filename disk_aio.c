@@ -0,0 +1,116 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "disk_aio.h"
+
+/* a pool with no workers */
+void aio_pool_init(aio_pool *pool){
+    pool->head = pool->tail = pool->stopping = pool->num_workers = 0;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->submitted, NULL);
+    pthread_cond_init(&pool->taken, NULL);
+    pthread_cond_init(&pool->completed, NULL);
+}
+
+/* stops the workers and frees what aio_pool_init made */
+void aio_pool_destroy(aio_pool *pool){
+    aio_stop(pool);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->submitted);
+    pthread_cond_destroy(&pool->taken);
+    pthread_cond_destroy(&pool->completed);
+}
+
+void aio_complete(aio_pool *pool, aio_batch *batch, int result){
+    pthread_mutex_lock(&pool->lock);
+    if(result < 0) batch->failed++;
+    batch->pending--;
+    pthread_cond_broadcast(&pool->completed);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void *aio_worker(void *arg){
+    aio_pool *pool = (aio_pool *)arg;
+    aio_request r;
+    pthread_mutex_lock(&pool->lock);
+    while(1){
+        while(pool->head == pool->tail && !pool->stopping) pthread_cond_wait(&pool->submitted, &pool->lock);
+        /* the ring is drained before a worker stops */
+        if(pool->head == pool->tail) break;
+        r = pool->ring[pool->head%aio_ring_size];
+        pool->head++;
+        pthread_cond_signal(&pool->taken);
+        pthread_mutex_unlock(&pool->lock);
+        aio_complete(pool, r.batch, r.io(r.context, r.start_address, r.nblocks, r.buffer));
+        pthread_mutex_lock(&pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+/* (re)starts the pool with the given # workers, 0 to run every request on submission
+ * returns -1 if the # workers is out of range or a worker cannot be created
+ */
+int aio_start(aio_pool *pool, int workers){
+    int i;
+    if(workers < 0 || workers > aio_max_workers) return -1;
+    aio_stop(pool);
+    for(i=0;i<workers;i++){
+        if(pthread_create(&pool->threads[i], NULL, aio_worker, pool) != 0) { aio_stop(pool); return -1; }
+        pool->num_workers++;
+    }
+    return 0;
+}
+
+/* completes every request in the ring, then stops the workers */
+void aio_stop(aio_pool *pool){
+    int i;
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = 1;
+    pthread_cond_broadcast(&pool->submitted);
+    pthread_mutex_unlock(&pool->lock);
+    for(i=0;i<pool->num_workers;i++) { pthread_join(pool->threads[i], NULL); }
+    pool->num_workers = 0;
+    pool->stopping = 0;
+}
+
+void aio_batch_init(aio_batch *batch){
+    batch->pending = batch->failed = 0;
+}
+
+/* queues io(context, start_address, nblocks, buffer) as part of batch; buffer must stay valid until aio_wait
+ * blocks while the ring is full
+ */
+int aio_submit(aio_pool *pool, aio_batch *batch, aio_io io, void *context, int start_address, int nblocks, void *buffer){
+    aio_request *r;
+    if(pool->num_workers == 0){
+        if(io(context, start_address, nblocks, buffer) < 0) batch->failed++;
+        return 0;
+    }
+    pthread_mutex_lock(&pool->lock);
+    while(pool->tail-pool->head == aio_ring_size) pthread_cond_wait(&pool->taken, &pool->lock);
+    r = &pool->ring[pool->tail%aio_ring_size];
+    r->batch = batch;
+    r->io = io;
+    r->context = context;
+    r->start_address = start_address;
+    r->nblocks = nblocks;
+    r->buffer = buffer;
+    batch->pending++;
+    pool->tail++;
+    pthread_cond_signal(&pool->submitted);
+    pthread_mutex_unlock(&pool->lock);
+    return 0;
+}
+
+/* waits until every request of the batch has completed
+ * returns -1 if any of them failed
+ */
+int aio_wait(aio_pool *pool, aio_batch *batch){
+    int failed;
+    pthread_mutex_lock(&pool->lock);
+    while(batch->pending > 0) pthread_cond_wait(&pool->completed, &pool->lock);
+    failed = batch->failed;
+    pthread_mutex_unlock(&pool->lock);
+    return failed ? -1 : 0;
+}
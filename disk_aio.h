@@ -0,0 +1,50 @@
+#ifndef DISK_AIO_H
+#define DISK_AIO_H
+
+#include <pthread.h>
+
+/* an asynchronous submission/completion queue for block reads and writes
+ * requests go into a ring served by a pool of worker threads; with no workers they run on submission
+ * each aio_pool has its own ring and workers
+ */
+#define aio_ring_size 256
+#define aio_max_workers 16
+
+typedef int (*aio_io)(void *context, int start_address, int nblocks, void *buffer);
+
+/* the requests a caller waits for together */
+typedef struct aio_batch{
+    int pending;    // # requests submitted but not completed
+    int failed;     // # requests that returned -1
+} aio_batch;
+
+typedef struct aio_request{
+    aio_batch *batch;
+    aio_io     io;
+    void      *context;     // passed to io
+    int        start_address, nblocks;
+    void      *buffer;
+} aio_request;
+
+typedef struct aio_pool{
+    aio_request     ring[aio_ring_size];
+    int             head,           // the next request a worker takes
+                    tail,           // where the next request is submitted
+                    stopping,
+                    num_workers;
+    pthread_t       threads[aio_max_workers];
+    pthread_mutex_t lock;
+    pthread_cond_t  submitted,      // the ring is no longer empty
+                    taken,          // the ring is no longer full
+                    completed;      // a request of some batch completed
+} aio_pool;
+
+void aio_pool_init(aio_pool *pool);
+void aio_pool_destroy(aio_pool *pool);
+int  aio_start(aio_pool *pool, int workers);
+void aio_stop(aio_pool *pool);
+void aio_batch_init(aio_batch *batch);
+int  aio_submit(aio_pool *pool, aio_batch *batch, aio_io io, void *context, int start_address, int nblocks, void *buffer);
+int  aio_wait(aio_pool *pool, aio_batch *batch);
+
+#endif
@@ -0,0 +1,100 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "disk_mmap.h"
+
+/* a disk with no image mapped */
+void mmap_disk_init(mmap_disk *disk){
+    disk->map = NULL;
+    disk->fd = -1;
+    disk->block_size = disk->num_blocks = 0;
+}
+
+/* maps num_blocks blocks of an open image */
+int map_image(mmap_disk *disk, int fd, int block_size, int num_blocks){
+    disk->map = (char *)mmap(NULL, (size_t)block_size*num_blocks, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    if(disk->map == MAP_FAILED) { disk->map = NULL; close(fd); return -1; }
+    disk->fd = fd;
+    disk->block_size = block_size;
+    disk->num_blocks = num_blocks;
+    return 0;
+}
+
+int mmap_init_fresh_disk(mmap_disk *disk, char *filename, int block_size, int num_blocks){
+    int fd;
+    mmap_close_disk(disk);
+    if((fd = open(filename, O_RDWR|O_CREAT|O_TRUNC, 0644)) < 0) return -1;
+    /* the image reads back as zeros until it is written */
+    if(ftruncate(fd, (off_t)block_size*num_blocks) < 0) { close(fd); return -1; }
+    return map_image(disk, fd, block_size, num_blocks);
+}
+
+int mmap_init_disk(mmap_disk *disk, char *filename, int block_size, int num_blocks){
+    int fd;
+    struct stat st;
+    mmap_close_disk(disk);
+    if((fd = open(filename, O_RDWR)) < 0) return -1;
+    if(fstat(fd, &st) < 0 || st.st_size < (off_t)block_size*num_blocks) { close(fd); return -1; }
+    return map_image(disk, fd, block_size, num_blocks);
+}
+
+/* returns # blocks read, -1 if the range is outside the image */
+int mmap_read_blocks(mmap_disk *disk, int start_address, int nblocks, void *buffer){
+    if(disk->map == NULL || start_address < 0 || nblocks < 0 || start_address+nblocks > disk->num_blocks) return -1;
+    memcpy(buffer, disk->map+(size_t)start_address*disk->block_size, (size_t)nblocks*disk->block_size);
+    return nblocks;
+}
+
+/* returns # blocks written, -1 if the range is outside the image */
+int mmap_write_blocks(mmap_disk *disk, int start_address, int nblocks, void *buffer){
+    if(disk->map == NULL || start_address < 0 || nblocks < 0 || start_address+nblocks > disk->num_blocks) return -1;
+    memcpy(disk->map+(size_t)start_address*disk->block_size, buffer, (size_t)nblocks*disk->block_size);
+    return nblocks;
+}
+
+/* returns where the block lives in the mapping, NULL if it is outside the image
+ * writes through the pointer reach the image on the next mmap_sync_disk
+ */
+char *mmap_block(mmap_disk *disk, int block){
+    if(disk->map == NULL || block < 0 || block >= disk->num_blocks) return NULL;
+    return disk->map+(size_t)block*disk->block_size;
+}
+
+/* tells the kernel blocks start_address..start_address+nblocks-1 will be read soon */
+int mmap_prefetch(mmap_disk *disk, int start_address, int nblocks){
+    long page = sysconf(_SC_PAGESIZE);
+    size_t from, to;
+    if(disk->map == NULL || start_address < 0 || nblocks <= 0 || start_address+nblocks > disk->num_blocks) return -1;
+    from = (size_t)start_address*disk->block_size/page*page;
+    to = (size_t)(start_address+nblocks)*disk->block_size;
+    return madvise(disk->map+from, to-from, MADV_WILLNEED);
+}
+
+/* writes blocks start_address..start_address+nblocks-1 back to the image file and waits for them */
+int mmap_sync_blocks(mmap_disk *disk, int start_address, int nblocks){
+    long page = sysconf(_SC_PAGESIZE);
+    size_t from, to;
+    if(disk->map == NULL || start_address < 0 || nblocks <= 0 || start_address+nblocks > disk->num_blocks) return -1;
+    from = (size_t)start_address*disk->block_size/page*page;
+    to = (size_t)(start_address+nblocks)*disk->block_size;
+    return msync(disk->map+from, to-from, MS_SYNC);
+}
+
+int mmap_sync_disk(mmap_disk *disk){
+    if(disk->map == NULL) return 0;
+    return msync(disk->map, (size_t)disk->block_size*disk->num_blocks, MS_SYNC);
+}
+
+int mmap_close_disk(mmap_disk *disk){
+    if(disk->map == NULL) return 0;
+    mmap_sync_disk(disk);
+    munmap(disk->map, (size_t)disk->block_size*disk->num_blocks);
+    close(disk->fd);
+    disk->map = NULL;
+    disk->fd = -1;
+    return 0;
+}
@@ -0,0 +1,25 @@
+#ifndef DISK_MMAP_H
+#define DISK_MMAP_H
+
+/* a disk image backend with the interface of disk_emu.h that maps the image into memory
+ * each mmap_disk is one image, any number of them can be open at once
+ */
+typedef struct mmap_disk{
+    char *map;          // the mapped image, NULL if no image is mapped
+    int   fd,
+          block_size,
+          num_blocks;
+}mmap_disk;
+
+void  mmap_disk_init(mmap_disk *disk);
+int   mmap_init_fresh_disk(mmap_disk *disk, char *filename, int block_size, int num_blocks);
+int   mmap_init_disk(mmap_disk *disk, char *filename, int block_size, int num_blocks);
+int   mmap_read_blocks(mmap_disk *disk, int start_address, int nblocks, void *buffer);
+int   mmap_write_blocks(mmap_disk *disk, int start_address, int nblocks, void *buffer);
+char *mmap_block(mmap_disk *disk, int block);
+int   mmap_prefetch(mmap_disk *disk, int start_address, int nblocks);
+int   mmap_sync_blocks(mmap_disk *disk, int start_address, int nblocks);
+int   mmap_sync_disk(mmap_disk *disk);
+int   mmap_close_disk(mmap_disk *disk);
+
+#endif
@@ -4,790 +4,3143 @@
 #include <unistd.h>
 #include <time.h>
 #include <stdint.h>
+#include <limits.h>
 #include <sys/stat.h>
 #include <sys/mman.h> 
 #include <fcntl.h>
+#include <pthread.h>
 #include "disk_emu.h"
+#include "disk_mmap.h"
+#include "disk_aio.h"
 #include "sfs_api.h"
+#include "sfs_api_ext.h"
 
-#define block_size 1024      // the size of each data block in bytes
-#define num_blocks 1027      // the # of blocks
-#define max_file_num 200     // the # of i-nodes
+#define block_size_default 1024     // the geometry of a fresh image unless configured otherwise, and of images of ssfs_chained_magic
+#define num_blocks_default 1027
+#define max_file_num_default 200
+#define block_size_min 512
+#define block_size_max 65536
 #define filename_length 10   // the filename has at most 10 characters
 #define max_restore_time 10
-#define unused '1'
+#define unused '1'          // fbm and wm values in images with one char per block
 #define used '0'
 #define writeable '1'
 #define readonly '0'
+#define bitmap_words ((fs->num_blocks+63)/64)       // # 64-bit words in the fbm and wm
+#define summary_words ((bitmap_words+63)/64)    // # 64-bit words summarizing the fbm
+#define ssfs_magic ((int)0xACBD000D)           // images keeping the data of small files in their i-nodes, see is_inline
+#define ssfs_chained_magic ((int)0xACBD0005)   // older images chaining i-nodes through pointer[14], upgraded on mount
+#define direct_pointer_num 12  // pointer[0..11] point at data blocks
+#define indirect_level_num 3   // pointer[12], [13] and [14] are the single, double and triple indirect blocks
+#define pointers_per_block (int)(fs->block_size/sizeof(int))
+#define i_nodes_per_block (int)(fs->block_size/sizeof(i_node))
+#define dir_entries_per_block (int)(fs->block_size/sizeof(dir_entry))
+#define inline_marker -2            // pointer[14] of an i-node whose data is in pointer[0..13]
+#define inline_max (int)(14*sizeof(int))    // the most bytes of data an i-node holds
+#define journal_block_num 16        // # blocks at the end of the disk reserved for the metadata journal
+#define journal_magic 0x4A484452    // the first block of the journal
+#define journal_tx_magic 0x4A545831 // the first block of a transaction in the journal
+#define journal_record_max 32768    // the most bytes one journal_record carries
+#define cache_capacity_default 64   // # blocks held by the block cache unless configured otherwise
+#define cache_capacity_min 2         // room for a pinned block and one more
+#define ind_capacity 64             // # indirect blocks held in memory before clean ones make room for others, see ind_get
+#define ra_window_min 4              // # blocks read ahead once a file is read sequentially
+#define ra_window_max 64             // the most the readahead window grows to, at most half the cache
+#define stat_slot_num 16             // # slots threads count statistics in, see my_stats
+#define aio_workers_default 0       // # threads serving queued block I/O unless configured otherwise
 
 typedef struct i_node{
     int size;   // initial value is -1, indicating it's free; busy otherwise
     int pointer[15];
 }i_node;
 
+/* the superblock: this header, then the root map and max_restore_time shadow maps, over sp_block_num blocks
+ * a map holds the blocks of the i-node file, then those of the root directory
+ */
 typedef struct superblock{
     int magic;      // specify the type of file system format for storing the data
-    int b_size;     // 1024 bytes
+    int b_size;     // # bytes per block
     int f_size;     // # blocks
     int i_num;      // # i_nodes
+    int journal_start;      // the first block of the journal
+    int journal_blocks;     // # blocks of the journal, 0 if the image has no room for one
+    int shadow_used[max_restore_time];  // 1 if shadow map i holds a checkpoint
+}superblock;
+
+/* the superblock of images of ssfs_chained_magic, with the maps of the i-node file in j-nodes */
+typedef struct legacy_superblock{
+    int magic;
+    int b_size;
+    int f_size;
+    int i_num;
     i_node root;    // the root is a j-node
     i_node shadow[max_restore_time];  
-}superblock;
+}legacy_superblock;
 
-typedef struct disk{
-    superblock s;
-    char data[num_blocks-20][block_size];
-    int fbm[num_blocks];   // each free bit is associated with one data block
-    int wm[num_blocks];    // each write bit is associated with one data block
-}disk;
+/* the first block of the journal; transactions follow it, each starting on a block */
+typedef struct journal_header{
+    unsigned int magic;
+    unsigned int seq;       // the sequence # of the first transaction to replay
+}journal_header;
+
+/* a transaction: this header, then length bytes of records, each a journal_record followed by its bytes */
+typedef struct journal_tx{
+    unsigned int magic;
+    unsigned int seq;
+    unsigned int length;
+    unsigned int checksum;  // FNV-1a over the records
+}journal_tx;
+
+typedef struct journal_record{
+    int block;              // the metadata block the bytes belong at
+    unsigned short offset;
+    unsigned short length;
+}journal_record;
 
 typedef struct dir_entry{
     char filename[filename_length+2];
     int i_node_index;      // this is the index of its i-node in the i-node file (array)
 }dir_entry;
 
+/* a position in a file: byte offset index*block_size+entry+1, see ptr_offset and ptr_seek */
 typedef struct pointer{
-    int block;
-    int entry;
+    int entry;  // the last byte before the position within the block, -1 at its start
+    int index;  // the block is the index-th block of the file
 }ptr;
 
+typedef struct cache_entry{
+    int block;      // the disk block held by this entry, -1 if the entry is free
+    int dirty;      // 1 if the block was modified since it was last written back
+    int ref;        // reference bit looked at by the clock hand
+    int pins;       // # views borrowing the block; a pinned entry is never evicted
+    int prefetched; // 1 if readahead brought the block in and it has not been read since
+    char *data;
+}cache_entry;
+
+/* an indirect block held in memory, see ind_get */
+typedef struct ind_block{
+    int   block;        // the indirect block held, -1 if the slot is free
+    char  dirty,        // changed since it was last logged
+          whole,        // its home block holds nothing of it yet, so it is logged whole
+          pending,      // in the transaction being built
+          stale;        // logged since its home block was last written
+    int  *entries;
+    char *logged,       // its content as last logged, or as its home block holds it
+         *pending_data; // as in the transaction being built
+}ind_block;
+
 typedef struct fd_entry{
     int i_node_number;  // this is the one that corresponds to the file
     ptr read_ptr;
     ptr write_ptr;
+    /* readahead: a read starting where the previous one ended is sequential */
+    int ra_next;        // the byte offset the previous read ended at, -1 before the first read
+    int ra_window;      // # blocks to keep read ahead of the read pointer, 0 until reads are sequential
+    int ra_end;         // the index of the block readahead has reached
 }fd_entry;
 
-int sp_start_block = 0,
-    fbm_start_block = 1,
-    wm_start_block = 2,
-    file_start_block = 3,       // the i-node file starts from this block
-    file_block_num = 13,        // # blocks that the i-node file takes up
-    root_dir_start_block = 16,  // the root directory starts from this block
-    root_dir_block_num= 4,      // # blocks that the root directory takes up
-    data_start_block = 20,      // user data goes in blocks start from this one
-    data_block_num = 1007,      // # data block for user
-    commit_return_value = -1;
-/* cache */
-char       fbm[num_blocks], 
-           wm[num_blocks];
-superblock sp;
-i_node     i_node_array[max_file_num];
-dir_entry  root_dir[max_file_num];
-fd_entry   fd_table[max_file_num];
-char       a_block_buf[block_size];
+/* a file system: its image and everything mounted from it, see ssfs_new */
+struct ssfs{
+    char      *filename;                // the image
+    /* the geometry of the mounted image and the layout derived from it, see set_geometry */
+    int block_size,                 // the size of each data block in bytes
+        num_blocks,                 // the # of blocks
+        max_file_num,               // the # of i-nodes
+        sp_start_block,
+        sp_block_num,               // # blocks that the superblock takes up
+        fbm_start_block,
+        wm_start_block,
+        bitmap_block_num,           // # blocks that each of the fbm and wm takes up
+        file_start_block,           // the i-node file starts from this block
+        file_block_num,             // # blocks that the i-node file takes up
+        root_dir_start_block,       // the root directory starts from this block
+        root_dir_block_num,         // # blocks that the root directory takes up
+        data_start_block,           // user data goes in blocks start from this one
+        data_block_num,             // # data block for user
+        map_len,                    // # blocks in a map: file_block_num+root_dir_block_num
+        dir_index_size,             // # slots in the name index, a power of two well above max_file_num
+        share_start_block,          // the share counts are kept in the blocks right before the journal
+        share_block_num,            // # blocks that the share counts take up
+        commit_return_value;
+    ssfs_geometry next_geometry;            // of the next fresh image
+    /* cache; everything sized by the geometry is allocated by set_geometry
+     * the metadata is kept in memory exactly as on the disk, padded to whole blocks, so that its blocks are read straight into place
+     */
+    uint64_t  *fbm,                         // bit b%64 of word b/64 is set if block b is unused
+              *fbm_summary,                 // bit w%64 of word w/64 is set if word w of the fbm has an unused block
+              *wm;                          // bit b%64 of word b/64 is set if block b is writeable; follows the fbm in memory as on the disk
+    int        fbm_cursor;                  // next-fit: the search for an unused block resumes here, a hint read and written relaxed
+    superblock sp;
+    char      *sp_image;                    // the superblock blocks: sp, then the maps
+    int       *root_map,                    // the blocks of the i-node file, then those of the root directory
+              *dir_map;                     // root_map+file_block_num
+    i_node    *i_node_array;
+    dir_entry *root_dir;
+    char      *i_node_block_loaded,         // 1 once the block of the i-node file is in i_node_array, see i_node_at
+               root_dir_loaded;             // 1 once the root directory is in root_dir and indexed
+    uint8_t   *share_count;                 // # references to block b beyond the first, held by checkpoints sharing it, see add_ref
+    char      *share_block_loaded;          // 1 once the block of the share counts is in share_count
+    fd_entry  *fd_table;
+    /* lookup indexes */
+    int       *dir_index;                   // open addressing on the file name: a root_dir slot, -1 if empty, -2 if deleted
+    int       *open_fd;                     // open_fd[i] is the fd of the file whose i-node is i, -1 if it is not opened
+    /* block cache */
+    cache_entry *cache;
+    int       *cache_index;                 // cache_index[b] is the cache entry holding block b, -1 if b is not cached
+    int        cache_capacity,
+               cache_hand,
+               cache_pinned;                // # entries with pins
+    long       cache_hits,
+               cache_misses,
+               ra_issued,                   // # blocks brought in by readahead
+               ra_hits;                     // # of them read before being evicted
+    /* indirect blocks are metadata: they are held here rather than in the block cache,
+     * and logged in the same transaction as the i-nodes and bitmaps that refer to them, see commit_indirect
+     */
+    ind_block *ind;
+    int       *ind_index,                   // ind_index[b] is the slot holding indirect block b, -1 if it is not held
+               ind_num,                     // # slots
+               ind_hand;                    // where the search for a slot to reuse resumes
+    /* metadata blocks modified since they were last written */
+    char      *i_node_block_dirty,
+              *root_dir_block_dirty,
+              *fbm_block_dirty,
+              *wm_block_dirty,
+              *share_block_dirty,
+               sp_dirty;
+    /* metadata journal: commit_metadata logs the bytes of the metadata blocks that changed,
+     * and their home blocks are only written at a checkpoint
+     */
+    int        journal_durable,             // 1 to sync every transaction before commit_metadata returns, see ssfs_journal_config
+               journal_active,              // 0 while mounting and for images without a journal: metadata goes straight home
+               journal_next,                // the block the next transaction goes to
+              *meta_home,                   // the home block of each metadata block as last logged, -1 if not logged since mount
+              *meta_pending_home;
+    char     **meta_logged,                 // its content as last logged
+             **meta_pending,                // its content in the transaction being built
+              *meta_is_pending,
+              *meta_stale,                  // 1 if it was logged since its home block was last written
+              *journal_buf;                 // the transaction being built
+    unsigned int journal_seq;               // the sequence # of the next transaction
+    int        journal_revoked;             // 1 once a block logged since the last checkpoint is freed, see ind_drop
+    int        journal_len,                 // # bytes of records in journal_buf
+               journal_buf_size;
+    /* group commit: callers of commit_metadata wait for one of them to log everything dirty */
+    pthread_mutex_t group_lock;
+    pthread_cond_t  group_done;
+    long       group_requested,             // # commit_metadata calls so far
+               group_logged;                // # of them whose changes are in the journal
+    int        group_leader;                // 1 while a caller is logging
+    int        meta_deferred;               // set while ssfs_batch applies its operations: commit_metadata waits for the end of the batch
+    int       *batch_freed,                 // blocks freed while meta_deferred is set, made unused once the batch commits
+               batch_freed_num;
+    long       meta_bytes_written,          // metadata written to the disk so far
+               meta_ops,                    // # operations that committed metadata
+               meta_last_op_bytes;          // metadata written by the last of them
+    ssfs_stats *stats;                      // stat_slot_num slots, each thread counts in one, see my_stats
+    FILE      *trace;                       // the trace being recorded, NULL if none, see ssfs_trace_start
+    long       trace_start;                 // stat_now when it started
+    /* disk backend, see ssfs_set_backend */
+    int        disk_backend,                // the backend of the mounted image
+               next_backend;                // the backend the next mkssfs mounts with
+    mmap_disk  disk;                        // the image with SSFS_BACKEND_MMAP
+    /* asynchronous block I/O, see ssfs_aio_config */
+    aio_pool   aio;
+    int        aio_workers,
+               aio_running;                 // # workers the pool was started with, -1 before it is started
+    aio_batch *ra_batch;                    // per i-node: readahead queued but not yet in the cache, see readahead
+    /* locks, always taken in this order: dir_lock, an i-node lock, then meta_lock, ind_lock, i_node_load_lock, cache_lock, emu_lock, trace_lock
+     * the fbm is updated with atomic operations and needs no lock
+     */
+    pthread_rwlock_t dir_lock;              // the root directory, fd table and i-node allocation; held for writing by operations on the whole file system
+    pthread_rwlock_t *i_node_lock;          // the i-node, data and open fd of one file; held for reading by operations that do not change the file
+    pthread_mutex_t  meta_lock;             // dirty bits, the superblock and writing metadata; recursive
+    pthread_mutex_t  ind_lock;              // the indirect blocks held in memory
+    pthread_mutex_t  i_node_load_lock;      // reading a block of the i-node file on first touch
+    pthread_mutex_t  cache_lock;            // the block cache, not needed with a mapped image
+    pthread_mutex_t  trace_lock;            // the trace file; taken last
+};
+
+/* a metadata block is known by the block it starts in: superblock, fbm, wm, i-node file and root directory,
+ * then the blocks of the share counts by data_start_block+i
+ */
+#define meta_slot_num (fs->data_start_block+fs->share_block_num)
+
+/* disk_emu holds one image for the whole process: the file system mounted on it, and its lock */
+ssfs_t          *emu_owner = NULL;
+pthread_mutex_t  emu_lock = PTHREAD_MUTEX_INITIALIZER;     // disk_emu shares one file position between callers
+
+/* the i-node locks are made by set_geometry */
+void init_locks(ssfs_t *fs){
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&fs->meta_lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    pthread_rwlock_init(&fs->dir_lock, NULL);
+    pthread_mutex_init(&fs->ind_lock, NULL);
+    pthread_mutex_init(&fs->i_node_load_lock, NULL);
+    pthread_mutex_init(&fs->cache_lock, NULL);
+    pthread_mutex_init(&fs->group_lock, NULL);
+    pthread_cond_init(&fs->group_done, NULL);
+    pthread_mutex_init(&fs->trace_lock, NULL);
+}
+
+void lock_cache(ssfs_t *fs)   { if(fs->disk_backend != SSFS_BACKEND_MMAP) pthread_mutex_lock(&fs->cache_lock); }
+void unlock_cache(ssfs_t *fs) { if(fs->disk_backend != SSFS_BACKEND_MMAP) pthread_mutex_unlock(&fs->cache_lock); }
+
+/* statistics: a thread takes a slot on its first count and keeps it for every file system,
+ * so threads rarely share a slot and the counts need only relaxed atomic adds; reading sums the slots
+ */
+__thread int stat_slot = -1;
+int          stat_slot_next = 0;
+
+ssfs_stats *my_stats(ssfs_t *fs){
+    if(stat_slot == -1) stat_slot = __atomic_fetch_add(&stat_slot_next, 1, __ATOMIC_RELAXED)%stat_slot_num;
+    return &fs->stats[stat_slot];
+}
+
+void stat_add(long *counter, long n) { __atomic_fetch_add(counter, n, __ATOMIC_RELAXED); }
+
+long stat_now(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*1000000000L + ts.tv_nsec;
+}
+
+/* counts a public call that began at start and returns its return value r */
+int stat_call(ssfs_t *fs, int call, long start, int r, long bytes){
+    ssfs_call_stats *c = &my_stats(fs)->call[call];
+    long ns = stat_now() - start;
+    int bucket = ns < 2 ? 0 : 63 - __builtin_clzl(ns);
+    if(bucket >= SSFS_STAT_BUCKETS) bucket = SSFS_STAT_BUCKETS-1;
+    stat_add(&c->calls, 1);
+    if(r < 0) stat_add(&c->errors, 1);
+    if(bytes > 0) stat_add(&c->bytes, bytes);
+    stat_add(&c->latency[bucket], 1);
+    return r;
+}
+
+/* fills rec for a call that began at start and returned r, all but the time */
+void trace_record(ssfs_trace_record *rec, int call, long start, int r, int file, int arg, int offset, char *name){
+    long ns = stat_now() - start;
+    memset(rec, 0, sizeof(ssfs_trace_record));
+    rec->latency = ns > INT_MAX ? INT_MAX : ns;
+    rec->call = call; rec->file = file; rec->arg = arg; rec->offset = offset; rec->result = r;
+    if(name != NULL) strncpy(rec->name, name, sizeof(rec->name)-1);
+}
+
+/* records a public call that began at start in the trace, if one is being recorded, and returns its return value r
+ * file is the fileID, or the checkpoint restored or diffed from; arg the length, the seek location or the checkpoint diffed to
+ */
+int trace_call(ssfs_t *fs, int call, long start, int r, int file, int arg, int offset, char *name){
+    ssfs_trace_record rec;
+    if(__atomic_load_n(&fs->trace, __ATOMIC_RELAXED) == NULL) return r;
+    trace_record(&rec, call, start, r, file, arg, offset, name);
+    pthread_mutex_lock(&fs->trace_lock);
+    if(fs->trace != NULL){
+        rec.time = start - fs->trace_start;
+        fwrite(&rec, sizeof(rec), 1, fs->trace);
+    }
+    pthread_mutex_unlock(&fs->trace_lock);
+    return r;
+}
+
+/* records each operation of a batch that began at start, in order and with no other call in between, and returns r
+ * file is the operation's type and offset the # operations after it, 0 for the last one of the batch
+ */
+int trace_batch(ssfs_t *fs, long start, int r, ssfs_op *ops, int num_ops){
+    ssfs_trace_record rec;
+    int k;
+    if(__atomic_load_n(&fs->trace, __ATOMIC_RELAXED) == NULL) return r;
+    pthread_mutex_lock(&fs->trace_lock);
+    for(k=0;k<num_ops && fs->trace != NULL;k++){
+        trace_record(&rec, SSFS_STAT_BATCH, start, ops[k].result, ops[k].type, ops[k].length, num_ops-1-k, ops[k].name);
+        rec.time = start - fs->trace_start;
+        fwrite(&rec, sizeof(rec), 1, fs->trace);
+    }
+    pthread_mutex_unlock(&fs->trace_lock);
+    return r;
+}
+
+int locked_read_blocks(int start_address, int nblocks, void *buffer){
+    int r;
+    pthread_mutex_lock(&emu_lock);
+    r = read_blocks(start_address, nblocks, buffer);
+    pthread_mutex_unlock(&emu_lock);
+    return r;
+}
+
+int locked_write_blocks(int start_address, int nblocks, void *buffer){
+    int r;
+    pthread_mutex_lock(&emu_lock);
+    r = write_blocks(start_address, nblocks, buffer);
+    pthread_mutex_unlock(&emu_lock);
+    return r;
+}
+
+/* block I/O on the image of the file system, through its backend */
+int disk_read(ssfs_t *fs, int start_address, int nblocks, void *buffer){
+    stat_add(&my_stats(fs)->block_reads, nblocks);
+    if(fs->disk_backend == SSFS_BACKEND_MMAP) return mmap_read_blocks(&fs->disk, start_address, nblocks, buffer);
+    return locked_read_blocks(start_address, nblocks, buffer);
+}
+
+int disk_write(ssfs_t *fs, int start_address, int nblocks, void *buffer){
+    stat_add(&my_stats(fs)->block_writes, nblocks);
+    if(fs->disk_backend == SSFS_BACKEND_MMAP) return mmap_write_blocks(&fs->disk, start_address, nblocks, buffer);
+    return locked_write_blocks(start_address, nblocks, buffer);
+}
+
+/* disk_read and disk_write as queued to the aio pool */
+int queued_read(void *fs, int start_address, int nblocks, void *buffer)  { return disk_read((ssfs_t *)fs, start_address, nblocks, buffer); }
+int queued_write(void *fs, int start_address, int nblocks, void *buffer) { return disk_write((ssfs_t *)fs, start_address, nblocks, buffer); }
 // my helper functions
-void load_sp(){
-    superblock *buffer_sp = (superblock *)malloc(block_size); 
-    if( read_blocks(sp_start_block, 1, buffer_sp) < 0) exit(EXIT_FAILURE);
-    memcpy(&sp, buffer_sp, block_size);
-    free(buffer_sp);
-}
-
-void load_fbm(){
-    char *buffer_fbm = (char *)malloc(num_blocks);
-    if( read_blocks(fbm_start_block, 1, buffer_fbm) < 0 ) exit(EXIT_FAILURE);
-    memcpy(&fbm, buffer_fbm, num_blocks);
-    free(buffer_fbm);
-}
-
-void load_wm(){
-    int *buffer_wm = (int *)malloc(num_blocks);
-    if( read_blocks(wm_start_block, 1, buffer_wm) < 0 ) exit(EXIT_FAILURE);
-    memcpy(&wm, buffer_wm, num_blocks*sizeof(int));
-    free(buffer_wm);
-}
-
-void commit_sp(){
-    superblock *buffer_sp = (superblock *)malloc(block_size); 
-    memcpy(buffer_sp, &sp, block_size);
-    if( write_blocks(sp_start_block, 1, buffer_sp) < 0) exit(EXIT_FAILURE);    
-    free(buffer_sp);
-}
-
-void commit_fbm(){
-    char *buffer_fbm = (char *)malloc(num_blocks*sizeof(int));
-    memcpy(buffer_fbm, &fbm, num_blocks);
-    if( write_blocks(fbm_start_block, 1, buffer_fbm) < 0 ) exit(EXIT_FAILURE);
-    free(buffer_fbm);
-}
-
-void commit_wm(){
-    int *buffer_wm = (int *)malloc(num_blocks*sizeof(int));
-    memcpy(buffer_wm, &wm, num_blocks*sizeof(int));
-    if( write_blocks(wm_start_block, 1, buffer_wm) < 0 ) exit(EXIT_FAILURE);
-    free(buffer_wm);
-}
-
-void load_i_node_file(){
-    i_node *buffer = (i_node *)malloc(block_size), array[file_block_num][block_size/sizeof(i_node)];
-    int i, j, k=0, m;
-    for(i=0;i<file_block_num;i++){
-        if( read_blocks(sp.root.pointer[i], 1, buffer) < 0) exit(EXIT_FAILURE);
-        memcpy(&array[i], buffer, block_size);
-        for(j=0;j<block_size/sizeof(i_node);j++){
-            if(k>=max_file_num) break;
-            i_node_array[k].size = array[i][j].size;
-            for(m=0;m<15;m++) { i_node_array[k].pointer[m] = array[i][j].pointer[m]; }
-            k++;
+int *shadow_map(ssfs_t *fs, int i) { return fs->root_map+(i+1)*fs->map_len; }
+
+/* 1 if the data of the file with these pointers is kept in them instead of in data blocks
+ * a file starts inline and leaves it for good
+ * once it grows past inline_max bytes, see promote_inline
+ */
+int is_inline(int *pointer) { return pointer[14] == inline_marker; }
+
+/* images of ssfs_chained_magic keep the maps of the i-node file in the j-nodes of the superblock,
+ * and find the root directory through the first i-node of the i-node file
+ */
+void load_legacy_sp(ssfs_t *fs){
+    legacy_superblock old;
+    i_node *first = (i_node *)malloc(fs->block_size);
+    int i, k, *map;
+    memcpy(&old, fs->sp_image, sizeof(old));
+    memset(fs->sp_image, 0, fs->sp_block_num*fs->block_size);
+    fs->sp.b_size = fs->block_size; fs->sp.f_size = fs->num_blocks; fs->sp.i_num = fs->max_file_num;
+    fs->sp.journal_start = 0; fs->sp.journal_blocks = 0;
+    for(i=-1;i<max_restore_time;i++){
+        i_node *j = i == -1 ? &old.root : &old.shadow[i];
+        if(i != -1 && (fs->sp.shadow_used[i] = j->size != -1) == 0) continue;
+        map = i == -1 ? fs->root_map : shadow_map(fs, i);
+        for(k=0;k<fs->file_block_num;k++) { map[k] = j->pointer[k]; }
+        if( disk_read(fs, map[0], 1, first) < 0) exit(EXIT_FAILURE);
+        for(k=0;k<fs->root_dir_block_num;k++) { map[fs->file_block_num+k] = first[0].pointer[k]; }
+    }
+    free(first);
+}
+
+void load_sp(ssfs_t *fs){
+    if( disk_read(fs, fs->sp_start_block, fs->sp_block_num, fs->sp_image) < 0) exit(EXIT_FAILURE);
+    memcpy(&fs->sp, fs->sp_image, sizeof(superblock));
+    if(fs->sp.magic == ssfs_chained_magic) load_legacy_sp(fs);
+}
+
+/* bitmap helpers */
+int is_unused(ssfs_t *fs, int block)   { return (fs->fbm[block/64] >> (block%64)) & 1; }
+int is_readonly(ssfs_t *fs, int block) { return !((fs->wm[block/64] >> (block%64)) & 1); }
+
+/* returns 1 if this call took the block from unused to used, 0 if it was already used */
+int claim_block(ssfs_t *fs, int block){
+    uint64_t bit = 1ULL << (block%64),
+             old = __atomic_fetch_and(&fs->fbm[block/64], ~bit, __ATOMIC_ACQ_REL);
+    if(!(old & bit)) return 0;
+    /* the summary is only a hint: unused_block falls back to rebuilding it when it races with mark_unused */
+    if((old & ~bit) == 0) __atomic_fetch_and(&fs->fbm_summary[block/4096], ~(1ULL << ((block/64)%64)), __ATOMIC_RELAXED);
+    __atomic_store_n(&fs->fbm_block_dirty[block/(fs->block_size*8)], 1, __ATOMIC_RELAXED);
+    return 1;
+}
+
+void mark_used(ssfs_t *fs, int block){
+    claim_block(fs, block);
+}
+
+void mark_unused(ssfs_t *fs, int block){
+    __atomic_fetch_or(&fs->fbm[block/64], 1ULL << (block%64), __ATOMIC_ACQ_REL);
+    __atomic_fetch_or(&fs->fbm_summary[block/4096], 1ULL << ((block/64)%64), __ATOMIC_RELAXED);
+    __atomic_store_n(&fs->fbm_block_dirty[block/(fs->block_size*8)], 1, __ATOMIC_RELAXED);
+}
+
+void mark_readonly(ssfs_t *fs, int block)  { fs->wm_block_dirty[block/(fs->block_size*8)] = 1; __atomic_fetch_and(&fs->wm[block/64], ~(1ULL << (block%64)), __ATOMIC_RELAXED); }
+void mark_writeable(ssfs_t *fs, int block) { fs->wm_block_dirty[block/(fs->block_size*8)] = 1; __atomic_fetch_or(&fs->wm[block/64], 1ULL << (block%64), __ATOMIC_RELAXED); }
+
+/* the allocator is defined with the rest of the search helpers below */
+int unused_block(ssfs_t *fs);
+
+void rebuild_fbm_summary(ssfs_t *fs){
+    int w, s;
+    uint64_t bits;
+    for(s=0;s<summary_words;s++){
+        bits = 0;
+        for(w=s*64;w<bitmap_words && w<(s+1)*64;w++) { if(__atomic_load_n(&fs->fbm[w], __ATOMIC_RELAXED) != 0) bits |= 1ULL << (w%64); }
+        __atomic_store_n(&fs->fbm_summary[s], bits, __ATOMIC_RELAXED);
+    }
+}
+
+/* images of ssfs_chained_magic keep one char per block; blocks past the first disk block of the map count as unused/writeable */
+void load_char_map(ssfs_t *fs, char *chars, uint64_t *map, char set){
+    int i;
+    memset(map, 0, bitmap_words*sizeof(uint64_t));
+    for(i=0;i<fs->num_blocks;i++) { if(i >= fs->block_size || chars[i] == set) map[i/64] |= 1ULL << (i%64); }
+}
+
+/* the fbm and wm blocks follow each other on the disk as in memory, and are read together */
+void load_bitmaps(ssfs_t *fs){
+    char *buffer;
+    if(fs->sp.magic != ssfs_chained_magic)
+    {
+        if( disk_read(fs, fs->fbm_start_block, 2*fs->bitmap_block_num, fs->fbm) < 0 ) exit(EXIT_FAILURE);
+    }
+    else
+    {
+        buffer = (char *)malloc(2*fs->block_size);
+        if( disk_read(fs, fs->fbm_start_block, 2, buffer) < 0 ) exit(EXIT_FAILURE);
+        load_char_map(fs, buffer, fs->fbm, unused);
+        load_char_map(fs, buffer+fs->block_size, fs->wm, writeable);
+        free(buffer);
+    }
+    rebuild_fbm_summary(fs);
+    fs->fbm_cursor = fs->data_start_block;
+}
+
+/* every metadata write goes to the disk through here so that it is counted */
+void write_meta_blocks(ssfs_t *fs, int block, int n, void *buffer){
+    if( disk_write(fs, block, n, buffer) < 0) exit(EXIT_FAILURE);
+    fs->meta_bytes_written += n*fs->block_size;
+    stat_add(&my_stats(fs)->meta_blocks_written, n);
+    fs->meta_last_op_bytes += n*fs->block_size;
+}
+
+/* makes what was written to blocks start..start+n-1 durable before anything written after
+ * disk_emu has no way to sync; a mapped image is otherwise synced on ssfs_commit
+ */
+void journal_sync(ssfs_t *fs, int start, int n){
+    if(fs->journal_durable && fs->disk_backend == SSFS_BACKEND_MMAP && mmap_sync_blocks(&fs->disk, start, n) <0 ) exit(EXIT_FAILURE);
+}
+
+/* with durable set, every commit of metadata is synced to the image before the call making it returns */
+int ssfs_journal_config_r(ssfs_t *fs, int durable){
+    if(durable != 0 && durable != 1) return -1;
+    fs->journal_durable = durable;
+    return 0;
+}
+
+unsigned int journal_checksum(char *data, int length){
+    unsigned int h = 2166136261u;
+    while(length-- > 0) { h ^= (unsigned char)*data++; h *= 16777619u; }
+    return h;
+}
+
+/* starts an empty journal whose first transaction is journal_seq */
+void journal_reset(ssfs_t *fs){
+    journal_header *h = (journal_header *)calloc(1, fs->block_size);
+    h->magic = journal_magic;
+    h->seq = fs->journal_seq;
+    write_meta_blocks(fs, fs->sp.journal_start, 1, h);
+    journal_sync(fs, fs->sp.journal_start, 1);
+    free(h);
+    fs->journal_next = fs->sp.journal_start+1;
+}
+
+/* forgets what was logged, e.g. when the metadata is loaded again; the next log of each block records all of it */
+void journal_forget(ssfs_t *fs){
+    int k;
+    for(k=0;k<meta_slot_num;k++) { fs->meta_home[k] = -1; fs->meta_stale[k] = fs->meta_is_pending[k] = 0; }
+    pthread_mutex_lock(&fs->ind_lock);
+    for(k=0;k<fs->ind_num;k++) { fs->ind[k].pending = fs->ind[k].stale = 0; }
+    pthread_mutex_unlock(&fs->ind_lock);
+    fs->journal_len = 0;
+}
+
+/* writes the metadata blocks logged since the last checkpoint home, then empties the journal
+ * only what is in the journal goes home, never a transaction still being built
+ * called by the commit leader, or with dir_lock held for writing so that there is none
+ */
+void journal_checkpoint(ssfs_t *fs){
+    int k, stale = 0;
+    if(!fs->journal_active) return;
+    for(k=0;k<meta_slot_num;k++){
+        if(!fs->meta_stale[k]) continue;
+        write_meta_blocks(fs, fs->meta_home[k], 1, fs->meta_logged[k]);
+        fs->meta_stale[k] = 0;
+        stale = 1;
+    }
+    pthread_mutex_lock(&fs->ind_lock);
+    for(k=0;k<fs->ind_num;k++){
+        if(fs->ind[k].block == -1 || !fs->ind[k].stale) continue;
+        write_meta_blocks(fs, fs->ind[k].block, 1, fs->ind[k].logged);
+        fs->ind[k].stale = 0;
+        stale = 1;
+    }
+    pthread_mutex_unlock(&fs->ind_lock);
+    /* one sync for all the home blocks before the journal forgets them */
+    if(stale) journal_sync(fs, 0, fs->sp.journal_start);
+    journal_reset(fs);
+    fs->journal_revoked = 0;
+}
+
+/* adds the bytes of now, the content of a metadata block, that differ from logged to the transaction being built,
+ * all of them if logged is NULL; runs of equal bytes shorter than a record header do not split a record
+ */
+void journal_append(ssfs_t *fs, int block, char *now, char *logged){
+    journal_record r;
+    int i = 0, j, gap, whole = logged == NULL;
+    /* room for the block in records at least a header apart, and for padding the transaction to whole blocks */
+    if(fs->journal_buf_size < (int)sizeof(journal_tx)+fs->journal_len+3*fs->block_size)
+    {
+        fs->journal_buf_size = 2*fs->journal_buf_size > (int)sizeof(journal_tx)+fs->journal_len+3*fs->block_size ? 2*fs->journal_buf_size : (int)sizeof(journal_tx)+fs->journal_len+3*fs->block_size;
+        fs->journal_buf = (char *)realloc(fs->journal_buf, fs->journal_buf_size);
+    }
+    while(i < fs->block_size)
+    {
+        if(whole) j = fs->block_size;
+        else
+        {
+            while(i < fs->block_size && now[i] == logged[i]) i++;
+            if(i == fs->block_size) break;
+            for(j=i+1,gap=0;j<fs->block_size && gap<(int)sizeof(journal_record);j++) { gap = now[j] == logged[j] ? gap+1 : 0; }
+            j -= gap;
         }
-    }   
-    free(buffer);
+        if(j-i > journal_record_max) j = i+journal_record_max;
+        r.block = block; r.offset = i; r.length = j-i;
+        memcpy(fs->journal_buf+sizeof(journal_tx)+fs->journal_len, &r, sizeof(r));
+        memcpy(fs->journal_buf+sizeof(journal_tx)+fs->journal_len+sizeof(r), now+i, j-i);
+        fs->journal_len += sizeof(r)+j-i;
+        i = j;
+    }
 }
 
-int commit_i_node_file(int modified){
-    i_node *buffer = (i_node *)malloc(block_size), array[file_block_num][block_size/sizeof(i_node)];
-    int i, j, k=0, m, i_node_block, block_index;
+/* adds the bytes of a metadata block that changed since it was last logged to the transaction being built */
+void journal_log(ssfs_t *fs, int slot, int block, char *buffer){
+    if(fs->meta_logged[slot] == NULL) { fs->meta_logged[slot] = (char *)malloc(fs->block_size); fs->meta_pending[slot] = (char *)malloc(fs->block_size); }
+    /* the block may change while it is logged: what is logged is a copy */
+    memcpy(fs->meta_pending[slot], buffer, fs->block_size);
+    /* a block not logged since mount, or moved to a new home, is logged whole */
+    journal_append(fs, block, fs->meta_pending[slot], fs->meta_home[slot] != block ? NULL : fs->meta_logged[slot]);
+    fs->meta_pending_home[slot] = block;
+    fs->meta_is_pending[slot] = 1;
+}
+
+/* the blocks of the transaction just written become what was last logged; stale unless they also went home */
+void journal_settle(ssfs_t *fs, int stale){
+    int k;
+    char *t;
+    for(k=0;k<meta_slot_num;k++){
+        if(!fs->meta_is_pending[k]) continue;
+        t = fs->meta_logged[k]; fs->meta_logged[k] = fs->meta_pending[k]; fs->meta_pending[k] = t;
+        fs->meta_home[k] = fs->meta_pending_home[k];
+        fs->meta_stale[k] = stale;
+        fs->meta_is_pending[k] = 0;
+    }
+    pthread_mutex_lock(&fs->ind_lock);
+    for(k=0;k<fs->ind_num;k++){
+        if(fs->ind[k].block == -1 || !fs->ind[k].pending) continue;
+        t = fs->ind[k].logged; fs->ind[k].logged = fs->ind[k].pending_data; fs->ind[k].pending_data = t;
+        fs->ind[k].stale = stale;
+        fs->ind[k].pending = 0;
+    }
+    pthread_mutex_unlock(&fs->ind_lock);
+    fs->journal_len = 0;
+}
+
+/* writes the transaction built by journal_log to the journal, checkpointing first if it does not fit
+ * a transaction larger than the whole journal cannot be atomic: it goes straight home after a checkpoint
+ */
+void journal_commit(ssfs_t *fs){
+    journal_tx *tx = (journal_tx *)fs->journal_buf;
+    int k, n = (sizeof(journal_tx)+fs->journal_len+fs->block_size-1)/fs->block_size;
+    if(fs->journal_len == 0) { journal_settle(fs, 1); return; }
+    if(fs->journal_next+n > fs->sp.journal_start+fs->sp.journal_blocks) journal_checkpoint(fs);
+    if(n > fs->sp.journal_blocks-1)
+    {
+        for(k=0;k<meta_slot_num;k++) { if(fs->meta_is_pending[k]) write_meta_blocks(fs, fs->meta_pending_home[k], 1, fs->meta_pending[k]); }
+        pthread_mutex_lock(&fs->ind_lock);
+        for(k=0;k<fs->ind_num;k++) { if(fs->ind[k].block != -1 && fs->ind[k].pending) write_meta_blocks(fs, fs->ind[k].block, 1, fs->ind[k].pending_data); }
+        pthread_mutex_unlock(&fs->ind_lock);
+        journal_settle(fs, 0);
+        return;
+    }
+    tx->magic = journal_tx_magic;
+    tx->seq = fs->journal_seq++;
+    tx->length = fs->journal_len;
+    tx->checksum = journal_checksum(fs->journal_buf+sizeof(journal_tx), fs->journal_len);
+    memset(fs->journal_buf+sizeof(journal_tx)+fs->journal_len, 0, n*fs->block_size-sizeof(journal_tx)-fs->journal_len);
+    write_meta_blocks(fs, fs->journal_next, n, fs->journal_buf);
+    journal_sync(fs, fs->journal_next, n);
+    fs->journal_next += n;
+    journal_settle(fs, 1);
+}
+
+/* replays the transactions in the journal onto their home blocks, then empties it
+ * a transaction that is torn or out of sequence ends the replay
+ */
+void journal_recover(ssfs_t *fs){
+    journal_header h;
+    journal_tx tx;
+    journal_record r;
+    char *buf = (char *)malloc(fs->sp.journal_blocks*fs->block_size), *home = (char *)malloc(fs->block_size);
+    int block = fs->sp.journal_start+1, n, k;
+    if( disk_read(fs, fs->sp.journal_start, 1, buf) <0 ) exit(EXIT_FAILURE);
+    memcpy(&h, buf, sizeof(h));
+    fs->journal_seq = h.magic == journal_magic ? h.seq : 1;
+    while(h.magic == journal_magic && block < fs->sp.journal_start+fs->sp.journal_blocks)
+    {
+        if( disk_read(fs, block, 1, buf) <0 ) exit(EXIT_FAILURE);
+        memcpy(&tx, buf, sizeof(tx));
+        n = (sizeof(journal_tx)+tx.length+fs->block_size-1)/fs->block_size;
+        if(tx.magic != journal_tx_magic || tx.seq != fs->journal_seq || tx.length > (unsigned int)fs->sp.journal_blocks*fs->block_size || block+n > fs->sp.journal_start+fs->sp.journal_blocks) break;
+        if( disk_read(fs, block, n, buf) <0 ) exit(EXIT_FAILURE);
+        if(journal_checksum(buf+sizeof(journal_tx), tx.length) != tx.checksum) break;
+        for(k=0;k<(int)tx.length;k+=sizeof(r)+r.length)
+        {
+            memcpy(&r, buf+sizeof(journal_tx)+k, sizeof(r));
+            if( disk_read(fs, r.block, 1, home) <0 ) exit(EXIT_FAILURE);
+            memcpy(home+r.offset, buf+sizeof(journal_tx)+k+sizeof(r), r.length);
+            if( disk_write(fs, r.block, 1, home) <0 ) exit(EXIT_FAILURE);
+        }
+        fs->journal_seq++;
+        block += n;
+    }
+    journal_sync(fs, 0, fs->num_blocks);
+    free(buf); free(home);
+    journal_reset(fs);
+}
+
+/* metadata blocks go home directly while mounting and on images without a journal, and are logged otherwise */
+void write_meta_block(ssfs_t *fs, int slot, int block, void *buffer){
+    if(fs->journal_active) journal_log(fs, slot, block, buffer);
+    else write_meta_blocks(fs, block, 1, buffer);
+}
+
+/* logs the indirect blocks changed since they were last logged, see ind_get;
+ * like the other metadata they go straight home while mounting and on images without a journal
+ */
+void commit_indirect(ssfs_t *fs){
+    ind_block *s;
+    int k;
+    pthread_mutex_lock(&fs->ind_lock);
+    for(k=0;k<fs->ind_num;k++){
+        s = &fs->ind[k];
+        if(s->block == -1 || !s->dirty) continue;
+        s->dirty = 0;
+        if(!fs->journal_active)
+        {
+            write_meta_blocks(fs, s->block, 1, s->entries);
+            memcpy(s->logged, s->entries, fs->block_size);
+        }
+        else
+        {
+            /* the block may change while it is logged: what is logged is a copy */
+            memcpy(s->pending_data, s->entries, fs->block_size);
+            journal_append(fs, s->block, s->pending_data, s->whole ? NULL : s->logged);
+            s->pending = 1;
+        }
+        s->whole = 0;
+    }
+    pthread_mutex_unlock(&fs->ind_lock);
+}
+
+void commit_sp(ssfs_t *fs){
+    int i;
+    /* cleared first so that a change made while writing marks it dirty again */
+    fs->sp_dirty = 0;
+    memcpy(fs->sp_image, &fs->sp, sizeof(superblock));
+    for(i=0;i<fs->sp_block_num;i++) { write_meta_block(fs, fs->sp_start_block+i, fs->sp_start_block+i, fs->sp_image+i*fs->block_size); }
+}
+
+/* writes the modified blocks of the fbm, or of the wm that follows it */
+void commit_bitmap(ssfs_t *fs, uint64_t *map, char *dirty, int start){
+    int i;
+    for(i=0;i<fs->bitmap_block_num;i++){
+        if(!dirty[i]) continue;
+        /* cleared first so that a change made while writing marks it dirty again */
+        dirty[i] = 0;
+        write_meta_block(fs, start+i, start+i, (char *)map+i*fs->block_size);
+    }
+}
+
+void commit_fbm(ssfs_t *fs) { commit_bitmap(fs, fs->fbm, fs->fbm_block_dirty, fs->fbm_start_block); }
+void commit_wm(ssfs_t *fs)  { commit_bitmap(fs, fs->wm, fs->wm_block_dirty, fs->wm_start_block); }
+
+/* returns the share count of a block, reading its block of the share counts on first use; the caller holds meta_lock */
+uint8_t *share_at(ssfs_t *fs, int block){
+    int i = block/fs->block_size;
+    if(!fs->share_block_loaded[i])
+    {
+        if( disk_read(fs, fs->share_start_block+i, 1, fs->share_count+i*fs->block_size) < 0) exit(EXIT_FAILURE);
+        fs->share_block_loaded[i] = 1;
+    }
+    return &fs->share_count[block];
+}
+
+/* a block is referred to by the i-node file, root directory or indirect block of the live file system and of each checkpoint holding it,
+ * counting each distinct referring block once; a block with more than one reference is read-only in the wm
+ * and copied before the live file system changes it, see copy_shared
+ */
+void add_ref(ssfs_t *fs, int block){
+    pthread_mutex_lock(&fs->meta_lock);
+    if((*share_at(fs, block))++ == 0) mark_readonly(fs, block);
+    fs->share_block_dirty[block/fs->block_size] = 1;
+    pthread_mutex_unlock(&fs->meta_lock);
+}
+
+/* drops a reference to a block; returns 1 if it was the last one, the caller then frees the block */
+int drop_ref(ssfs_t *fs, int block){
+    uint8_t *count;
+    int last;
+    pthread_mutex_lock(&fs->meta_lock);
+    count = share_at(fs, block);
+    if(!(last = *count == 0))
+    {
+        if(--*count == 0) mark_writeable(fs, block);
+        fs->share_block_dirty[block/fs->block_size] = 1;
+    }
+    pthread_mutex_unlock(&fs->meta_lock);
+    return last;
+}
+
+/* writes the modified blocks of the share counts */
+void commit_shares(ssfs_t *fs){
+    int i;
+    for(i=0;i<fs->share_block_num;i++){
+        if(!fs->share_block_dirty[i]) continue;
+        fs->share_block_dirty[i] = 0;
+        write_meta_block(fs, fs->data_start_block+i, fs->share_start_block+i, fs->share_count+i*fs->block_size);
+    }
+}
+
+/* forget the i-node file and the root directory in memory: they are read again from the disk on first use */
+void unload_metadata(ssfs_t *fs){
+    memset(fs->i_node_block_loaded, 0, fs->file_block_num);
+    fs->root_dir_loaded = 0;
+}
+
+/* returns the i-node, reading its block of the i-node file the first time one of its i-nodes is touched */
+i_node *i_node_at(ssfs_t *fs, int n){
+    int i = n/i_nodes_per_block;
+    if(!__atomic_load_n(&fs->i_node_block_loaded[i], __ATOMIC_ACQUIRE))
+    {
+        pthread_mutex_lock(&fs->i_node_load_lock);
+        if(!fs->i_node_block_loaded[i])
+        {
+            if( disk_read(fs, fs->root_map[i], 1, &fs->i_node_array[i*i_nodes_per_block]) < 0) exit(EXIT_FAILURE);
+            __atomic_store_n(&fs->i_node_block_loaded[i], 1, __ATOMIC_RELEASE);
+        }
+        pthread_mutex_unlock(&fs->i_node_load_lock);
+    }
+    return &fs->i_node_array[n];
+}
+
+/* writes the i-th block of the i-node file */
+void write_i_node_block(ssfs_t *fs, int i){
+    fs->i_node_block_dirty[i] = 0;
+    write_meta_block(fs, fs->file_start_block+i, fs->root_map[i], &fs->i_node_array[i*i_nodes_per_block]);
+}
+
+/* adds a reference to the top blocks of the files in block i of the i-node file, when a copy of it is made */
+void share_i_node_block(ssfs_t *fs, int i){
+    int k, p;
+    i_node *n = &fs->i_node_array[i*i_nodes_per_block];
+    /* the root directory's i-node is found through dir_map, its pointers are unused */
+    for(k=i==0;k<i_nodes_per_block && i*i_nodes_per_block+k<fs->max_file_num;k++){
+        if(n[k].size == -1 || is_inline(n[k].pointer)) continue;
+        for(p=0;p<15;p++) { if(n[k].pointer[p] != -1) add_ref(fs, n[k].pointer[p]); }
+    }
+}
+
+/* called before i-node modified changes: its block of the i-node file is marked dirty,
+ * and moved to a new block first if a checkpoint shares it
+ * with modified = -1, the whole i-node file is written
+ */
+int commit_i_node_file(ssfs_t *fs, int modified){
+    int i, block_index, i_node_block;
     if(modified!= -1)
     {
-	    if(wm[sp.root.pointer[modified/(block_size/sizeof(i_node))]] == readonly)
+        i_node_block = modified/(fs->block_size/sizeof(i_node));
+        /* the block is read from where it is before it moves */
+        i_node_at(fs, modified);
+        pthread_mutex_lock(&fs->meta_lock);
+	    if(is_readonly(fs, fs->root_map[i_node_block]))
     	{
-    		if((block_index = unused_block()) <0 ) return -1;
-    		fbm[block_index] = used;
-    		sp.root.pointer[modified/(block_size/sizeof(i_node))] = block_index;		
+    		if((block_index = unused_block(fs)) <0 ) { pthread_mutex_unlock(&fs->meta_lock); return -1; }
+            /* the copy refers to the blocks of its i-nodes as well */
+            share_i_node_block(fs, i_node_block);
+            drop_ref(fs, fs->root_map[i_node_block]);
+    		fs->root_map[i_node_block] = block_index;		
+            fs->sp_dirty = 1;
     	}
+        fs->i_node_block_dirty[i_node_block] = 1;
+        pthread_mutex_unlock(&fs->meta_lock);
     	return 0;
     }
-    for(i=0;i<file_block_num;i++){
-        for(j=0;j<block_size/sizeof(i_node);j++){
-            if(k>=max_file_num) break;
-            array[i][j].size = i_node_array[k].size;
-            for(m=0;m<15;m++){ array[i][j].pointer[m] = i_node_array[k].pointer[m]; }
-            k++;
-        }        
-        memcpy(buffer, &array[i], block_size);
-        if( write_blocks(sp.root.pointer[i], 1, buffer) < 0) exit(EXIT_FAILURE);        
-    }
-    free(buffer);
+    for(i=0;i<fs->file_block_num;i++){ write_i_node_block(fs, i); }
     return 0;
 }
 
-void load_root_dir(){
-    dir_entry *buffer = (dir_entry *)malloc(block_size), array[root_dir_block_num][block_size/sizeof(dir_entry)];
-    int i, j, k=0;
-    for(i=0;i<root_dir_block_num;i++){        
-        if( read_blocks(i_node_array[0].pointer[i], 1, buffer) < 0) exit(EXIT_FAILURE);
-        memcpy(&array[i], buffer, block_size);
-        for(j=0;j<block_size/sizeof(dir_entry);j++){
-            if(k>=max_file_num) break;
-            root_dir[k].i_node_index = array[i][j].i_node_index;
-            strcpy(root_dir[k].filename, array[i][j].filename);
-            k++;
-        }
+/* FNV-1a */
+unsigned int name_hash(char *name){
+    unsigned int h = 2166136261u;
+    while(*name) { h ^= (unsigned char)*name++; h *= 16777619u; }
+    return h;
+}
+
+void dir_index_insert(ssfs_t *fs, int slot){
+    unsigned int h = name_hash(fs->root_dir[slot].filename), k;
+    for(k=0;k<(unsigned int)fs->dir_index_size;k++){
+        int *entry = &fs->dir_index[(h+k)&(fs->dir_index_size-1)];
+        if(*entry < 0) { *entry = slot; return; }
     }
-    free(buffer);
 }
 
-int commit_root_dir(int modified){
-    dir_entry *buffer = (dir_entry *)malloc(block_size), array[root_dir_block_num][block_size/sizeof(dir_entry)];
-    int i, j, k=0, block_index, i_node_block;
+void dir_index_remove(ssfs_t *fs, int slot){
+    unsigned int h = name_hash(fs->root_dir[slot].filename), k;
+    for(k=0;k<(unsigned int)fs->dir_index_size;k++){
+        int *entry = &fs->dir_index[(h+k)&(fs->dir_index_size-1)];
+        if(*entry == -1) return;
+        if(*entry == slot) { *entry = -2; return; }
+    }
+}
+
+/* index every file in the root directory; slot 0 is the root directory itself */
+void dir_index_build(ssfs_t *fs){
+    int i;
+    for(i=0;i<fs->dir_index_size;i++) { fs->dir_index[i] = -1; }
+    for(i=1;i<fs->max_file_num;i++) { if(fs->root_dir[i].i_node_index != -1) dir_index_insert(fs, i); }
+}
+
+/* reads the root directory in as few reads as its blocks allow, on the first lookup after mounting
+ * the whole directory is read then: mounting is cheaper, but mount and first lookup together still grow with max_file_num
+ */
+void load_root_dir(ssfs_t *fs){
+    int *pointer = fs->dir_map, i, n;
+    for(i=0;i<fs->root_dir_block_num;i+=n){
+        for(n=1;i+n<fs->root_dir_block_num && pointer[i+n] == pointer[i]+n;n++);
+        if( disk_read(fs, pointer[i], n, &fs->root_dir[i*dir_entries_per_block]) < 0) exit(EXIT_FAILURE);
+    }
+    dir_index_build(fs);
+    fs->root_dir_loaded = 1;
+}
+
+/* returns the root directory slot of the file with this name
+ * -1 if there is no such file
+ */
+int dir_lookup(ssfs_t *fs, char *name){
+    unsigned int h, k;
+    int slot;
+    if(!fs->root_dir_loaded) load_root_dir(fs);
+    h = name_hash(name);
+    for(k=0;k<(unsigned int)fs->dir_index_size;k++){
+        slot = fs->dir_index[(h+k)&(fs->dir_index_size-1)];
+        if(slot == -1) return -1;
+        if(slot >= 0 && strcmp(fs->root_dir[slot].filename, name) == 0) return slot;
+    }
+    return -1;
+}
+
+/* writes the i-th block of the root directory */
+void write_root_dir_block(ssfs_t *fs, int i){
+    fs->root_dir_block_dirty[i] = 0;
+    write_meta_block(fs, fs->root_dir_start_block+i, fs->dir_map[i], &fs->root_dir[i*dir_entries_per_block]);
+}
+
+/* called before entry modified of the root directory changes, like commit_i_node_file */
+int commit_root_dir(ssfs_t *fs, int modified){
+    int i, block_index, dir_block;
     if(modified != -1)
     {
-    	if(wm[sp.root.pointer[modified/(block_size/sizeof(i_node))]] == readonly)
+        dir_block = modified/(fs->block_size/sizeof(dir_entry));
+        if(!fs->root_dir_loaded) load_root_dir(fs);
+        pthread_mutex_lock(&fs->meta_lock);
+    	if(is_readonly(fs, fs->dir_map[dir_block]))
     	{
-    		if((block_index = unused_block()) <0 ) return -1;
-    		fbm[block_index] = used;
-    		i_node_array[0].pointer[modified/(block_size/sizeof(dir_entry))] = block_index;		
+    		if((block_index = unused_block(fs)) <0 ) { pthread_mutex_unlock(&fs->meta_lock); return -1; }
+            drop_ref(fs, fs->dir_map[dir_block]);
+    		fs->dir_map[dir_block] = block_index;		
+            fs->sp_dirty = 1;
     	}
+        fs->root_dir_block_dirty[dir_block] = 1;
+        pthread_mutex_unlock(&fs->meta_lock);
     	return 0;
     }
-   
-    for(i=0;i<root_dir_block_num;i++){
-        for(j=0;j<block_size/sizeof(dir_entry);j++){
-            if(k>=max_file_num) break;
-            array[i][j].i_node_index = root_dir[k].i_node_index;
-            strcpy(array[i][j].filename, root_dir[k].filename);
-            k++;
-        }
-        memcpy(buffer, &array[i], block_size);
-        if( write_blocks(i_node_array[0].pointer[i], 1, buffer) < 0) exit(EXIT_FAILURE);        
+    for(i=0;i<fs->root_dir_block_num;i++){ write_root_dir_block(fs, i); }
+    return 0;
+}
+
+/* writes only the metadata blocks modified since the last commit, as one transaction of the journal */
+void write_metadata(ssfs_t *fs){
+    int i;
+    pthread_mutex_lock(&fs->meta_lock);
+    fs->meta_last_op_bytes = 0;
+    /* first: a block an indirect block points at was claimed before it was bound, so the fbm logged after has it */
+    commit_indirect(fs);
+    if(fs->sp_dirty) commit_sp(fs);
+    commit_fbm(fs);
+    commit_wm(fs);
+    commit_shares(fs);
+    for(i=0;i<fs->file_block_num;i++) { if(fs->i_node_block_dirty[i]) write_i_node_block(fs, i); }
+    for(i=0;i<fs->root_dir_block_num;i++) { if(fs->root_dir_block_dirty[i]) write_root_dir_block(fs, i); }
+    fs->meta_ops++;
+    pthread_mutex_unlock(&fs->meta_lock);
+    /* only one caller at a time gets here, see commit_metadata; others can mark metadata dirty meanwhile */
+    if(fs->journal_active) journal_commit(fs);
+}
+
+/* returns once the metadata changed before the call is in the journal
+ * callers arriving while one of them is writing wait for it, and the next one writes for all of them
+ */
+void commit_metadata(ssfs_t *fs){
+    long turn, upto;
+    if(fs->meta_deferred) return;
+    pthread_mutex_lock(&fs->group_lock);
+    turn = ++fs->group_requested;
+    while(fs->group_logged < turn)
+    {
+        if(fs->group_leader) { pthread_cond_wait(&fs->group_done, &fs->group_lock); continue; }
+        fs->group_leader = 1;
+        upto = fs->group_requested;
+        pthread_mutex_unlock(&fs->group_lock);
+        write_metadata(fs);
+        pthread_mutex_lock(&fs->group_lock);
+        fs->group_logged = upto;
+        fs->group_leader = 0;
+        pthread_cond_broadcast(&fs->group_done);
+    }
+    pthread_mutex_unlock(&fs->group_lock);
+}
+
+/* forget the dirty bits, e.g. after loading or writing all the metadata */
+void clear_metadata_dirty(ssfs_t *fs){
+    memset(fs->i_node_block_dirty, 0, fs->file_block_num);
+    memset(fs->root_dir_block_dirty, 0, fs->root_dir_block_num);
+    memset(fs->fbm_block_dirty, 0, fs->bitmap_block_num);
+    memset(fs->wm_block_dirty, 0, fs->bitmap_block_num);
+    memset(fs->share_block_dirty, 0, fs->share_block_num);
+    fs->sp_dirty = 0;
+}
+
+void ssfs_metadata_stats_r(ssfs_t *fs, long *bytes_written, long *operations, long *last_op_bytes){
+    if(bytes_written != NULL) *bytes_written = fs->meta_bytes_written;
+    if(operations != NULL) *operations = fs->meta_ops;
+    if(last_op_bytes != NULL) *last_op_bytes = fs->meta_last_op_bytes;
+}
+
+/* write a cached block back to the disk if it has been modified */
+int cache_write_back(ssfs_t *fs, cache_entry *e){
+    if(e->block == -1 || !e->dirty) return 0;
+    if( disk_write(fs, e->block, 1, e->data) < 0) return -1;
+    e->dirty = 0;
+    return 0;
+}
+
+/* (re)allocate the cache with the given capacity, dropping whatever it held */
+void cache_init(ssfs_t *fs, int capacity){
+    int i;
+    if(fs->cache != NULL){
+        for(i=0;i<fs->cache_capacity;i++) free(fs->cache[i].data);
+        free(fs->cache);
+    }
+    fs->cache_capacity = capacity;
+    fs->cache = (cache_entry *)malloc(fs->cache_capacity*sizeof(cache_entry));
+    for(i=0;i<fs->cache_capacity;i++){
+        fs->cache[i].block = -1;
+        fs->cache[i].dirty = fs->cache[i].ref = fs->cache[i].pins = fs->cache[i].prefetched = 0;
+        fs->cache[i].data = (char *)malloc(fs->block_size);
     }
+    for(i=0;i<fs->num_blocks;i++) { fs->cache_index[i] = -1; }
+    fs->cache_hand = fs->cache_pinned = 0;
+}
+
+/* write every dirty block back to the disk, the caller holds cache_lock
+ * the writes are queued together and waited for once
+ */
+int cache_write_all(ssfs_t *fs){
+    int i;
+    aio_batch batch;
+    if(fs->cache == NULL) return 0;
+    aio_batch_init(&batch);
+    for(i=0;i<fs->cache_capacity;i++) { if(fs->cache[i].block != -1 && fs->cache[i].dirty) aio_submit(&fs->aio, &batch, queued_write, fs, fs->cache[i].block, 1, fs->cache[i].data); }
+    if( aio_wait(&fs->aio, &batch) <0 ) return -1;
+    for(i=0;i<fs->cache_capacity;i++) { fs->cache[i].dirty = 0; }
+    return 0;
+}
+
+/* write every dirty block back to the disk */
+int cache_flush(ssfs_t *fs){
+    int r;
+    lock_cache(fs);
+    r = cache_write_all(fs);
+    unlock_cache(fs);
+    return r;
+}
+
+/* forget a block without writing it back, e.g. when it is freed */
+void cache_drop(ssfs_t *fs, int block){
+    if(fs->cache == NULL || fs->disk_backend == SSFS_BACKEND_MMAP || block<0 || block>=fs->num_blocks) return;
+    lock_cache(fs);
+    if(fs->cache_index[block] != -1){
+        fs->cache[fs->cache_index[block]].block = -1;
+        fs->cache[fs->cache_index[block]].dirty = 0;
+        fs->cache_index[block] = -1;
+    }
+    unlock_cache(fs);
+}
+
+/* pick an entry to reuse with the CLOCK algorithm, writing its old block back if it is dirty */
+cache_entry *cache_evict(ssfs_t *fs){
+    cache_entry *e;
+    int k;
+    /* two sweeps clear every reference bit, so a third finding nothing means everything is pinned */
+    for(k=0;k<3*fs->cache_capacity;k++){
+        e = &fs->cache[fs->cache_hand];
+        fs->cache_hand = (fs->cache_hand+1)%fs->cache_capacity;
+        if(e->pins) continue;
+        if(e->block == -1) return e;
+        if(e->ref) { e->ref = 0; continue; }
+        if( cache_write_back(fs, e) <0 ) return NULL;
+        fs->cache_index[e->block] = -1;
+        e->block = -1;
+        return e;
+    }
+    return NULL;
+}
+
+/* returns the cached copy of a block, reading it from the disk on a miss if load is set
+ * NULL if the block cannot be brought in
+ * the caller holds cache_lock for as long as it uses the copy
+ */
+char *cache_get(ssfs_t *fs, int block, int load){
+    cache_entry *e;
+    if(block<0 || block>=fs->num_blocks) return NULL;
+    /* a mapped image is its own cache: hand out the block where it lives */
+    if(fs->disk_backend == SSFS_BACKEND_MMAP) { __atomic_fetch_add(&fs->cache_hits, 1, __ATOMIC_RELAXED); return mmap_block(&fs->disk, block); }
+    if(fs->cache == NULL) cache_init(fs, fs->cache_capacity);
+    if(fs->cache_index[block] != -1){
+        fs->cache_hits++;
+        e = &fs->cache[fs->cache_index[block]];
+        e->ref = 1;
+        if(e->prefetched) { fs->ra_hits++; e->prefetched = 0; }
+        return e->data;
+    }
+    fs->cache_misses++;
+    if((e = cache_evict(fs)) == NULL) return NULL;
+    if(load && disk_read(fs, block, 1, e->data) < 0) return NULL;
+    e->block = block;
+    e->dirty = e->prefetched = 0;
+    e->ref = 1;
+    fs->cache_index[block] = e-fs->cache;
+    return e->data;
+}
+
+/* returns the # blocks from start on, up to n, that are not in the cache
+ * they can be read around the cache: only operations holding the lock of their file bring them in,
+ * and only one holding it for writing can modify them
+ */
+int cache_miss_run(ssfs_t *fs, int start, int n){
+    int k;
+    if(fs->cache == NULL || fs->disk_backend == SSFS_BACKEND_MMAP) return n;
+    lock_cache(fs);
+    for(k=0;k<n && fs->cache_index[start+k] == -1;k++);
+    unlock_cache(fs);
+    return k;
+}
+
+/* puts blocks start..start+n-1, read into buf by readahead, into the cache unless they are cached already
+ * it runs on an aio worker, which must not wait for cache_lock: its holder may be waiting for the workers,
+ * so the blocks are dropped if the lock is taken
+ */
+void cache_fill(ssfs_t *fs, int start, int n, char *buf){
+    cache_entry *e;
+    int k;
+    if(pthread_mutex_trylock(&fs->cache_lock) != 0) return;
+    if(fs->cache == NULL) cache_init(fs, fs->cache_capacity);
+    for(k=0;k<n;k++){
+        if(fs->cache_index[start+k] != -1) continue;
+        if((e = cache_evict(fs)) == NULL) break;
+        memcpy(e->data, buf+k*fs->block_size, fs->block_size);
+        e->block = start+k;
+        e->dirty = 0;
+        /* not yet read, so it should not be the first to go */
+        e->ref = 1;
+        e->prefetched = 1;
+        fs->cache_index[start+k] = e-fs->cache;
+        fs->ra_issued++;
+    }
+    pthread_mutex_unlock(&fs->cache_lock);
+}
+
+/* the aio request of readahead: reads the blocks into buffer, puts them in the cache and frees buffer
+ * a failed read is not reported, the blocks are read again when they are needed
+ */
+int queued_readahead(void *fs, int start_address, int nblocks, void *buffer){
+    if( disk_read((ssfs_t *)fs, start_address, nblocks, buffer) >= 0 ) cache_fill((ssfs_t *)fs, start_address, nblocks, (char *)buffer);
     free(buffer);
     return 0;
 }
 
-int unused_block(){
+/* waits for the readahead queued for the blocks of i-node i_node_number, for every file with -1 */
+void wait_readahead(ssfs_t *fs, int i_node_number){
     int i;
-    for(i=data_start_block;i<num_blocks-data_start_block;i++) { if(fbm[i]==unused) return i; }
+    if(fs->ra_batch == NULL) return;
+    if(i_node_number != -1) { aio_wait(&fs->aio, &fs->ra_batch[i_node_number]); return; }
+    for(i=0;i<fs->max_file_num;i++) { aio_wait(&fs->aio, &fs->ra_batch[i]); }
+}
+
+/* like cache_get, but the block stays in the cache until cache_unpin
+ * *entry is set to the cache entry to hand to cache_unpin, -1 when nothing needs unpinning
+ */
+char *cache_pin(ssfs_t *fs, int block, int *entry){
+    char *data;
+    lock_cache(fs);
+    data = cache_get(fs, block, 1);
+    *entry = -1;
+    if(data != NULL && fs->disk_backend != SSFS_BACKEND_MMAP){
+        *entry = fs->cache_index[block];
+        if(fs->cache[*entry].pins++ == 0) fs->cache_pinned++;
+    }
+    unlock_cache(fs);
+    return data;
+}
+
+void cache_unpin(ssfs_t *fs, int entry){
+    lock_cache(fs);
+    if(entry >= 0 && entry < fs->cache_capacity && fs->cache[entry].pins > 0 && --fs->cache[entry].pins == 0) fs->cache_pinned--;
+    unlock_cache(fs);
+}
+
+void cache_mark_dirty(ssfs_t *fs, int block){
+    if(fs->disk_backend != SSFS_BACKEND_MMAP && fs->cache_index[block] != -1) fs->cache[fs->cache_index[block]].dirty = 1;
+}
+
+/* drops the indirect blocks held, e.g. when an image is mounted */
+void ind_init(ssfs_t *fs){
+    int i;
+    for(i=0;i<fs->ind_num;i++) { free(fs->ind[i].entries); free(fs->ind[i].logged); free(fs->ind[i].pending_data); }
+    free(fs->ind);
+    fs->ind = NULL;
+    fs->ind_num = fs->ind_hand = 0;
+    for(i=0;i<fs->num_blocks;i++) { fs->ind_index[i] = -1; }
+}
+
+/* returns the slot holding an indirect block, reading the block from home if load is set and it is not held
+ * a block not loaded was just allocated: its content is the caller's to fill, and it is logged whole
+ * a change to a held block is only written home from what was logged, so a crash never leaves a block
+ * pointing where the i-nodes and bitmaps of the journal do not; see commit_indirect and journal_checkpoint
+ * NULL if the block cannot be read; the caller holds ind_lock for as long as it uses the slot
+ */
+ind_block *ind_get(ssfs_t *fs, int block, int load){
+    ind_block *s = NULL;
+    int i, k;
+    if(block<0 || block>=fs->num_blocks) return NULL;
+    if((i = fs->ind_index[block]) != -1)
+    {
+        if(!load) fs->ind[i].whole = 1;
+        return &fs->ind[i];
+    }
+    /* a free slot, or once ind_capacity blocks are held one whose block neither the journal nor its home block needs */
+    for(k=0;k<fs->ind_num;k++){
+        s = &fs->ind[fs->ind_hand];
+        fs->ind_hand = (fs->ind_hand+1)%fs->ind_num;
+        if(s->block == -1 || (fs->ind_num >= ind_capacity && !s->dirty && !s->pending && !s->stale)) break;
+    }
+    if(k == fs->ind_num)
+    {
+        if((fs->ind_num & (fs->ind_num-1)) == 0 && (fs->ind = (ind_block *)realloc(fs->ind, (fs->ind_num == 0 ? 1 : 2*fs->ind_num)*sizeof(ind_block))) == NULL) exit(EXIT_FAILURE);
+        s = &fs->ind[fs->ind_num++];
+        s->entries = (int *)malloc(fs->block_size);
+        s->logged = (char *)malloc(fs->block_size);
+        s->pending_data = (char *)malloc(fs->block_size);
+    }
+    else if(s->block != -1) fs->ind_index[s->block] = -1;
+    s->block = -1;
+    s->dirty = s->pending = s->stale = 0;
+    s->whole = !load;
+    if(load)
+    {
+        if( disk_read(fs, block, 1, s->entries) <0 ) return NULL;
+        memcpy(s->logged, s->entries, fs->block_size);
+    }
+    s->block = block;
+    fs->ind_index[block] = s-fs->ind;
+    return s;
+}
+
+/* forgets an indirect block that was freed
+ * the journal may still hold what was logged of it, and replaying that onto the block once it is reused would
+ * destroy what it holds then: journal_revoked is set, and the caller checkpoints the journal before the block can be reused
+ * until the transaction freeing it commits, a crash leaves the block in use: what was logged of it goes home first,
+ * as the checkpoint no longer finds it
+ */
+void ind_drop(ssfs_t *fs, int block){
+    int i;
+    pthread_mutex_lock(&fs->ind_lock);
+    if((i = fs->ind_index[block]) != -1)
+    {
+        if(fs->ind[i].stale) write_meta_blocks(fs, block, 1, fs->ind[i].logged);
+        if(fs->ind[i].stale || fs->ind[i].pending) fs->journal_revoked = 1;
+        fs->ind[i].block = -1;
+        fs->ind_index[block] = -1;
+    }
+    pthread_mutex_unlock(&fs->ind_lock);
+}
+
+/* selects the backend used from the next mkssfs on
+ * SSFS_BACKEND_EMU goes through disk_emu, SSFS_BACKEND_MMAP maps the image into memory
+ */
+int ssfs_set_backend_r(ssfs_t *fs, int backend){
+    if(backend != SSFS_BACKEND_EMU && backend != SSFS_BACKEND_MMAP) return -1;
+    fs->next_backend = backend;
+    return 0;
+}
+
+/* gives disk_emu back if this file system holds it */
+void release_emu(ssfs_t *fs){
+    pthread_mutex_lock(&emu_lock);
+    if(emu_owner == fs) { close_disk(); emu_owner = NULL; }
+    pthread_mutex_unlock(&emu_lock);
+}
+
+/* switch to the selected backend, leaving the image of the previous one
+ * returns -1 if it is SSFS_BACKEND_EMU and disk_emu holds the image of another file system
+ */
+int select_backend(ssfs_t *fs){
+    if(fs->next_backend == SSFS_BACKEND_EMU)
+    {
+        pthread_mutex_lock(&emu_lock);
+        if(emu_owner != NULL && emu_owner != fs) { pthread_mutex_unlock(&emu_lock); return -1; }
+        emu_owner = fs;
+        pthread_mutex_unlock(&emu_lock);
+    }
+    else release_emu(fs);
+    if(fs->disk_backend == SSFS_BACKEND_MMAP) mmap_close_disk(&fs->disk);
+    fs->disk_backend = fs->next_backend;
+    return 0;
+}
+
+/* sets the # threads serving queued block I/O, 0 to do all I/O in the calling thread */
+int ssfs_aio_config_r(ssfs_t *fs, int workers){
+    pthread_rwlock_wrlock(&fs->dir_lock);
+    if(aio_start(&fs->aio, workers) <0 ) { fs->aio_running = 0; pthread_rwlock_unlock(&fs->dir_lock); return -1; }
+    fs->aio_workers = fs->aio_running = workers;
+    pthread_rwlock_unlock(&fs->dir_lock);
+    return 0;
+}
+
+/* the cache is emptied whenever its capacity changes */
+int ssfs_cache_config_r(ssfs_t *fs, int capacity){
+    if(capacity < cache_capacity_min) return -1;
+    lock_cache(fs);
+    /* the views borrowing entries would point into freed memory */
+    if(fs->cache_pinned > 0) { unlock_cache(fs); return -1; }
+    if( cache_write_all(fs) <0 ) { unlock_cache(fs); return -1; }
+    cache_init(fs, capacity);
+    unlock_cache(fs);
+    return 0;
+}
+
+void ssfs_cache_stats_r(ssfs_t *fs, long *hits, long *misses){
+    if(hits != NULL) *hits = fs->cache_hits;
+    if(misses != NULL) *misses = fs->cache_misses;
+}
+
+void ssfs_cache_reset_stats_r(ssfs_t *fs){
+    fs->cache_hits = fs->cache_misses = fs->ra_issued = fs->ra_hits = 0;
+}
+
+void ssfs_readahead_stats_r(ssfs_t *fs, long *issued, long *hits){
+    if(issued != NULL) *issued = fs->ra_issued;
+    if(hits != NULL) *hits = fs->ra_hits;
+}
+
+/* returns the first unused block at or after from
+ * -1 if there is none
+ */
+int unused_block_from(ssfs_t *fs, int from){
+    int w = from/64, s, k, block = -1;
+    long words = 1;     // # words of the fbm and its summary looked at
+    uint64_t bits, word;
+    if(from >= fs->num_blocks) return -1;
+    bits = __atomic_load_n(&fs->fbm[w], __ATOMIC_RELAXED) & (~0ULL << (from%64));
+    if(bits) block = w*64 + __builtin_ctzll(bits);
+    /* skip over the words without an unused block using the summary */
+    w++;
+    for(s=w/64;block<0 && s<summary_words;s++){
+        bits = __atomic_load_n(&fs->fbm_summary[s], __ATOMIC_RELAXED);
+        words++;
+        if(s == w/64) bits &= ~0ULL << (w%64);
+        for(;bits && block<0;bits&=bits-1){
+            k = s*64 + __builtin_ctzll(bits);
+            words++;
+            /* the word may have filled up since the summary was read */
+            if((word = __atomic_load_n(&fs->fbm[k], __ATOMIC_RELAXED)) != 0) block = k*64 + __builtin_ctzll(word);
+        }
+    }
+    stat_add(&my_stats(fs)->alloc_words, words);
+    return block;
+}
+
+/* claims an unused block and returns it, searching next-fit from where the last search ended
+ * -1 if all the blocks are taken
+ */
+int unused_block(ssfs_t *fs){
+    int block, pass, from = __atomic_load_n(&fs->fbm_cursor, __ATOMIC_RELAXED);
+    stat_add(&my_stats(fs)->alloc_scans, 1);
+    for(pass=0;pass<3;pass++){
+        while((block = unused_block_from(fs, from)) >= 0){
+            /* another thread may claim it first */
+            if(claim_block(fs, block)) { __atomic_store_n(&fs->fbm_cursor, block+1, __ATOMIC_RELAXED); return block; }
+            from = block+1;
+        }
+        /* wrap around once, then once more after rebuilding a summary that a race may have left stale */
+        if(pass == 1) rebuild_fbm_summary(fs);
+        from = fs->data_start_block;
+    }
+    return -1;
+}
+
+/* returns the # consecutive unused blocks starting at block, up to max */
+int unused_run_length(ssfs_t *fs, int block, int max){
+    int len = 0, off, k;
+    uint64_t bits;
+    while(len < max && block+len < fs->num_blocks){
+        off = (block+len)%64;
+        bits = ~(__atomic_load_n(&fs->fbm[(block+len)/64], __ATOMIC_RELAXED) >> off);
+        k = bits ? __builtin_ctzll(bits) : 64;
+        if(k > 64-off) k = 64-off;
+        len += k;
+        if(k < 64-off) break;
+    }
+    if(len > max) len = max;
+    if(block+len > fs->num_blocks) len = fs->num_blocks-block;
+    return len;
+}
+
+/* allocates n consecutive blocks and returns the first one
+ * -1 if there is no run that long
+ */
+int alloc_contiguous(ssfs_t *fs, int n){
+    int pass, from, block, len, k;
+    if(n <= 0) return -1;
+    stat_add(&my_stats(fs)->alloc_scans, 1);
+    for(pass=0;pass<2;pass++){
+        from = pass==0 ? __atomic_load_n(&fs->fbm_cursor, __ATOMIC_RELAXED) : fs->data_start_block;
+        while((block = unused_block_from(fs, from)) >= 0){
+            if(pass == 1 && block >= __atomic_load_n(&fs->fbm_cursor, __ATOMIC_RELAXED)) break;
+            if((len = unused_run_length(fs, block, n)) == n){
+                for(k=0;k<n && claim_block(fs, block+k);k++);
+                if(k == n) { __atomic_store_n(&fs->fbm_cursor, block+n, __ATOMIC_RELAXED); return block; }
+                /* another thread took block+k: give the rest back and search on */
+                while(--k >= 0) { mark_unused(fs, block+k); }
+                len = 1;
+            }
+            from = block+len;
+        }
+    }
     return -1;
 }
 
-int unused_i_node(){
+int unused_i_node(ssfs_t *fs){
     int i=0;
-    for(i=0;i<max_file_num;i++) { 
-        if(i_node_array[i].size == -1) return i; 
+    for(i=0;i<fs->max_file_num;i++) { 
+        if(i_node_at(fs, i)->size == -1) return i; 
     }
     return -1;
 }
 
-int unused_fd_entry(){
-    int i=0; for(i=0;i<max_file_num;i++) { if(fd_table[i].i_node_number==-1) return i; }
+int unused_fd_entry(ssfs_t *fs){
+    int i=0; for(i=0;i<fs->max_file_num;i++) { if(fs->fd_table[i].i_node_number==-1) return i; }
     return -1;
 }
 
-int unused_dir_entry(){
-   //load_root_dir();
-    int i=0; for(i=0;i<max_file_num;i++) { if(root_dir[i].i_node_index==-1) return i; }
+int unused_dir_entry(ssfs_t *fs){
+    if(!fs->root_dir_loaded) load_root_dir(fs);
+    int i=0; for(i=0;i<fs->max_file_num;i++) { if(fs->root_dir[i].i_node_index==-1) return i; }
     return -1;
 }
 
-int write_file_to_blocks(int nblocks, void *buf, int *pointer){ 
+int write_file_to_blocks(ssfs_t *fs, int nblocks, void *buf, int *pointer){ 
     int i, block_index;
     for(i=0;i<nblocks;i++){
-        if((block_index = unused_block()) <0 ) {return -1;}
-        if( write_blocks(block_index, 1, buf) < 0) return -1;
-        fbm[block_index] = used;
-        buf += block_size;
+        if((block_index = unused_block(fs)) <0 ) {return -1;}
+        if( disk_write(fs, block_index, 1, buf) < 0) return -1;
+        buf += fs->block_size;
         pointer[i] = block_index;      
     }
     return 0;
 }
 
-int find_block_to_write(int i_node_number, int block){
-    int k=0, block_to_write, new_i_node;
-    for(k=0;k<14;k++) { if(i_node_array[i_node_number].pointer[k] == block) break; }                
-    /* if the write pointer is in the block pointed to by the last direct pointer  
-     * and the indirect pointer is not used
-     */
-    if(k==13 && i_node_array[i_node_number].pointer[14]==-1)
-    {
-        /* create an i-node pointed to by the indirected pointer */
-        new_i_node = unused_i_node(); block_to_write = unused_block();    
-        if( block_to_write <0 || new_i_node <0 ) { printf("write overflow\n"); return -1;} 
-       
-        i_node_array[i_node_number].pointer[14] = new_i_node;
-        i_node_array[new_i_node].size = 0;
-        i_node_array[new_i_node].pointer[0] = block_to_write;
-        int i; for(i=1;i<15;i++){ i_node_array[new_i_node].pointer[i] = -1; }
-    }
-    /* if the write pointer is in the block pointed to by the last direct pointer
-     * and the indirect pointer is used
-     */
-    else if(k==13 && i_node_array[i_node_number].pointer[14]!=-1)
+/* returns entry n of an indirect block; if set is not -1, the entry is set to it first */
+int indirect_entry(ssfs_t *fs, int block, int n, int set){
+    ind_block *s;
+    int entry;
+    pthread_mutex_lock(&fs->ind_lock);
+    if((s = ind_get(fs, block, 1)) == NULL) exit(EXIT_FAILURE);
+    if(set != -1) { s->entries[n] = set; s->dirty = 1; }
+    entry = s->entries[n];
+    pthread_mutex_unlock(&fs->ind_lock);
+    return entry;
+}
+
+/* marks entry n of an indirect block unused */
+void clear_indirect_entry(ssfs_t *fs, int block, int n){
+    ind_block *s;
+    pthread_mutex_lock(&fs->ind_lock);
+    if((s = ind_get(fs, block, 1)) == NULL) exit(EXIT_FAILURE);
+    s->entries[n] = -1;
+    s->dirty = 1;
+    pthread_mutex_unlock(&fs->ind_lock);
+}
+
+/* returns a newly allocated indirect block with all entries unused
+ * -1 if the disk is full
+ */
+int new_indirect_block(ssfs_t *fs){
+    ind_block *s;
+    int i, block;
+    if((block = unused_block(fs)) <0 ) return -1;
+    pthread_mutex_lock(&fs->ind_lock);
+    s = ind_get(fs, block, 0);
+    for(i=0;i<pointers_per_block;i++) { s->entries[i] = -1; }
+    s->dirty = 1;
+    pthread_mutex_unlock(&fs->ind_lock);
+    return block;
+}
+
+/* finds the level of the radix tree covering the index-th block of a file,
+ * leaving index relative to the first block of that level and span the # blocks each pointer of the top indirect block covers
+ * returns 0 for a direct pointer, -1 if the index is beyond the largest file
+ */
+int radix_level(ssfs_t *fs, int *index, long long *span){
+    int level;
+    if(*index < direct_pointer_num) return 0;
+    *index -= direct_pointer_num;
+    *span = 1;
+    for(level=1;level<=indirect_level_num;level++){
+        if(*index < *span*pointers_per_block) return level;
+        *index -= *span*pointers_per_block;
+        *span *= pointers_per_block;
+    }
+    return -1;
+}
+
+/* returns the level of the block pointer[p] of an i-node points at, 0 for a data block */
+int pointer_level(int p) { return p < direct_pointer_num ? 0 : p-direct_pointer_num+1; }
+
+/* returns the index in the file of the first block reached through pointer[p] of an i-node */
+long long pointer_index(ssfs_t *fs, int p){
+    long long index = p < direct_pointer_num ? p : direct_pointer_num, span = 1;
+    int level;
+    for(level=1;level<pointer_level(p);level++){ span *= pointers_per_block; index += span; }
+    return index;
+}
+
+/* returns the block holding the index-th block of the file associated with this i-node
+ * -1 if the file has no such block; at most indirect_level_num indirect blocks are read on the way
+ */
+int lookup_block(ssfs_t *fs, int i_node_number, int index){
+    int *pointer = i_node_at(fs, i_node_number)->pointer, level, top;
+    long long span;
+    if(index < 0 || is_inline(pointer) || (level = radix_level(fs, &index, &span)) < 0) return -1;
+    if(level == 0) return pointer[index];
+    top = pointer[direct_pointer_num+level-1];
+    /* walk down one indirect block per level */
+    while(top != -1 && level > 0){
+        top = indirect_entry(fs, top, (int)(index/span), -1);
+        index %= span;
+        span /= pointers_per_block;
+        level--;
+    }
+    return top;
+}
+
+/* gives the live file system its own copy of a block a checkpoint shares, see add_ref
+ * the content is copied if copy is set, as it always is for an indirect block of level > 0, whose entries gain the copy as a referrer
+ * returns the block to use from now on, block itself if it is not shared; -1 if the disk is full
+ */
+int copy_shared(ssfs_t *fs, int block, int level, int copy){
+    int k, new_block, *entries;
+    char *data, *buffer;
+    ind_block *s;
+    if(!is_readonly(fs, block)) return block;
+    if((new_block = unused_block(fs)) <0 ) return -1;
+    if(level > 0)
     {
-        /* go to the i-node pointed by the indirect pointer */
-        new_i_node = i_node_array[i_node_number].pointer[14];
-        block_to_write = i_node_array[new_i_node].pointer[0];
+        entries = (int *)malloc(fs->block_size);
+        pthread_mutex_lock(&fs->ind_lock);
+        if((s = ind_get(fs, block, 1)) == NULL) exit(EXIT_FAILURE);
+        memcpy(entries, s->entries, fs->block_size);
+        /* taken after the copy: getting a slot may move the others */
+        s = ind_get(fs, new_block, 0);
+        memcpy(s->entries, entries, fs->block_size);
+        s->dirty = 1;
+        pthread_mutex_unlock(&fs->ind_lock);
+        for(k=0;k<pointers_per_block;k++) { if(entries[k] != -1) add_ref(fs, entries[k]); }
+        free(entries);
     }
-    /* if the write pointer is not found in the blocks pointed to by the direct pointers
-     * and the indirect pointer is used
-     */
-    else if(k==14 && i_node_array[i_node_number].pointer[14]!=-1)
+    else if(copy)
     {
-        /* go to the i-node pointed by the indirect pointer */
-        new_i_node = i_node_array[i_node_number].pointer[14];
-        block_to_write = find_block_to_write(new_i_node, block);
+        buffer = (char *)malloc(fs->block_size);
+        lock_cache(fs);
+        if((data = cache_get(fs, block, 1)) == NULL) exit(EXIT_FAILURE);
+        memcpy(buffer, data, fs->block_size);
+        if((data = cache_get(fs, new_block, 0)) == NULL) exit(EXIT_FAILURE);
+        memcpy(data, buffer, fs->block_size);
+        cache_mark_dirty(fs, new_block);
+        unlock_cache(fs);
+        free(buffer);
+    }
+    drop_ref(fs, block);
+    return new_block;
+}
+
+/* gives the live file system its own copy of the block of the i-node file holding this i-node if a checkpoint shares it
+ * done before anything under the i-node changes: until then a checkpoint sharing the block shares all of the file's blocks
+ */
+int own_i_node(ssfs_t *fs, int i_node_number){
+    return is_readonly(fs, fs->root_map[i_node_number/i_nodes_per_block]) ? commit_i_node_file(fs, i_node_number) : 0;
+}
+
+/* makes the index-th block of the file associated with this i-node, and the indirect blocks leading to it, the live file system's own
+ * before it is written, copying those a checkpoint shares; the content of the block itself only if copy is set
+ * returns the block, -1 if the file has no such block or the disk is full
+ */
+int own_block(ssfs_t *fs, int i_node_number, int index, int copy){
+    int *pointer = i_node_at(fs, i_node_number)->pointer, level, slot, block, next, entry;
+    long long span;
+    if(index < 0 || is_inline(pointer) || (level = radix_level(fs, &index, &span)) < 0) return -1;
+    if( own_i_node(fs, i_node_number) <0 ) return -1;
+    slot = level == 0 ? index : direct_pointer_num+level-1;
+    if((block = pointer[slot]) == -1) return -1;
+    if((next = copy_shared(fs, block, level, copy)) != block){
+        if(next == -1 || commit_i_node_file(fs, i_node_number) <0 ) return -1;
+        pointer[slot] = next;
+    }
+    /* walk down one indirect block per level */
+    while(level > 0){
+        block = next;
+        entry = (int)(index/span);
+        index %= span;
+        span /= pointers_per_block;
+        level--;
+        if((next = indirect_entry(fs, block, entry, -1)) == -1) return -1;
+        if((slot = copy_shared(fs, next, level, copy)) != next){
+            if(slot == -1) return -1;
+            indirect_entry(fs, block, entry, slot);
+            next = slot;
+        }
+    }
+    return next;
+}
+
+/* makes block the index-th block of the file associated with this i-node,
+ * allocating the indirect blocks on the way if necessary
+ * returns -1 if the index is beyond the largest file or the disk is full
+ */
+int bind_block(ssfs_t *fs, int i_node_number, int index, int block){
+    int *pointer = i_node_at(fs, i_node_number)->pointer, level, slot, next, entry;
+    long long span;
+    if(index < 0 || is_inline(pointer) || (level = radix_level(fs, &index, &span)) < 0) return -1;
+    if( own_i_node(fs, i_node_number) <0 ) return -1;
+    if(level == 0){
+        if( commit_i_node_file(fs, i_node_number) <0 ) return -1;
+        pointer[index] = block;
+        return 0;
+    }
+    slot = direct_pointer_num+level-1;
+    if(pointer[slot] == -1){
+        if((next = new_indirect_block(fs)) <0 ) return -1;
+        if( commit_i_node_file(fs, i_node_number) <0 ) return -1;
+        pointer[slot] = next;
     }
-    else if(k==14 && i_node_array[i_node_number].pointer[14]==-1) {printf("4\n");return -1;}
-    else 
+    /* the indirect blocks on the way are copied if a checkpoint shares them */
+    else if((next = copy_shared(fs, pointer[slot], level, 1)) != pointer[slot]){
+        if(next == -1 || commit_i_node_file(fs, i_node_number) <0 ) return -1;
+        pointer[slot] = next;
+    }
+    next = pointer[slot];
+    while(level > 1){
+        int parent = next, child;
+        entry = (int)(index/span);
+        if((child = indirect_entry(fs, parent, entry, -1)) == -1){
+            if((next = new_indirect_block(fs)) <0 ) return -1;
+            indirect_entry(fs, parent, entry, next);
+        }
+        else if((next = copy_shared(fs, child, level-1, 1)) != child){
+            if(next == -1) return -1;
+            indirect_entry(fs, parent, entry, next);
+        }
+        index %= span;
+        span /= pointers_per_block;
+        level--;
+    }
+    indirect_entry(fs, next, index, block);
+    return 0;
+}
+
+/* returns the index-th block of the file associated with this i-node
+ * if it does not exist and alloc is set, a new block is allocated for it
+ * -1 if the block does not exist and cannot be allocated
+ */
+int map_block(ssfs_t *fs, int i_node_number, int index, int alloc){
+    int block = lookup_block(fs, i_node_number, index);
+    if(block != -1 || !alloc) return block;
+    if((block = unused_block(fs)) <0 ) return -1;
+    if( bind_block(fs, i_node_number, index, block) <0 ) { mark_unused(fs, block); return -1; }
+    return block;
+}
+
+/* makes sure blocks index..index+n-1 of the file exist, taking the missing ones from one
+ * contiguous run when the disk has one; files only grow at the end so the missing ones are a suffix
+ * returns -1 if the blocks cannot be bound to the file
+ */
+int reserve_blocks(ssfs_t *fs, int i_node_number, int index, int n){
+    int k, first = index, block;
+    while(first < index+n && lookup_block(fs, i_node_number, first) != -1) first++;
+    if(first == index+n) return 0;
+    /* without a long enough run, write_at allocates one block at a time through map_block */
+    if((block = alloc_contiguous(fs, index+n-first)) <0 ) return 0;
+    for(k=0;first+k<index+n;k++){
+        if( bind_block(fs, i_node_number, first+k, block+k) <0 ){
+            for(;first+k<index+n;k++) { mark_unused(fs, block+k); }
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* frees a block of a file; during a batch it stays used until the batch commits,
+ * so that no later operation of the batch writes over it while the image still has the file pointing at it
+ */
+void free_file_block(ssfs_t *fs, int block){
+    if(fs->meta_deferred) fs->batch_freed[fs->batch_freed_num++] = block;
+    else mark_unused(fs, block);
+}
+
+/* drops a reference to a block, freeing it if it was the last one */
+void release_block(ssfs_t *fs, int block){
+    if(!drop_ref(fs, block)) return;
+    free_file_block(fs, block);
+    cache_drop(fs, block);
+}
+
+/* drops a reference to an indirect block, freeing it and dropping its references if it was the last one;
+ * level 1 points straight at data blocks
+ */
+void release_indirect_block(ssfs_t *fs, int block, int level){
+    int k, entry;
+    if(!drop_ref(fs, block)) return;
+    for(k=0;k<pointers_per_block;k++){
+        if((entry = indirect_entry(fs, block, k, -1)) == -1) continue;
+        if(level > 1) release_indirect_block(fs, entry, level-1);
+        else release_block(fs, entry);
+    }
+    ind_drop(fs, block);
+    free_file_block(fs, block);
+}
+
+/* drops the references of an i-node to its blocks */
+void release_pointers(ssfs_t *fs, int *pointer){
+    int k;
+    if(is_inline(pointer)) return;
+    for(k=0;k<direct_pointer_num;k++){ if(pointer[k] != -1) release_block(fs, pointer[k]); }
+    for(k=0;k<indirect_level_num;k++){
+        if(pointer[direct_pointer_num+k] != -1) release_indirect_block(fs, pointer[direct_pointer_num+k], k+1);
+    }
+}
+
+/* frees every block of the file associated with this i-node that no checkpoint holds, including its indirect blocks
+ * the caller has made the i-node the live file system's own, see own_i_node
+ */
+void release_file_blocks(ssfs_t *fs, int i_node_number){
+    release_pointers(fs, i_node_at(fs, i_node_number)->pointer);
+}
+
+/* drops a map's reference to the i-th block of the i-node file, and the references of its i-nodes if it was the last one
+ * the block is read from the disk: the caller has checkpointed the journal
+ */
+void release_i_node_block(ssfs_t *fs, int block, int i){
+    i_node *i_nodes;
+    int k;
+    if(!drop_ref(fs, block)) return;
+    i_nodes = (i_node *)malloc(fs->block_size);
+    if( disk_read(fs, block, 1, i_nodes) < 0) exit(EXIT_FAILURE);
+    for(k=i==0;k<i_nodes_per_block && i*i_nodes_per_block+k<fs->max_file_num;k++) { if(i_nodes[k].size != -1) release_pointers(fs, i_nodes[k].pointer); }
+    free(i_nodes);
+    mark_unused(fs, block);
+}
+
+/* drops the references of a map to the i-node file and root directory it holds */
+void release_map(ssfs_t *fs, int *map){
+    int i;
+    for(i=0;i<fs->file_block_num;i++) { release_i_node_block(fs, map[i], i); }
+    for(i=fs->file_block_num;i<fs->map_len;i++) { release_block(fs, map[i]); }
+}
+
+/* images written before the radix layout chain a whole i-node through pointer[14]
+ * every 14 blocks; move each file onto indirect blocks and give the chained i-nodes back
+ */
+void upgrade_chained_i_nodes(ssfs_t *fs){
+    int i, k, n, next, *blocks = (int *)malloc(fs->num_blocks*sizeof(int));
+    load_root_dir(fs);
+    for(i=1;i<fs->max_file_num;i++){
+        int head = fs->root_dir[i].i_node_index, cur;
+        if(head == -1) continue;
+        n = 0;
+        for(cur=head;cur!=-1;cur=next){
+            for(k=0;k<14;k++) { if(i_node_at(fs, cur)->pointer[k] != -1) blocks[n++] = i_node_at(fs, cur)->pointer[k]; }
+            next = i_node_at(fs, cur)->pointer[14];
+            if(cur != head) i_node_at(fs, cur)->size = -1;
+            for(k=0;k<15;k++) { i_node_at(fs, cur)->pointer[k] = -1; }
+        }
+        for(k=0;k<n;k++) { if( bind_block(fs, head, k, blocks[k]) <0 ) exit(EXIT_FAILURE); }
+    }
+    free(blocks);
+    commit_i_node_file(fs, -1); commit_indirect(fs);
+}
+
+/* what upgrade_shares knows of a block: where the first reference it found puts it */
+typedef struct upgrade_owner{
+    int i_node_number;      // -1 for a block of the i-node file or root directory, -2 while the block is not found yet
+    long long position;     // 4 times the index of the first file block under it plus its level, or its index in the map
+}upgrade_owner;
+
+/* moves a block out of the blocks of the share counts for upgrade_shares; returns where it is now */
+int upgrade_move(ssfs_t *fs, int block, int *moved){
+    char *buffer;
+    if(block < fs->share_start_block || block >= fs->share_start_block+fs->share_block_num) return block;
+    if(moved[block-fs->share_start_block] == -1)
     {
-        if(i_node_array[i_node_number].pointer[k+1]==-1)
-        {
-            block_to_write = unused_block();
-            if(block_to_write <0 ) return -1;
-            i_node_array[i_node_number].pointer[k+1] = block_to_write;          
+        buffer = (char *)malloc(fs->block_size);
+        if((moved[block-fs->share_start_block] = unused_block(fs)) <0 ) exit(EXIT_FAILURE);
+        if( disk_read(fs, block, 1, buffer) <0 || disk_write(fs, moved[block-fs->share_start_block], 1, buffer) <0 ) exit(EXIT_FAILURE);
+        free(buffer);
+    }
+    return moved[block-fs->share_start_block];
+}
+
+/* counts a reference found by upgrade_shares to a block at a position of the i-node file or root directory (i_node_number -1)
+ * or of a file; returns 1 the first time the block is found, -1 if the block is somewhere else already:
+ * older images freed the blocks of a file a checkpoint held, and a later file may have taken them
+ */
+int upgrade_ref(ssfs_t *fs, int block, int i_node_number, long long position, upgrade_owner *owner){
+    if(owner[block].i_node_number == -2)
+    {
+        owner[block].i_node_number = i_node_number;
+        owner[block].position = position;
+        /* a checkpoint may still refer to a block freed since */
+        claim_block(fs, block);
+        return 1;
+    }
+    if(owner[block].i_node_number != i_node_number || owner[block].position != position) return -1;
+    add_ref(fs, block);
+    return 0;
+}
+
+/* counts the references to a data block (level 0) or an indirect block, the first index of the file under it at index,
+ * and those of its entries the first time
+ * returns where the block is now, -1 for a pointer to drop
+ */
+int upgrade_tree(ssfs_t *fs, int block, int level, int i_node_number, long long index, upgrade_owner *owner, int *moved){
+    int k, entry, now, found;
+    long long span = 1;
+    if(block < fs->data_start_block || block >= fs->num_blocks) return -1;
+    block = upgrade_move(fs, block, moved);
+    if((found = upgrade_ref(fs, block, i_node_number, 4*index+level, owner)) != 1) return found == 0 ? block : -1;
+    for(k=1;k<level;k++) { span *= pointers_per_block; }
+    for(k=0;level>0 && k<pointers_per_block;k++){
+        if((entry = indirect_entry(fs, block, k, -1)) == -1) continue;
+        if((now = upgrade_tree(fs, entry, level-1, i_node_number, index+k*span, owner, moved)) == -1) clear_indirect_entry(fs, block, k);
+        else if(now != entry) indirect_entry(fs, block, k, now);
+    }
+    return block;
+}
+
+/* counts a reference to the i-th block of the i-node file or root directory in a map, and those of its i-nodes the first time
+ * returns where the block is now
+ */
+int upgrade_map_block(ssfs_t *fs, int block, int i, upgrade_owner *owner, int *moved){
+    i_node *i_nodes;
+    int k, p, now, changed = 0;
+    block = upgrade_move(fs, block, moved);
+    if(upgrade_ref(fs, block, -1, i, owner) != 1 || i >= fs->file_block_num) return block;
+    i_nodes = (i_node *)malloc(fs->block_size);
+    if( disk_read(fs, block, 1, i_nodes) < 0) exit(EXIT_FAILURE);
+    for(k=i==0;k<i_nodes_per_block && i*i_nodes_per_block+k<fs->max_file_num;k++){
+        if(i_nodes[k].size == -1) continue;
+        for(p=0;p<15;p++){
+            if(i_nodes[k].pointer[p] == -1) continue;
+            now = upgrade_tree(fs, i_nodes[k].pointer[p], pointer_level(p), i*i_nodes_per_block+k, pointer_index(fs, p), owner, moved);
+            if(now != i_nodes[k].pointer[p]) { i_nodes[k].pointer[p] = now; changed = 1; }
         }
-        else block_to_write = i_node_array[i_node_number].pointer[k+1];
     }
-    fbm[block_to_write] = used;
-    return block_to_write;
+    if(changed) write_meta_blocks(fs, block, 1, i_nodes);
+    free(i_nodes);
+    return block;
+}
+
+/* images of ssfs_chained_magic share blocks between checkpoints without counting the references:
+ * count them by walking the live file system, then the checkpoints from the newest, each block once,
+ * and take the blocks of the share counts, moving what is in them elsewhere
+ * a checkpoint's pointer to a block found in another place is dropped
+ */
+void upgrade_shares(ssfs_t *fs){
+    upgrade_owner *owner = (upgrade_owner *)malloc(fs->num_blocks*sizeof(upgrade_owner));
+    int *moved = (int *)malloc(fs->share_block_num*sizeof(int)), *map, i, k;
+    for(k=0;k<fs->num_blocks;k++) { owner[k].i_node_number = -2; }
+    for(k=0;k<fs->share_block_num;k++) { moved[k] = -1; claim_block(fs, fs->share_start_block+k); }
+    /* the wm is made again from the counts */
+    for(k=0;k<fs->num_blocks;k++) { mark_writeable(fs, k); }
+    if( cache_flush(fs) <0 ) exit(EXIT_FAILURE);
+    for(i=max_restore_time;i>=0;i--){
+        if(i < max_restore_time && !fs->sp.shadow_used[i]) continue;
+        map = i == max_restore_time ? fs->root_map : shadow_map(fs, i);
+        for(k=0;k<fs->map_len;k++) { map[k] = upgrade_map_block(fs, map[k], k, owner, moved); }
+    }
+    commit_indirect(fs);
+    memset(fs->share_block_dirty, 1, fs->share_block_num);
+    unload_metadata(fs);
+    free(owner); free(moved);
+}
+
+/* returns # chars written
+ * -1 if the writing beyond boundary 
+ */
+int writes_block_by_char(ssfs_t *fs, int block_to_write, int offset, char *buf, int length){
+    if(length<0 || offset+length > fs->block_size) return -1;
+    lock_cache(fs);
+    /* a write covering the whole block does not need the old content */
+    char *a_block = cache_get(fs, block_to_write, length != fs->block_size);
+    if(a_block == NULL) exit(EXIT_FAILURE);
+    memcpy(a_block+offset, buf, length);
+    cache_mark_dirty(fs, block_to_write);
+    unlock_cache(fs);
+    mark_used(fs, block_to_write);
+    return length;
+}
+
+int reads_block_by_char(ssfs_t *fs, int block_to_read, int offset, char *buf, int length){  
+    if(length<0 || offset+length > fs->block_size) return -1;
+    lock_cache(fs);
+    char *a_block = cache_get(fs, block_to_read, 1);
+    if(a_block == NULL) exit(EXIT_FAILURE);
+    memcpy(buf, a_block+offset, length);
+    unlock_cache(fs);
+    return length;
+}
+
+/* returns -1 if the layout of the geometry does not fit in it */
+int check_geometry(ssfs_geometry *g){
+    int bs = g->block_size;
+    long long inode_blocks, dir_blocks, map_bytes, bitmap_blocks, share_blocks;
+    if(bs < block_size_min || bs > block_size_max || (bs & (bs-1)) != 0 || g->num_blocks <= 0 || g->max_files < 2) return -1;
+    inode_blocks = ((long long)g->max_files*sizeof(i_node)+bs-1)/bs;
+    dir_blocks = ((long long)g->max_files*sizeof(dir_entry)+bs-1)/bs;
+    map_bytes = sizeof(superblock)+(long long)(max_restore_time+1)*(inode_blocks+dir_blocks)*sizeof(int);
+    bitmap_blocks = (((long long)g->num_blocks+63)/64*8+bs-1)/bs;
+    share_blocks = ((long long)g->num_blocks+bs-1)/bs;
+    /* room for the metadata, the share counts, the journal and at least one data block */
+    if((map_bytes+bs-1)/bs+2*bitmap_blocks+inode_blocks+dir_blocks+share_blocks+journal_block_num >= g->num_blocks) return -1;
+    return 0;
+}
+
+/* frees everything set_geometry sized to the geometry */
+void free_layout(ssfs_t *fs){
+    int i;
+    for(i=0;i<fs->max_file_num;i++) { pthread_rwlock_destroy(&fs->i_node_lock[i]); }
+    for(i=0;fs->meta_logged!=NULL && i<meta_slot_num;i++) { free(fs->meta_logged[i]); free(fs->meta_pending[i]); }
+    if(fs->cache != NULL) { for(i=0;i<fs->cache_capacity;i++) { free(fs->cache[i].data); } free(fs->cache); fs->cache = NULL; }
+    for(i=0;i<fs->ind_num;i++) { free(fs->ind[i].entries); free(fs->ind[i].logged); free(fs->ind[i].pending_data); }
+    free(fs->ind); fs->ind = NULL; fs->ind_num = 0; free(fs->ind_index); free(fs->batch_freed);
+    free(fs->fbm); free(fs->fbm_summary); free(fs->sp_image); free(fs->i_node_array); free(fs->root_dir); free(fs->i_node_block_loaded);
+    free(fs->fd_table); free(fs->dir_index); free(fs->open_fd); free(fs->cache_index); free(fs->i_node_lock); free(fs->ra_batch); fs->ra_batch = NULL;
+    free(fs->i_node_block_dirty); free(fs->root_dir_block_dirty); free(fs->fbm_block_dirty); free(fs->wm_block_dirty);
+    free(fs->share_count); free(fs->share_block_loaded); free(fs->share_block_dirty);
+    free(fs->meta_home); free(fs->meta_pending_home); free(fs->meta_logged); free(fs->meta_pending); free(fs->meta_is_pending); free(fs->meta_stale);
+    free(fs->journal_buf); fs->journal_buf = NULL; fs->journal_buf_size = 0;
+}
+
+/* derives the layout from the geometry, as mkssfs(1) lays it out:
+ * superblock and maps, fbm, wm, i-node file, root directory, data, and the journal in the last blocks
+ * everything kept per block or per i-node is sized to it, and only reallocated when the geometry changes
+ */
+void set_geometry(ssfs_t *fs, ssfs_geometry *g){
+    int i;
+    if(g->block_size == fs->block_size && g->num_blocks == fs->num_blocks && g->max_files == fs->max_file_num) return;
+    free_layout(fs);
+    fs->block_size = g->block_size;
+    fs->num_blocks = g->num_blocks;
+    fs->max_file_num = g->max_files;
+    fs->file_block_num = (fs->max_file_num*sizeof(i_node)+fs->block_size-1)/fs->block_size;
+    fs->root_dir_block_num = (fs->max_file_num*sizeof(dir_entry)+fs->block_size-1)/fs->block_size;
+    fs->map_len = fs->file_block_num+fs->root_dir_block_num;
+    fs->sp_block_num = (sizeof(superblock)+(max_restore_time+1)*fs->map_len*sizeof(int)+fs->block_size-1)/fs->block_size;
+    fs->bitmap_block_num = (bitmap_words*sizeof(uint64_t)+fs->block_size-1)/fs->block_size;
+    fs->fbm_start_block = fs->sp_start_block+fs->sp_block_num;
+    fs->wm_start_block = fs->fbm_start_block+fs->bitmap_block_num;
+    fs->file_start_block = fs->wm_start_block+fs->bitmap_block_num;
+    fs->root_dir_start_block = fs->file_start_block+fs->file_block_num;
+    fs->data_start_block = fs->root_dir_start_block+fs->root_dir_block_num;
+    fs->data_block_num = fs->num_blocks-fs->data_start_block;
+    fs->share_block_num = (fs->num_blocks+fs->block_size-1)/fs->block_size;
+    fs->share_start_block = fs->num_blocks-journal_block_num-fs->share_block_num;
+    for(fs->dir_index_size=16;fs->dir_index_size<2*fs->max_file_num;fs->dir_index_size*=2);
+    /* the fbm and wm share one allocation, the wm right after the fbm as on the disk */
+    fs->fbm = (uint64_t *)calloc(2*fs->bitmap_block_num, fs->block_size);
+    fs->wm = fs->fbm+fs->bitmap_block_num*fs->block_size/sizeof(uint64_t);
+    fs->fbm_summary = (uint64_t *)calloc(summary_words, sizeof(uint64_t));
+    fs->sp_image = (char *)calloc(fs->sp_block_num, fs->block_size);
+    fs->root_map = (int *)(fs->sp_image+sizeof(superblock));
+    fs->dir_map = fs->root_map+fs->file_block_num;
+    fs->i_node_array = (i_node *)calloc(fs->file_block_num, fs->block_size);
+    fs->root_dir = (dir_entry *)calloc(fs->root_dir_block_num, fs->block_size);
+    fs->i_node_block_loaded = (char *)calloc(fs->file_block_num, 1);
+    fs->fd_table = (fd_entry *)calloc(fs->max_file_num, sizeof(fd_entry));
+    fs->dir_index = (int *)malloc(fs->dir_index_size*sizeof(int));
+    fs->open_fd = (int *)malloc(fs->max_file_num*sizeof(int));
+    fs->cache_index = (int *)malloc(fs->num_blocks*sizeof(int));
+    fs->ind_index = (int *)malloc(fs->num_blocks*sizeof(int));
+    fs->batch_freed = (int *)malloc(fs->num_blocks*sizeof(int));
+    fs->i_node_lock = (pthread_rwlock_t *)malloc(fs->max_file_num*sizeof(pthread_rwlock_t));
+    for(i=0;i<fs->max_file_num;i++) { pthread_rwlock_init(&fs->i_node_lock[i], NULL); }
+    fs->ra_batch = (aio_batch *)malloc(fs->max_file_num*sizeof(aio_batch));
+    for(i=0;i<fs->max_file_num;i++) { aio_batch_init(&fs->ra_batch[i]); }
+    fs->i_node_block_dirty = (char *)calloc(fs->file_block_num, 1);
+    fs->root_dir_block_dirty = (char *)calloc(fs->root_dir_block_num, 1);
+    fs->fbm_block_dirty = (char *)calloc(fs->bitmap_block_num, 1);
+    fs->wm_block_dirty = (char *)calloc(fs->bitmap_block_num, 1);
+    fs->share_count = (uint8_t *)calloc(fs->share_block_num, fs->block_size);
+    fs->share_block_loaded = (char *)calloc(fs->share_block_num, 1);
+    fs->share_block_dirty = (char *)calloc(fs->share_block_num, 1);
+    fs->meta_home = (int *)malloc(meta_slot_num*sizeof(int));
+    fs->meta_pending_home = (int *)malloc(meta_slot_num*sizeof(int));
+    fs->meta_logged = (char **)calloc(meta_slot_num, sizeof(char *));
+    fs->meta_pending = (char **)calloc(meta_slot_num, sizeof(char *));
+    fs->meta_is_pending = (char *)calloc(meta_slot_num, 1);
+    fs->meta_stale = (char *)calloc(meta_slot_num, 1);
 }
 
-int find_block_to_read(int i_node_number, int block){
-    int k=0, block_to_read, new_i_node;
-    for(k=0;k<14;k++) { if(i_node_array[i_node_number].pointer[k] == block) break; }
-    
-    if(k==13 && i_node_array[i_node_number].pointer[14]==-1) return -1;
-    
-    else if(k==13 && i_node_array[i_node_number].pointer[14]!=-1)
-    {
-        new_i_node = i_node_array[i_node_number].pointer[14];
-        block_to_read = i_node_array[new_i_node].pointer[0];
-    }
-    else if(k==14 && i_node_array[i_node_number].pointer[14]!=-1)
+/* reads the geometry of the image from its superblock, opening it with the smallest block size to get there
+ * images of ssfs_chained_magic have the default geometry
+ * returns -1 if there is no image or it is not one of ours
+ */
+int read_geometry(ssfs_t *fs, char *filename, ssfs_geometry *g){
+    superblock *buffer = (superblock *)calloc(1, block_size_min);
+    int magic = 0;
+    if((fs->disk_backend == SSFS_BACKEND_MMAP ? mmap_init_disk(&fs->disk, filename, block_size_min, 1) : init_disk(filename, block_size_min, 1)) !=-1)
     {
-        new_i_node = i_node_array[i_node_number].pointer[14];
-        block_to_read = find_block_to_read(new_i_node, block);
+        if( disk_read(fs, fs->sp_start_block, 1, buffer) == 1 ) magic = buffer->magic;
+        if(fs->disk_backend == SSFS_BACKEND_MMAP) mmap_close_disk(&fs->disk);
+        else close_disk();
     }
-    else if(k==14 && i_node_array[i_node_number].pointer[14]==-1) {printf("lll\n");return -1;}
-    else
+    g->block_size = buffer->b_size; g->num_blocks = buffer->f_size; g->max_files = buffer->i_num;
+    free(buffer);
+    if(magic == ssfs_chained_magic)
     {
-        if(i_node_array[i_node_number].pointer[k+1] == -1) return -1; 
-        block_to_read = i_node_array[i_node_number].pointer[k+1];
+        g->block_size = block_size_default; g->num_blocks = num_blocks_default; g->max_files = max_file_num_default;
+        return 0;
     }
-    return block_to_read;
+    return magic == ssfs_magic ? check_geometry(g) : -1;
 }
 
-/* returns # chars written
- * -1 if the writing beyond boundary 
- */
-int writes_block_by_char(int block_to_write, int offset, char *buf, int length){
-    if(length<0 || offset+length > block_size) return -1;
-    char *a_block = (char *)malloc(block_size);
-    int j;
-    if(read_blocks(block_to_write, 1, a_block) <0 ) exit(EXIT_FAILURE);
-    for(j=0;j<length;j++){ a_block[offset+j] = buf[j]; }
-    write_blocks(block_to_write, 1, a_block);
-    free(a_block);
-    fbm[block_to_write] = used;
-    return length;
+/* sets the geometry of the image the next mkssfs(1) creates; max_files 0 takes one i-node per 4 blocks */
+int ssfs_set_geometry_r(ssfs_t *fs, ssfs_geometry *geometry){
+    ssfs_geometry g = *geometry;
+    if(g.max_files == 0) g.max_files = g.num_blocks/4;
+    if( check_geometry(&g) <0 ) return -1;
+    fs->next_geometry = g;
+    return 0;
 }
 
-int reads_block_by_char(int block_to_read, int offset, char *buf, int length){  
-    if(length<0 || offset+length > block_size) return -1;
-    char *a_block = (char *)malloc(block_size);
-    int j;
-    if(read_blocks(block_to_read, 1, a_block) <0 ) exit(EXIT_FAILURE);
-    for(j=0;j<length;j++){ buf[j] = a_block[offset+j]; }
-    free(a_block);
-    return length;
+void ssfs_get_geometry_r(ssfs_t *fs, ssfs_geometry *geometry){
+    geometry->block_size = fs->block_size;
+    geometry->num_blocks = fs->num_blocks;
+    geometry->max_files = fs->max_file_num;
 }
 
-void mkssfs(int fresh)
+int mkssfs_helper(ssfs_t *fs, int fresh)
 {
     int i, j;
-    char *filename = "yjiang28_disk";
+    char *filename = fs->filename;
+    ssfs_geometry g;
+    /* write back whatever the previous mount left in the cache, then start over empty with the new geometry */
+    if(!fresh && cache_flush(fs) <0 ) exit(EXIT_FAILURE);
+    if( select_backend(fs) <0 ) return -1;
+    if(fresh) g = fs->next_geometry;
+    else if( read_geometry(fs, filename, &g) <0 ) exit(EXIT_FAILURE);
+    set_geometry(fs, &g);
+    cache_init(fs, fs->cache_capacity);
+    ind_init(fs);
     /* set up the file descriptor table */
-    for(i=0;i<max_file_num;i++) { fd_table[i].i_node_number = -1; }
+    for(i=0;i<fs->max_file_num;i++) { fs->fd_table[i].i_node_number = -1; fs->open_fd[i] = -1; }
     if(fresh)
     {
-        if(init_fresh_disk(filename, block_size, num_blocks) ==-1) exit(EXIT_FAILURE);
+        if(fs->disk_backend == SSFS_BACKEND_MMAP && mmap_init_fresh_disk(&fs->disk, filename, fs->block_size, fs->num_blocks) ==-1) exit(EXIT_FAILURE);
+        if(fs->disk_backend == SSFS_BACKEND_EMU && init_fresh_disk(filename, fs->block_size, fs->num_blocks) ==-1) exit(EXIT_FAILURE);
         /* setup the super block*/
-        sp.magic = 0xACBD0005;
-        sp.b_size = block_size;
-        sp.f_size = num_blocks;
-        sp.i_num = max_file_num;
-        sp.root.size = file_block_num*block_size;  
-        // initialize shadow roots to be unused
-        for(i=0;i<max_restore_time;i++) {sp.shadow[i].size = -1;}
-        // set up the j-node associated with the i-node file
-        for(i=0;i<file_block_num;i++) { sp.root.pointer[i]=i+file_start_block; }
-        sp.root.size = max_file_num;    // =13
+        fs->journal_active = 0;
+        memset(fs->i_node_block_loaded, 1, fs->file_block_num);
+        fs->root_dir_loaded = 1;
+        memset(fs->sp_image, 0, fs->sp_block_num*fs->block_size);
+        fs->sp.magic = ssfs_magic;
+        fs->sp.journal_start = fs->num_blocks-journal_block_num;
+        fs->sp.journal_blocks = journal_block_num;
+        fs->sp.b_size = fs->block_size;
+        fs->sp.f_size = fs->num_blocks;
+        fs->sp.i_num = fs->max_file_num;
+        // initialize shadow maps to be unused
+        for(i=0;i<max_restore_time;i++) { fs->sp.shadow_used[i] = 0; }
+        // set up the map of the i-node file and the root directory
+        for(i=0;i<fs->file_block_num;i++) { fs->root_map[i] = i+fs->file_start_block; }
+        for(i=0;i<fs->root_dir_block_num;i++){ fs->dir_map[i] = i+fs->root_dir_start_block; }
         /* setup the FBM & WM */
-        for(i=0;i<data_start_block;i++){ 
-            fbm[i] = used; 
-            if(i<3) wm[i] = writeable; 
-            else wm[i] = readonly; 
-        }
-        for(i=data_start_block;i<num_blocks;i++) { 
-            fbm[i] = unused; 
-            wm[i] = writeable; 
+        memset(fs->fbm, 0, 2*fs->bitmap_block_num*fs->block_size);
+        for(i=0;i<fs->data_start_block;i++) { mark_writeable(fs, i); }
+        for(i=fs->data_start_block;i<fs->num_blocks;i++) { 
+            if(i < fs->share_start_block) mark_unused(fs, i); 
+            mark_writeable(fs, i); 
         } 
+        /* nothing is shared yet */
+        memset(fs->share_count, 0, fs->share_block_num*fs->block_size);
+        memset(fs->share_block_loaded, 1, fs->share_block_num);
+        memset(fs->share_block_dirty, 1, fs->share_block_num);
+        rebuild_fbm_summary(fs);
+        fs->fbm_cursor = fs->data_start_block;
         /* set up an array containing all the i-nodes */ 
-        for(i=0;i<max_file_num;i++) 
+        for(i=0;i<fs->max_file_num;i++) 
         { 
-            i_node_array[i].size = -1; 
-            for(j=0;j<15;j++){ i_node_array[i].pointer[j] = -1;}
+            fs->i_node_array[i].size = -1; 
+            for(j=0;j<15;j++){ fs->i_node_array[i].pointer[j] = -1;}
         }
-        for(i=0;i<root_dir_block_num;i++){ i_node_array[0].pointer[i] = i+root_dir_start_block; }  // the root directory takes up 4 blocks
-        i_node_array[0].size = root_dir_block_num*block_size;  // =4; the 1st i-node in the i-node file is associated with the root directory
+        fs->i_node_array[0].size = fs->root_dir_block_num*fs->block_size;  // the 1st i-node in the i-node file is associated with the root directory, found through dir_map
         /* set up the root directory */
-        root_dir[0].i_node_index = 0;   // the first i-node is associated with the root directory
-        for(i=1;i<max_file_num;i++){ root_dir[i].i_node_index = -1; }        
+        fs->root_dir[0].i_node_index = 0;   // the first i-node is associated with the root directory
+        for(i=1;i<fs->max_file_num;i++){ fs->root_dir[i].i_node_index = -1; }        
+        dir_index_build(fs);
         /* map the superblock, fbm, wm and i-node file onto the disk */
-        commit_sp(); commit_fbm(); commit_wm(); commit_i_node_file(-1); commit_root_dir(-1); 
-        /* set up the data blocks and map it onto the disk */
-        char data[num_blocks-20][block_size];
-        char *buffer_db = (char *)malloc(data_block_num*block_size*sizeof(char));
-        for(i=0;i<data_block_num;i++) { for(j=0;j<block_size;j++) {data[i][j] = '0'; } }
-        memcpy(buffer_db, &data, data_block_num*block_size*sizeof(char));
-        if( write_blocks(data_start_block, data_block_num, buffer_db) < 0) exit(EXIT_FAILURE);
-        free(buffer_db);
-    }
-    else if(init_disk(filename, block_size, num_blocks) !=-1){ load_sp(); load_wm(); load_fbm(); load_i_node_file(); load_root_dir(); } 
+        commit_sp(fs); commit_fbm(fs); commit_wm(fs); commit_shares(fs); commit_i_node_file(fs, -1); commit_root_dir(fs, -1); clear_metadata_dirty(fs);
+        /* the data blocks are left as the new image reads back: no byte of a block is read before it is written */
+        fs->journal_seq = 1;
+        journal_reset(fs);
+    }
+    else if((fs->disk_backend == SSFS_BACKEND_MMAP ? mmap_init_disk(&fs->disk, filename, fs->block_size, fs->num_blocks) 
+                                               : init_disk(filename, fs->block_size, fs->num_blocks)) !=-1){ 
+        fs->journal_active = 0;
+        load_sp(fs); 
+        /* the journal holds metadata newer than its home blocks, the superblock included */
+        if(fs->sp.journal_blocks > 0) { journal_recover(fs); load_sp(fs); }
+        /* the i-node file and the root directory are only read when first used */
+        load_bitmaps(fs); unload_metadata(fs); clear_metadata_dirty(fs);
+        /* so are the share counts */
+        memset(fs->share_block_loaded, 0, fs->share_block_num);
+        /* an older image has no share counts, no journal and chained i-nodes: move the files onto indirect blocks,
+         * take the blocks of a journal if they are free, count the references, then write the superblock with its maps,
+         * the bitmaps and the share counts back in the current layout; no i-node of it is inline, from now on small files may be
+         */
+        if(fs->sp.magic == ssfs_chained_magic)
+        {
+            memset(fs->share_count, 0, fs->share_block_num*fs->block_size);
+            memset(fs->share_block_loaded, 1, fs->share_block_num);
+            upgrade_chained_i_nodes(fs);
+            fs->sp.journal_start = fs->num_blocks-journal_block_num;
+            fs->sp.journal_blocks = unused_run_length(fs, fs->sp.journal_start, journal_block_num) == journal_block_num ? journal_block_num : 0;
+            for(i=0;i<fs->sp.journal_blocks;i++) { mark_used(fs, fs->sp.journal_start+i); }
+            upgrade_shares(fs);
+            fs->sp.magic = ssfs_magic;
+            commit_sp(fs); commit_fbm(fs); commit_wm(fs); commit_shares(fs); clear_metadata_dirty(fs);
+            fs->journal_seq = 1;
+            if(fs->sp.journal_blocks > 0) journal_reset(fs);
+        }
+    } 
     else exit(EXIT_FAILURE);
+    journal_forget(fs);
+    fs->journal_active = fs->sp.journal_blocks > 0;
+    return 0;
+}
+
+/* returns -1 if the image cannot be opened through the selected backend */
+int mkssfs_r(ssfs_t *fs, int fresh)
+{
+    long start = stat_now();
+    int r;
+    pthread_rwlock_wrlock(&fs->dir_lock);
+    if(fs->aio_running == -1) fs->aio_running = aio_start(&fs->aio, fs->aio_workers) <0 ? aio_start(&fs->aio, 0) : fs->aio_workers;
+    wait_readahead(fs, -1);
+    r = mkssfs_helper(fs, fresh);
+    pthread_rwlock_unlock(&fs->dir_lock);
+    return stat_call(fs, SSFS_STAT_MKSSFS, start, r, 0);
+}
+
+/* creates a file of size 0 in the root directory, leaving the metadata for the caller to commit
+ * returns its i-node number, -1 if there is no room for it
+ */
+int create_file(ssfs_t *fs, char *name)
+{
+    int new_dir_entry, new_i_node;
+
+    // 1. the file starts inline, without a data block
+
+    // 2.1 create an i-node in the copy of the i-node file
+    if((new_i_node = unused_i_node(fs)) <0 ) return -1;
+    if( commit_i_node_file(fs, new_i_node) <0 ) return -1;
+    i_node_at(fs, new_i_node)->size = 0;
+    memset(i_node_at(fs, new_i_node)->pointer, 0, inline_max);
+    i_node_at(fs, new_i_node)->pointer[14] = inline_marker;
+
+    // 3.1 create a new entry in the copy of the root directory
+    if((new_dir_entry = unused_dir_entry(fs)) <0 ) return -1;
+    if( commit_root_dir(fs, new_dir_entry) <0 ) return -1;
+    fs->root_dir[new_dir_entry].i_node_index = new_i_node;
+    strcpy(fs->root_dir[new_dir_entry].filename, name);
+    dir_index_insert(fs, new_dir_entry);
+    return new_i_node;
 }
 
-int ssfs_fopen(char *name)
+int fopen_helper(ssfs_t *fs, char *name)
 {
-    int i=0, j=0, k=0, new_fd_entry=-1;
-    for(i=0;i<max_file_num;i++)
+    int i=0, new_fd_entry=-1;
+    /* if the file exists */
+    if((i = dir_lookup(fs, name)) != -1)
     {
-        /* if the file exists */
-        if(root_dir[i].i_node_index!=-1 && strcmp(root_dir[i].filename, name)==0)
-        {
-            int i_node_number, new_fd_entry;
-
-            i_node_number = root_dir[i].i_node_index;
-            /* check if this file is already opened */
-            for(k=0;k<max_file_num;k++)
-            { 
-                if(fd_table[k].i_node_number==i_node_number) 
-                { 
-                    printf("The requested file is already opened\n"); 
-                    return -1;
-                }
-            }
-            /* if this file is not opened, open it */
-            if((new_fd_entry = unused_fd_entry()) <0 ) return -1;
-            fd_table[new_fd_entry].i_node_number = i_node_number;          
-            fd_table[new_fd_entry].read_ptr.block = i_node_array[i_node_number].pointer[0]; 
-            fd_table[new_fd_entry].read_ptr.entry = -1;
-            int size = i_node_array[i_node_number].size;
-            for(j=0;j<size/(block_size*14);j++){ i_node_number = i_node_array[i_node_number].pointer[14]; }
-            fd_table[new_fd_entry].write_ptr.block = i_node_array[i_node_number].pointer[(size/block_size)%14];
-            fd_table[new_fd_entry].write_ptr.entry = i_node_array[i_node_number].size/block_size-1;    
-            return new_fd_entry;         
-        }
+        int i_node_number = fs->root_dir[i].i_node_index;
+        /* check if this file is already opened */
+        if(fs->open_fd[i_node_number] != -1) return -1;
+        /* if this file is not opened, open it */
+        if((new_fd_entry = unused_fd_entry(fs)) <0 ) return -1;
+        fs->fd_table[new_fd_entry].i_node_number = i_node_number;          
+        fs->fd_table[new_fd_entry].read_ptr.entry = -1;
+        fs->fd_table[new_fd_entry].read_ptr.index = 0;
+        /* the write pointer sits on the last byte of the file */
+        int size = i_node_at(fs, i_node_number)->size;
+        fs->fd_table[new_fd_entry].write_ptr.index = size>0 ? (size-1)/fs->block_size : 0;
+        fs->fd_table[new_fd_entry].write_ptr.entry = size>0 ? (size-1)%fs->block_size : -1;
+        fs->fd_table[new_fd_entry].ra_next = -1;
+        fs->fd_table[new_fd_entry].ra_window = fs->fd_table[new_fd_entry].ra_end = 0;
+        fs->open_fd[i_node_number] = new_fd_entry;
+        return new_fd_entry;         
     }
     /* if the file doesn't exist, create a new one of size 0 */
-    if(i==max_file_num)
+    else
     {        
-        int new_dir_entry, new_file_block, new_i_node, new_fd_entry;
-        
-        // 1. find an empty block in the data block to place the file
-        if((new_file_block = unused_block()) <0) return -1;
-        fbm[new_file_block] = used;
-
-        // 2.1 create an i-node in the copy of the i-node file
-        if((new_i_node = unused_i_node()) <0 ) return -1;
-        if( commit_i_node_file(new_i_node) <0 ) return -1;
-        i_node_array[new_i_node].size = 0;
-        i_node_array[new_i_node].pointer[0] = new_file_block;
-        for(k=1;k<15;k++){ i_node_array[new_i_node].pointer[k] = -1; }
-               
-        // 3.1 create a new entry in the copy of the root directory
-        if((new_dir_entry = unused_dir_entry()) <0 ) return -1;
-    	if( commit_root_dir(new_dir_entry) <0 ) return -1;
-        root_dir[new_dir_entry].i_node_index = new_i_node;
-        strcpy(root_dir[new_dir_entry].filename, name);
-
-        commit_sp();commit_fbm(); commit_i_node_file(-1);commit_root_dir(-1);
+        int new_i_node, new_fd_entry;
+
+        if((new_i_node = create_file(fs, name)) <0 ) return -1;
+        commit_metadata(fs);
         // 4. create a new entry in the file descriptor table
-        if((new_fd_entry = unused_fd_entry()) <0 ) return -1;
-        fd_table[new_fd_entry].i_node_number   = new_i_node;
-        fd_table[new_fd_entry].read_ptr.block  = new_file_block; 
-        fd_table[new_fd_entry].read_ptr.entry  = -1;
-        fd_table[new_fd_entry].write_ptr.block = new_file_block; 
-        fd_table[new_fd_entry].write_ptr.entry = i_node_array[new_i_node].size/block_size-1;
+        if((new_fd_entry = unused_fd_entry(fs)) <0 ) return -1;
+        fs->fd_table[new_fd_entry].i_node_number   = new_i_node;
+        fs->fd_table[new_fd_entry].read_ptr.entry  = -1;
+        fs->fd_table[new_fd_entry].read_ptr.index  = 0;
+        fs->fd_table[new_fd_entry].write_ptr.entry = -1;
+        fs->fd_table[new_fd_entry].write_ptr.index = 0;
+        fs->fd_table[new_fd_entry].ra_next = -1;
+        fs->fd_table[new_fd_entry].ra_window = fs->fd_table[new_fd_entry].ra_end = 0;
+        fs->open_fd[new_i_node] = new_fd_entry;
 
         return new_fd_entry;
     }
-    printf("fopen cannot reach here!\n");
-    return -1;  
 }
 
-int inc_size(int fileID, int inc)
+int ssfs_fopen_r(ssfs_t *fs, char *name)
+{
+    long start = stat_now();
+    int r;
+    pthread_rwlock_wrlock(&fs->dir_lock);
+    r = fopen_helper(fs, name);
+    pthread_rwlock_unlock(&fs->dir_lock);
+    return trace_call(fs, SSFS_STAT_FOPEN, start, stat_call(fs, SSFS_STAT_FOPEN, start, r, 0), -1, 0, 0, name);
+}
+
+/* locks the file opened as fileID for an operation on its content and returns its i-node number,
+ * for writing if write is set and for reading otherwise
+ * -1 if fileID is not opened, with only dir_lock taken
+ */
+int lock_file(ssfs_t *fs, int fileID, int write)
 {
-    if(fileID<0 || fileID>=max_file_num) return -1;
-    int k=0, i_node_number=fd_table[fileID].i_node_number;
-    while(i_node_number!=-1)
-    {       
-    	if( commit_i_node_file(i_node_number) <0 ) return -1;
-        i_node_array[i_node_number].size += inc;
-        i_node_number = i_node_array[i_node_number].pointer[14];        
+    int i_node_number = -1;
+    pthread_rwlock_rdlock(&fs->dir_lock);
+    if(fileID>=0 && fileID<fs->max_file_num && (i_node_number = fs->fd_table[fileID].i_node_number) != -1)
+    {
+        if(write) pthread_rwlock_wrlock(&fs->i_node_lock[i_node_number]);
+        else pthread_rwlock_rdlock(&fs->i_node_lock[i_node_number]);
     }
-    return inc;
+    return i_node_number;
 }
 
-int ssfs_fwrite(int fileID, char *buf, int length)
+void unlock_file(ssfs_t *fs, int i_node_number)
 {
-    if(length == 0) return 0;
-    if(fileID<0 || fileID>=max_file_num) return -1;
+    if(i_node_number != -1) pthread_rwlock_unlock(&fs->i_node_lock[i_node_number]);
+    pthread_rwlock_unlock(&fs->dir_lock);
+}
 
-    int k=0, block_to_write, i_node_number=fd_table[fileID].i_node_number;
-    if(length == 0) return 0;
-    /* if the file is opened */
-    if(i_node_number != -1)
-    {
-        int block = fd_table[fileID].write_ptr.block;
-        int entry = fd_table[fileID].write_ptr.entry;    // writing starts from the (entry+1)-th entry in this block   
-        int offset = entry+1;    // # filled entries in the block containing the write pointer        
-        /* if the available entry in this block is more than enough */
-        if(offset+length <= block_size) 
+int inc_size(ssfs_t *fs, int i_node_number, int inc)
+{
+    if( commit_i_node_file(fs, i_node_number) <0 ) return -1;
+    i_node_at(fs, i_node_number)->size += inc;
+    return inc;
+}
+
+/* returns the byte offset in the file that a read or write pointer stands for */
+int ptr_offset(ssfs_t *fs, ptr *p){
+    return p->index*fs->block_size + p->entry+1;
+}
+
+/* moves a read or write pointer to byte offset loc of the file
+ * a pointer on a block boundary stays at the end of the previous block, which always exists
+ */
+void ptr_seek(ssfs_t *fs, ptr *p, int loc){
+    if(loc > 0 && loc%fs->block_size == 0) { p->index = loc/fs->block_size-1; p->entry = fs->block_size-1; }
+    else { p->index = loc/fs->block_size; p->entry = loc%fs->block_size-1; }
+}
+
+/* returns the # blocks, up to n, from the index-th block of the file on that follow each other on the disk
+ * *start is set to the first of them
+ */
+int block_run(ssfs_t *fs, int i_node_number, int index, int n, int *start){
+    int run = 1;
+    if((*start = lookup_block(fs, i_node_number, index)) == -1) return 0;
+    while(run < n && lookup_block(fs, i_node_number, index+run) == *start+run) run++;
+    return run;
+}
+
+/* makes the blocks of the file a write of length bytes at byte offset pos goes to the live file system's own, see own_block
+ * only blocks the write covers partly keep their content
+ */
+int own_blocks(ssfs_t *fs, int i_node_number, int pos, int length){
+    int i, index;
+    for(i=0;i<max_restore_time && !fs->sp.shadow_used[i];i++);
+    /* without a checkpoint nothing is shared */
+    if(i == max_restore_time) return 0;
+    for(index=pos/fs->block_size;index<=(pos+length-1)/fs->block_size;index++){
+        if(lookup_block(fs, i_node_number, index) == -1) continue;
+        if( own_block(fs, i_node_number, index, index*fs->block_size < pos || (index+1)*fs->block_size > pos+length) <0 ) return -1;
+    }
+    return 0;
+}
+
+/* moves the data of an inline file to a data block of its own, after which the file has a block map like any other
+ * returns -1 if the disk is full
+ */
+int promote_inline(ssfs_t *fs, int i_node_number){
+    i_node *n = i_node_at(fs, i_node_number);
+    int k, block, saved[15];
+    char *data;
+    if( commit_i_node_file(fs, i_node_number) <0 ) return -1;
+    memcpy(saved, n->pointer, sizeof(saved));
+    for(k=0;k<15;k++) { n->pointer[k] = -1; }
+    /* an empty file needs no block, the write that follows allocates what it covers */
+    if(n->size == 0) return 0;
+    if((block = map_block(fs, i_node_number, 0, 1)) <0 ) { memcpy(n->pointer, saved, sizeof(saved)); return -1; }
+    /* written as a whole block, so that nothing is read for it */
+    data = (char *)calloc(fs->block_size, sizeof(char));
+    memcpy(data, saved, n->size);
+    k = writes_block_by_char(fs, block, 0, data, fs->block_size);
+    free(data);
+    return k < 0 ? -1 : 0;
+}
+
+/* writes length bytes of buf at byte offset pos of the file, which is at most its size
+ * returns # bytes written, -1 if nothing could be written
+ */
+int write_at(ssfs_t *fs, int i_node_number, char *buf, int length, int pos)
+{
+    int k, n, run, start, block, acc = 0;
+    aio_batch batch;
+    /* file sizes are ints: the block map reaches further than that on large images */
+    if(length > INT_MAX-pos) return -1;
+    /* a block readahead is still reading could otherwise reach the cache after it is written */
+    wait_readahead(fs, i_node_number);
+    /* a small file is written in its i-node, with the rest of the metadata, as long as it fits */
+    if(is_inline(i_node_at(fs, i_node_number)->pointer))
+    {
+        if(pos+length <= inline_max)
         {
-            int acc = writes_block_by_char(block, offset, buf, length);
-            if(acc != -1)
-            {
-                fd_table[fileID].write_ptr.entry += acc; 
-                int inc = fd_table[fileID].write_ptr.entry - i_node_array[i_node_number].size%block_size+1;           
-                /* if this block is the last one belongs to this file, then the file size may be incremented */
-                if( find_block_to_read(i_node_number, block) == -1 && inc>0 ) inc_size(fileID, inc);          
-                commit_fbm(); commit_i_node_file(-1); load_i_node_file();
-                return length;
-            } 
-            else return -1;
+            if( commit_i_node_file(fs, i_node_number) <0 ) return -1;
+            memcpy((char *)i_node_at(fs, i_node_number)->pointer+pos, buf, length);
+            if( pos+length > i_node_at(fs, i_node_number)->size ) i_node_at(fs, i_node_number)->size = pos+length;
+            commit_i_node_file(fs, i_node_number);
+            commit_metadata(fs);
+            return length;
         }
-        /* if the write pointer is at the last entry in a block and the length is smaller than block size */
-        else if(entry==block_size-1 && length<=block_size)
-        {   
-            int temp = find_block_to_write(i_node_number, block);
-            if(temp <0 ) {return -1;}
-            fd_table[fileID].write_ptr.block = temp;
-            fd_table[fileID].write_ptr.entry = -1;
-            return ssfs_fwrite(fileID, buf, length);                                            
+        if( promote_inline(fs, i_node_number) <0 ) return -1;
+    }
+    if( own_blocks(fs, i_node_number, pos, length) <0 ) return -1;
+    /* the blocks this write extends the file with are allocated in one contiguous run */
+    if( reserve_blocks(fs, i_node_number, pos/fs->block_size, (pos+length-1)/fs->block_size-pos/fs->block_size+1) <0 ) return -1;
+    aio_batch_init(&batch);
+    while(acc < length)
+    {
+        int index = (pos+acc)/fs->block_size, offset = (pos+acc)%fs->block_size;
+        /* whole blocks go straight to the disk, one write_blocks per contiguous run, all queued and waited for at the end */
+        if(offset == 0 && length-acc >= fs->block_size)
+        {
+            /* a block reserve_blocks found no run for is allocated on its own */
+            if(map_block(fs, i_node_number, index, 1) <0 ) break;
+            if((run = block_run(fs, i_node_number, index, (length-acc)/fs->block_size, &start)) <= 0) break;
+            for(k=0;k<run;k++) { cache_drop(fs, start+k); }
+            aio_submit(&fs->aio, &batch, queued_write, fs, start, run, buf+acc);
+            acc += run*fs->block_size;
         }
-        /* if the available entry in this block is not enough, divide the buf into pieces for recursing */
+        /* only the partial head and tail blocks are merged with what they held */
         else
-        {           
-            int avail = block_size-offset;  // # available entries in this block 
-            int rest  = length-avail;       // # chars to be written in other blocks
-            int piece = rest/block_size;    // # blocks to write to
-            int last  = rest%block_size;    // # chars to be written in the last block
-            int acc = 0;
-            int temp;
-            acc += ssfs_fwrite(fileID, buf, avail);
-            for(k=0;k<piece;k++)
-            { 
-                if((temp = ssfs_fwrite(fileID, buf+avail+block_size*k, block_size))<0) { return -1;}
-                else acc += temp; 
-            }
-            if((temp = ssfs_fwrite(fileID, buf+avail+ block_size*k, last))<0) { return -1;}
-            else acc += temp;
-            return acc;
+        {
+            n = fs->block_size-offset < length-acc ? fs->block_size-offset : length-acc;
+            if((block = map_block(fs, i_node_number, index, 1)) <0 ) break;
+            if( writes_block_by_char(fs, block, offset, buf+acc, n) <0 ) break;
+            acc += n;
         }
     }
-    printf("fwrite: requested file is not opened\n");
-    return -1;
+    /* which of the queued runs failed is not known, so none of the write counts */
+    if( aio_wait(&fs->aio, &batch) <0 ) acc = 0;
+    if(acc == 0) return -1;
+    /* if the write went past the end of the file, the file size is incremented */
+    if( pos+acc > i_node_at(fs, i_node_number)->size ) inc_size(fs, i_node_number, pos+acc-i_node_at(fs, i_node_number)->size);
+    /* marked again: a commit_metadata of another file may have written the i-node block while it changed */
+    commit_i_node_file(fs, i_node_number);
+    commit_metadata(fs);
+    return acc;
 }
 
-
-int ssfs_fread(int fileID, char *buf, int length)
+int fwrite_helper(ssfs_t *fs, int fileID, char *buf, int length)
 {
-    int k, block_to_read, i_node_number = fd_table[fileID].i_node_number;
     if(length == 0) return 0;
-    if(i_node_array[i_node_number].size == 0) {printf("111\n");return 0;}
-    /* if the file is opened */
-    if(fd_table[fileID].i_node_number != -1)
-    {
-        int block = fd_table[fileID].read_ptr.block;
-        int entry = fd_table[fileID].read_ptr.entry;    // writing starts from the (entry+1)-th entry in this block   
-        int offset = entry+1;    // # filled entries in the block containing the read pointer
-        /* if the read pointer will not go outside of this block */
-        if(offset+length <= block_size) 
+    if(fileID<0 || fileID>=fs->max_file_num || length<0) return -1;
+
+    int acc, i_node_number = fs->fd_table[fileID].i_node_number;
+    /* if the file is not opened */
+    if(i_node_number == -1) return -1;
+
+    int pos = ptr_offset(fs, &fs->fd_table[fileID].write_ptr);
+    if((acc = write_at(fs, i_node_number, buf, length, pos)) <0 ) return -1;
+    ptr_seek(fs, &fs->fd_table[fileID].write_ptr, pos+acc);
+    return acc;
+}
+
+int ssfs_fwrite_r(ssfs_t *fs, int fileID, char *buf, int length)
+{
+    long start = stat_now();
+    int r, i_node_number = lock_file(fs, fileID, 1);
+    r = fwrite_helper(fs, fileID, buf, length);
+    unlock_file(fs, i_node_number);
+    return trace_call(fs, SSFS_STAT_FWRITE, start, stat_call(fs, SSFS_STAT_FWRITE, start, r, r), fileID, length, 0, NULL);
+}
+
+/* called after fileID read bytes [pos, end) of its file
+ * once reads are sequential, keeps ra_window blocks past end in the cache, growing the window while they stay sequential
+ */
+void readahead(ssfs_t *fs, int fileID, int pos, int end)
+{
+    fd_entry *f = &fs->fd_table[fileID];
+    int from, to, run, start, last, limit = fs->cache_capacity/2 < ra_window_max ? fs->cache_capacity/2 : ra_window_max;
+    if(pos != f->ra_next) { f->ra_window = 0; f->ra_end = 0; }
+    else f->ra_window = f->ra_window == 0 ? ra_window_min : 2*f->ra_window;
+    /* a cache too small to hold a window is not worth reading ahead into */
+    if(f->ra_window > limit) f->ra_window = limit < ra_window_min ? 0 : limit;
+    f->ra_next = end;
+    if(f->ra_window == 0) return;
+    /* the block end falls in was read through the cache unless end is on a boundary */
+    from = (end+fs->block_size-1)/fs->block_size;
+    if(from < f->ra_end) from = f->ra_end;
+    to = (end+fs->block_size-1)/fs->block_size+f->ra_window;
+    last = (i_node_at(fs, f->i_node_number)->size+fs->block_size-1)/fs->block_size;
+    if(to > last) to = last;
+    /* refill only once half the window has been read */
+    if(from >= to || to-from < f->ra_window/2) return;
+    /* each run is queued without waiting, the read goes on while the caller uses what it read */
+    while(from < to)
+    {
+        if((run = block_run(fs, f->i_node_number, from, to-from, &start)) <= 0) break;
+        if(fs->disk_backend == SSFS_BACKEND_MMAP) { mmap_prefetch(&fs->disk, start, run); __atomic_fetch_add(&fs->ra_issued, run, __ATOMIC_RELAXED); from += run; continue; }
+        /* blocks in the cache already, possibly modified, are left alone */
+        if((run = cache_miss_run(fs, start, run)) == 0) { from++; continue; }
+        aio_submit(&fs->aio, &fs->ra_batch[f->i_node_number], queued_readahead, fs, start, run, malloc(run*fs->block_size));
+        from += run;
+    }
+    f->ra_end = from;
+}
+
+/* reads up to length bytes at byte offset pos of the file into buf
+ * returns # bytes read, which stops at the end of the file, -1 if the disk cannot be read
+ */
+int read_at(ssfs_t *fs, int i_node_number, char *buf, int length, int pos)
+{
+    int n, run, start, block, acc = 0;
+    aio_batch batch;
+    /* never read past the end of the file */
+    if(length > i_node_at(fs, i_node_number)->size-pos) length = i_node_at(fs, i_node_number)->size-pos;
+    if(length <= 0) return 0;
+    if(is_inline(i_node_at(fs, i_node_number)->pointer))
+    {
+        memcpy(buf, (char *)i_node_at(fs, i_node_number)->pointer+pos, length);
+        return length;
+    }
+    aio_batch_init(&batch);
+    while(acc < length)
+    {
+        int index = (pos+acc)/fs->block_size, offset = (pos+acc)%fs->block_size;
+        /* whole blocks not in the cache come straight from the disk, one read_blocks per contiguous run,
+         * all queued and waited for at the end
+         */
+        if(offset == 0 && length-acc >= fs->block_size)
         {
-            int acc = reads_block_by_char(block, offset, buf, length); 
-            if(acc != -1)
-            {   
-                fd_table[fileID].read_ptr.entry += acc;
-                return acc;
+            if((run = block_run(fs, i_node_number, index, (length-acc)/fs->block_size, &start)) <= 0) break;
+            /* a cached block may be newer than its copy on the disk */
+            if((run = cache_miss_run(fs, start, run)) == 0)
+            {
+                if( reads_block_by_char(fs, start, 0, buf+acc, fs->block_size) <0 ) break;
+                acc += fs->block_size;
+                continue;
             }
-            else return -1;
-        } 
-        /* if the read pointer is at the last entry in a block and the length is smaller than block size */
-        else if(entry==block_size-1 && length<=block_size)
-        {
-            int temp = find_block_to_read(i_node_number, block);
-            if(temp <0 ) return -1;
-            fd_table[fileID].read_ptr.block = temp;
-            fd_table[fileID].read_ptr.entry = -1;
-            return ssfs_fread(fileID, buf, length);
+            aio_submit(&fs->aio, &batch, queued_read, fs, start, run, buf+acc);
+            acc += run*fs->block_size;
         }
-        /* if the available entry in this block is not enough, divide the buf into pieces for recursing */
         else
-        {   
-            int avail = block_size-offset;   // # available entries in this block 
-            int rest  = length-avail;       // # chars to be written in other blocks
-            int piece = rest/block_size;    // # blocks to write to
-            int last  = rest%block_size;    // # chars to be written in the last block
-            int acc = 0;
-            int temp;
-            acc += ssfs_fread(fileID, buf, avail);
-            for(k=0;k<piece;k++)
-            { 
-                if((temp = ssfs_fread(fileID, buf+avail+block_size*k, block_size)) <0 ) return acc-(block_size-i_node_array[i_node_number].size%block_size);
-                else acc+=temp; 
-            }
-            if((temp = ssfs_fread(fileID, buf+avail+block_size*k, last)) <0 ) return acc;
-            else acc+=temp; 
-            return acc;
+        {
+            n = fs->block_size-offset < length-acc ? fs->block_size-offset : length-acc;
+            if((block = map_block(fs, i_node_number, index, 0)) <0 ) break;
+            if( reads_block_by_char(fs, block, offset, buf+acc, n) <0 ) break;
+            acc += n;
         }
     }
-    else
+    if( aio_wait(&fs->aio, &batch) <0 ) return -1;
+    return acc;
+}
+
+int fread_helper(ssfs_t *fs, int fileID, char *buf, int length)
+{
+    if(fileID<0 || fileID>=fs->max_file_num || length<0) return -1;
+
+    int acc, i_node_number = fs->fd_table[fileID].i_node_number;
+    /* if the file is not opened */
+    if(i_node_number == -1) return -1;
+
+    int pos = ptr_offset(fs, &fs->fd_table[fileID].read_ptr);
+    if((acc = read_at(fs, i_node_number, buf, length, pos)) <0 ) return -1;
+    ptr_seek(fs, &fs->fd_table[fileID].read_ptr, pos+acc);
+    readahead(fs, fileID, pos, pos+acc);
+    return acc;
+}
+
+int ssfs_fread_r(ssfs_t *fs, int fileID, char *buf, int length)
+{
+    long start = stat_now();
+    int r, i_node_number = lock_file(fs, fileID, 0);
+    r = fread_helper(fs, fileID, buf, length);
+    unlock_file(fs, i_node_number);
+    return trace_call(fs, SSFS_STAT_FREAD, start, stat_call(fs, SSFS_STAT_FREAD, start, r, r), fileID, length, 0, NULL);
+}
+
+/* like ssfs_fwrite and ssfs_fread, at byte offset offset of the file instead of the file's write and read pointers,
+ * which are left where they are; offset is at most the size of the file
+ */
+int pwrite_helper(ssfs_t *fs, int fileID, char *buf, int length, int offset)
+{
+    if(length == 0) return 0;
+    if(fileID<0 || fileID>=fs->max_file_num || length<0 || offset<0) return -1;
+    int i_node_number = fs->fd_table[fileID].i_node_number;
+    if(i_node_number == -1 || offset > i_node_at(fs, i_node_number)->size) return -1;
+    return write_at(fs, i_node_number, buf, length, offset);
+}
+
+int pread_helper(ssfs_t *fs, int fileID, char *buf, int length, int offset)
+{
+    if(fileID<0 || fileID>=fs->max_file_num || length<0 || offset<0) return -1;
+    int i_node_number = fs->fd_table[fileID].i_node_number;
+    if(i_node_number == -1 || offset > i_node_at(fs, i_node_number)->size) return -1;
+    return read_at(fs, i_node_number, buf, length, offset);
+}
+
+int ssfs_pwrite_r(ssfs_t *fs, int fileID, char *buf, int length, int offset)
+{
+    long start = stat_now();
+    int r, i_node_number = lock_file(fs, fileID, 1);
+    r = pwrite_helper(fs, fileID, buf, length, offset);
+    unlock_file(fs, i_node_number);
+    return trace_call(fs, SSFS_STAT_PWRITE, start, stat_call(fs, SSFS_STAT_PWRITE, start, r, r), fileID, length, offset, NULL);
+}
+
+/* calls on the same file, even through the same fileID, run in parallel */
+int ssfs_pread_r(ssfs_t *fs, int fileID, char *buf, int length, int offset)
+{
+    long start = stat_now();
+    int r, i_node_number = lock_file(fs, fileID, 0);
+    r = pread_helper(fs, fileID, buf, length, offset);
+    unlock_file(fs, i_node_number);
+    return trace_call(fs, SSFS_STAT_PREAD, start, stat_call(fs, SSFS_STAT_PREAD, start, r, r), fileID, length, offset, NULL);
+}
+
+/* like ssfs_fread, but instead of copying, view is filled with read-only spans
+ * pointing into the cache or the mapped image; they stay valid until ssfs_release_view.
+ * A view is a snapshot that may go stale: a later write to the range may or may not show in it,
+ * e.g. whole blocks are written past the cache and copied on write after a checkpoint. A view covers at most SSFS_VIEW_MAX_SPANS blocks
+ * and as many as the cache can pin, so it may cover less than length.
+ * returns # bytes covered, -1 if the file is not opened
+ */
+int fread_view_helper(ssfs_t *fs, int fileID, int length, ssfs_view *view)
+{
+    view->num_spans = 0;
+    if(fileID<0 || fileID>=fs->max_file_num || length<0) return -1;
+
+    int n, block, entry, acc = 0, i_node_number = fs->fd_table[fileID].i_node_number;
+    char *data;
+    if(i_node_number == -1) return -1;
+
+    int pos = ptr_offset(fs, &fs->fd_table[fileID].read_ptr);
+    if(length > i_node_at(fs, i_node_number)->size-pos) length = i_node_at(fs, i_node_number)->size-pos;
+    /* the data of an inline file is borrowed from its i-node, which stays in memory */
+    if(length > 0 && is_inline(i_node_at(fs, i_node_number)->pointer))
     {
-        printf("fread: requested file is not opened\n");
-        return -1;
+        view->span[0].data = (char *)i_node_at(fs, i_node_number)->pointer+pos;
+        view->span[0].length = length;
+        view->pinned[0] = -1;
+        view->num_spans = 1;
+        acc = length;
     }
-    
+    while(acc < length && view->num_spans < SSFS_VIEW_MAX_SPANS)
+    {
+        int index = (pos+acc)/fs->block_size, offset = (pos+acc)%fs->block_size;
+        n = fs->block_size-offset < length-acc ? fs->block_size-offset : length-acc;
+        /* leave room in the cache for one more block */
+        if(view->num_spans > 0 && fs->disk_backend != SSFS_BACKEND_MMAP && fs->cache_pinned+1 >= fs->cache_capacity) break;
+        if((block = lookup_block(fs, i_node_number, index)) <0 ) break;
+        if((data = cache_pin(fs, block, &entry)) == NULL) break;
+        view->span[view->num_spans].data = data+offset;
+        view->span[view->num_spans].length = n;
+        view->pinned[view->num_spans] = entry;
+        view->num_spans++;
+        acc += n;
+    }
+    ptr_seek(fs, &fs->fd_table[fileID].read_ptr, pos+acc);
+    return acc;
+}
+
+int ssfs_fread_view_r(ssfs_t *fs, int fileID, int length, ssfs_view *view)
+{
+    long start = stat_now();
+    int r, i_node_number = lock_file(fs, fileID, 0);
+    r = fread_view_helper(fs, fileID, length, view);
+    unlock_file(fs, i_node_number);
+    return trace_call(fs, SSFS_STAT_FREAD_VIEW, start, stat_call(fs, SSFS_STAT_FREAD_VIEW, start, r, r), fileID, length, 0, NULL);
 }
 
-int ssfs_fclose(int fileID)
+void ssfs_release_view_r(ssfs_t *fs, ssfs_view *view)
 {
-    if(fileID >= 0 && fileID < max_file_num)
+    int k;
+    for(k=0;k<view->num_spans;k++) { cache_unpin(fs, view->pinned[k]); }
+    view->num_spans = 0;
+}
+
+int fclose_helper(ssfs_t *fs, int fileID)
+{
+    if(fileID >= 0 && fileID < fs->max_file_num)
     {
-        if(fd_table[fileID].i_node_number == -1) return -1;
-        else fd_table[fileID].i_node_number = -1;
+        if(fs->fd_table[fileID].i_node_number == -1) return -1;
+        fs->open_fd[fs->fd_table[fileID].i_node_number] = -1;
+        fs->fd_table[fileID].i_node_number = -1;
+        if( cache_flush(fs) <0 ) return -1;
         return 0; 
     }
     return -1;
 }
 
-/* ptr is either 'r' or 'w' */
-int fseek_helper(int fileID, int loc, char ptr)
+int ssfs_fclose_r(ssfs_t *fs, int fileID)
 {
-    int block_index,
-        i_node_number = fd_table[fileID].i_node_number;
-    if(ptr == 'r')
-    {
-        /* check if this entry goes beyond this file */
-        if(i_node_array[i_node_number].size < loc)  return -1;
-        /* find the number of blocks the read pointer has to walk through */
-        else if(loc/block_size == 0) 
-        { 
-            fd_table[fileID].read_ptr.entry = loc%block_size-1; 
-            return 0; 
-        }
-        else
-        {
-            /* find the next block the read pointer should move to */
-            block_index = find_block_to_read(i_node_number, fd_table[fileID].read_ptr.block);
-            if(block_index == -1) { printf("read pointer out of bound\n"); return -1; }
-            fd_table[fileID].read_ptr.block = block_index;
-            fd_table[fileID].read_ptr.entry = 0;
-            loc -= block_size;
-            return fseek_helper(fileID, loc, 'r');
-        }
-    }
-    else if(ptr == 'w')
-    {
-        /* check if this entry goes beyond this file */
-        if(i_node_array[i_node_number].size < loc) return -1;
-        /* find the number of blocks the read pointer has to walk through */
-        else if(loc/block_size == 0) 
-        { 
-            fd_table[fileID].write_ptr.entry = loc%block_size-1; 
-            return 0; 
-        }
-        else
-        {
-            /* find the next block the read pointer should move to */
-            block_index = find_block_to_read(i_node_number, fd_table[fileID].write_ptr.block);
-            if(block_index == -1) return -1; 
-            fd_table[fileID].write_ptr.block = block_index;
-            fd_table[fileID].write_ptr.entry = 0;
-            loc -= block_size;
-            return fseek_helper(fileID, loc, 'w');
-        }
-    }    
-    else{ printf("Invalid paramenter\n"); return -1;}
+    long start = stat_now();
+    int r;
+    pthread_rwlock_wrlock(&fs->dir_lock);
+    r = fclose_helper(fs, fileID);
+    pthread_rwlock_unlock(&fs->dir_lock);
+    return trace_call(fs, SSFS_STAT_FCLOSE, start, stat_call(fs, SSFS_STAT_FCLOSE, start, r, 0), fileID, 0, 0, NULL);
 }
 
-int ssfs_frseek(int fileID, int loc)
+/* ptr is either 'r' or 'w'
+ * the pointer moves straight to loc: only the block holding it is looked up
+ */
+int fseek_helper(ssfs_t *fs, int fileID, int loc, char ptr)
+{
+    int i_node_number = fs->fd_table[fileID].i_node_number;
+    /* check if this entry goes beyond this file */
+    if(i_node_at(fs, i_node_number)->size < loc) return -1;
+    if(ptr == 'r') ptr_seek(fs, &fs->fd_table[fileID].read_ptr, loc);
+    else if(ptr == 'w') ptr_seek(fs, &fs->fd_table[fileID].write_ptr, loc);
+    else return -1;
+    return 0;
+}
+
+int frseek_helper(ssfs_t *fs, int fileID, int loc)
 {
-    //printf("seek loc %d\n", loc);
-    if(fileID >= 0 && fileID < max_file_num && loc>=0)
+    if(fileID >= 0 && fileID < fs->max_file_num && loc>=0)
     {
-        int i_node_number = fd_table[fileID].i_node_number;
-        if( i_node_number == -1) { printf("case1\n"); return -1;}
+        int i_node_number = fs->fd_table[fileID].i_node_number;
+        if( i_node_number == -1) return -1;
 
-        /* move the read pointer to the beginning of this file */
-        fd_table[fileID].read_ptr.block = i_node_array[i_node_number].pointer[0];
-        fd_table[fileID].read_ptr.entry = -1;
-        return fseek_helper(fileID, loc, 'r');
+        return fseek_helper(fs, fileID, loc, 'r');
     }
     else return -1;
 }
 
-int ssfs_fwseek(int fileID, int loc)
+int ssfs_frseek_r(ssfs_t *fs, int fileID, int loc)
+{
+    long start = stat_now();
+    int r, i_node_number = lock_file(fs, fileID, 0);
+    r = frseek_helper(fs, fileID, loc);
+    unlock_file(fs, i_node_number);
+    return trace_call(fs, SSFS_STAT_FRSEEK, start, stat_call(fs, SSFS_STAT_FRSEEK, start, r, 0), fileID, loc, 0, NULL);
+}
+
+int fwseek_helper(ssfs_t *fs, int fileID, int loc)
 {
-    if(fileID >= 0 && fileID < max_file_num && loc>=0)
+    if(fileID >= 0 && fileID < fs->max_file_num && loc>=0)
     {
-        int i_node_number = fd_table[fileID].i_node_number;
+        int i_node_number = fs->fd_table[fileID].i_node_number;
         if( i_node_number == -1) return -1;
 
-        /* move the read pointer to the beginning of this file */
-        fd_table[fileID].write_ptr.block = i_node_array[i_node_number].pointer[0];
-        fd_table[fileID].write_ptr.entry = -1;     
-
-        return fseek_helper(fileID, loc, 'w');        
+        return fseek_helper(fs, fileID, loc, 'w');
     }
     else return -1;
 }
 
-int ssfs_remove(char *file)
+int ssfs_fwseek_r(ssfs_t *fs, int fileID, int loc)
+{
+    long start = stat_now();
+    /* the write pointer is the writers', see ssfs_fwrite_r */
+    int r, i_node_number = lock_file(fs, fileID, 1);
+    r = fwseek_helper(fs, fileID, loc);
+    unlock_file(fs, i_node_number);
+    return trace_call(fs, SSFS_STAT_FWSEEK, start, stat_call(fs, SSFS_STAT_FWSEEK, start, r, 0), fileID, loc, 0, NULL);
+}
+
+int remove_helper(ssfs_t *fs, char *file)
 {
-    int i, i_node_number, block;
+    int i, i_node_number;
     
     /* find the index of the i-node associated with this file in root directory */
-    for(i=0;i<max_file_num;i++)
+    if((i = dir_lookup(fs, file)) == -1) return -1;
+    i_node_number = fs->root_dir[i].i_node_index; 
+    if( commit_root_dir(fs, i) <0 ) return -1;
+    dir_index_remove(fs, i);
+    fs->root_dir[i].i_node_index = -1;
+    /* if this file is opened, close it first */
+    if(fs->open_fd[i_node_number] != -1) fclose_helper(fs, fs->open_fd[i_node_number]);
+    /* clear the i-node associated with this file in the i-node file (array), after moving it off a block a checkpoint shares */
+    if( commit_i_node_file(fs, i_node_number) <0 ) return -1;
+    /* free the data and indirect blocks of this file in the fbm, once readahead is done reading them */
+    wait_readahead(fs, i_node_number);
+    release_file_blocks(fs, i_node_number);
+    /* what the journal holds of a freed indirect block goes before the block can be reused, see ind_drop */
+    if(fs->journal_revoked) journal_checkpoint(fs);
+    i_node_at(fs, i_node_number)->size = -1;
+    for(i=0;i<15;i++) { i_node_at(fs, i_node_number)->pointer[i] = -1; }
+
+    commit_metadata(fs);
+
+    return 0;
+}
+
+int ssfs_remove_r(ssfs_t *fs, char *file)
+{
+    long start = stat_now();
+    int r;
+    pthread_rwlock_wrlock(&fs->dir_lock);
+    r = remove_helper(fs, file);
+    pthread_rwlock_unlock(&fs->dir_lock);
+    return trace_call(fs, SSFS_STAT_REMOVE, start, stat_call(fs, SSFS_STAT_REMOVE, start, r, 0), -1, 0, 0, file);
+}
+
+/* applies ops in order, committing the metadata they change once at the end
+ * each op's result is set to what the corresponding call would return
+ */
+int batch_helper(ssfs_t *fs, ssfs_op *ops, int num_ops)
+{
+    int k, i, i_node_number, created, done = 0;
+    ssfs_op *op;
+    fs->meta_deferred = 1;
+    fs->batch_freed_num = 0;
+    for(k=0;k<num_ops;k++)
     {
-        if(strcmp(root_dir[i].filename, file)==0) 
-        { 
-            i_node_number = root_dir[i].i_node_index; 
-            if( commit_root_dir(i) <0 ) return -1;
-            root_dir[i].i_node_index = -1;
-            break;
+        op = &ops[k];
+        op->result = -1;
+        created = -1;
+        if(op->type == SSFS_OP_CREATE)
+        {
+            if(dir_lookup(fs, op->name) != -1 || create_file(fs, op->name) >= 0) op->result = 0;
         }
+        /* a write that fails leaves no file behind */
+        else if(op->type == SSFS_OP_WRITE && op->length >= 0)
+        {
+            /* appended to the end of the file, which is created first if needed */
+            if((i = dir_lookup(fs, op->name)) != -1) i_node_number = fs->root_dir[i].i_node_index;
+            else i_node_number = created = create_file(fs, op->name);
+            if(i_node_number >= 0)
+                op->result = op->length == 0 ? 0 : write_at(fs, i_node_number, op->buf, op->length, i_node_at(fs, i_node_number)->size);
+            if(op->result < 0 && created >= 0) remove_helper(fs, op->name);
+        }
+        else if(op->type == SSFS_OP_REMOVE) op->result = remove_helper(fs, op->name);
+        if(op->result >= 0) done++;
     }
-    if(i==max_file_num) return -1;
-    /* if this file is opened, close it first */
-    for(i=0;i<max_file_num;i++)
-    { 
-        if(fd_table[i].i_node_number == i_node_number) ssfs_fclose(i); 
-    }
-    /* find the i-node associated with this file in the i-node file (array) and set the fbm entry to be 1 */
-    block = i_node_array[i_node_number].pointer[0]; 
-    while(block != -1)
+    fs->meta_deferred = 0;
+    commit_metadata(fs);
+    /* the blocks the batch freed can be taken again now that the image no longer points at them */
+    for(k=0;k<fs->batch_freed_num;k++) { mark_unused(fs, fs->batch_freed[k]); }
+    fs->batch_freed_num = 0;
+    return done;
+}
+
+/* bytes written by the operations of a batch */
+long batch_bytes(ssfs_op *ops, int num_ops){
+    long bytes = 0;
+    for(int i=0;i<num_ops;i++) { if(ops[i].type == SSFS_OP_WRITE && ops[i].result > 0) bytes += ops[i].result; }
+    return bytes;
+}
+
+int ssfs_batch_r(ssfs_t *fs, ssfs_op *ops, int num_ops)
+{
+    long start = stat_now();
+    int r;
+    if(num_ops < 0) return -1;
+    pthread_rwlock_wrlock(&fs->dir_lock);
+    r = batch_helper(fs, ops, num_ops);
+    pthread_rwlock_unlock(&fs->dir_lock);
+    return trace_batch(fs, start, stat_call(fs, SSFS_STAT_BATCH, start, r, batch_bytes(ops, num_ops)), ops, num_ops);
+}
+
+/* returns the map of checkpoint cnum, or the live one for SSFS_LIVE; NULL if there is no such checkpoint */
+int *map_of(ssfs_t *fs, int cnum){
+    if(cnum == SSFS_LIVE) return fs->root_map;
+    if(cnum<0 || cnum>=max_restore_time || !fs->sp.shadow_used[cnum]) return NULL;
+    return shadow_map(fs, cnum);
+}
+
+/* copies the i-nodes of the i-th block of the i-node file of a map; those of the live file system are in memory */
+void read_map_i_nodes(ssfs_t *fs, int *map, int i, i_node *i_nodes){
+    if(map == fs->root_map) memcpy(i_nodes, i_node_at(fs, i*i_nodes_per_block), fs->block_size);
+    else if( disk_read(fs, map[i], 1, i_nodes) < 0) exit(EXIT_FAILURE);
+}
+
+/* returns list with room for one more item of size bytes after its n items, growing it whenever n is a power of two */
+void *diff_grow(void *list, int n, int size){
+    if(n == 0 || (n & (n-1)) == 0) list = realloc(list, (size_t)(n == 0 ? 1 : 2*n)*size);
+    if(list == NULL) exit(EXIT_FAILURE);
+    return list;
+}
+
+/* adds to diff the data blocks under block to, of the given level, that are not where they are under block from
+ * index is that of the first block of the file under them; a block both have is the same in both, with all it leads to
+ */
+void diff_tree(ssfs_t *fs, int from, int to, int level, int i_node_number, long long index, ssfs_changes *diff){
+    int k;
+    long long span = 1;
+    if(to == -1 || to == from) return;
+    if(level == 0)
     {
-        fbm[block] = unused; 
-        block = find_block_to_read(i_node_number, block);    
+        diff->block = (ssfs_changed_block *)diff_grow(diff->block, diff->num_blocks, sizeof(ssfs_changed_block));
+        diff->block[diff->num_blocks].i_node = i_node_number;
+        diff->block[diff->num_blocks].index = (int)index;
+        diff->block[diff->num_blocks++].block = to;
+        return;
     }
-    /* clear all the i-nodes associated with this file in the i-node file (array) */
-    int temp;
-    do
-    {
-    	if( commit_i_node_file(i_node_number) <0 ) return -1;
-        i_node_array[i_node_number].size = -1;
-        for(i=0;i<14;i++)
-        {
-            i_node_array[i_node_number].pointer[i] = -1;
+    for(k=1;k<level;k++) { span *= pointers_per_block; }
+    for(k=0;k<pointers_per_block;k++){
+        diff_tree(fs, from == -1 ? -1 : indirect_entry(fs, from, k, -1), indirect_entry(fs, to, k, -1), level-1, i_node_number, index+k*span, diff);
+    }
+}
+
+/* adds to diff the i-nodes of the i-th block of the i-node file that differ between two maps, and the data blocks of their files */
+void diff_i_node_block(ssfs_t *fs, int *from, int *to, int i, ssfs_changes *diff){
+    i_node *a = (i_node *)malloc(fs->block_size), *b = (i_node *)malloc(fs->block_size);
+    int k, p;
+    read_map_i_nodes(fs, from, i, a);
+    read_map_i_nodes(fs, to, i, b);
+    for(k=i==0;k<i_nodes_per_block && i*i_nodes_per_block+k<fs->max_file_num;k++){
+        if(a[k].size == b[k].size && memcmp(a[k].pointer, b[k].pointer, sizeof(a[k].pointer)) == 0) continue;
+        diff->i_node = (int *)diff_grow(diff->i_node, diff->num_i_nodes, sizeof(int));
+        diff->i_node[diff->num_i_nodes++] = i*i_nodes_per_block+k;
+        /* an inline file has no data blocks, what changed in it is in the i-node */
+        if(b[k].size == -1 || is_inline(b[k].pointer)) continue;
+        for(p=0;p<15;p++){
+            diff_tree(fs, a[k].size == -1 || is_inline(a[k].pointer) ? -1 : a[k].pointer[p], b[k].pointer[p], pointer_level(p), i*i_nodes_per_block+k, pointer_index(fs, p), diff);
         }
-        temp = i_node_array[i_node_number].pointer[14];
-        i_node_array[i_node_number].pointer[14] = -1;
-        i_node_number = temp;
-    }while(i_node_number != -1);
+    }
+    free(a); free(b);
+}
 
-    commit_fbm();
-    commit_i_node_file(-1);
-    commit_root_dir(-1);
-    load_root_dir();
+/* adds to diff the entries of the i-th block of the root directory that differ between two maps */
+void diff_dir_block(ssfs_t *fs, int *from, int *to, int i, ssfs_changes *diff){
+    dir_entry *a = (dir_entry *)malloc(fs->block_size), *b = (dir_entry *)malloc(fs->block_size);
+    int k;
+    if(from == fs->root_map) memcpy(a, &fs->root_dir[i*dir_entries_per_block], fs->block_size);
+    else if( disk_read(fs, from[fs->file_block_num+i], 1, a) < 0) exit(EXIT_FAILURE);
+    if(to == fs->root_map) memcpy(b, &fs->root_dir[i*dir_entries_per_block], fs->block_size);
+    else if( disk_read(fs, to[fs->file_block_num+i], 1, b) < 0) exit(EXIT_FAILURE);
+    for(k=i==0;k<dir_entries_per_block && i*dir_entries_per_block+k<fs->max_file_num;k++){
+        if(a[k].i_node_index == b[k].i_node_index && (b[k].i_node_index == -1 || strcmp(a[k].filename, b[k].filename) == 0)) continue;
+        diff->entry = (int *)diff_grow(diff->entry, diff->num_entries, sizeof(int));
+        diff->entry[diff->num_entries++] = i*dir_entries_per_block+k;
+    }
+    free(a); free(b);
+}
 
+int diff_helper(ssfs_t *fs, int from, int to, ssfs_changes *diff)
+{
+    int *a = map_of(fs, from), *b = map_of(fs, to), i;
+    if(a == NULL || b == NULL) return -1;
+    memset(diff, 0, sizeof(ssfs_changes));
+    /* the metadata of the live file system is compared as it is in memory */
+    if(!fs->root_dir_loaded) load_root_dir(fs);
+    /* a block of the i-node file or root directory both maps have is shared, and the same in both */
+    for(i=0;i<fs->file_block_num;i++){ if(a[i] != b[i]) diff_i_node_block(fs, a, b, i, diff); }
+    for(i=0;i<fs->root_dir_block_num;i++){ if(a[fs->file_block_num+i] != b[fs->file_block_num+i]) diff_dir_block(fs, a, b, i, diff); }
     return 0;
 }
 
-int commit_helper()
+/* before the live file system becomes what map holds: the blocks of the i-node file that differ are read again on first use,
+ * and those of the root directory right away; the others are shared, what is in memory for them stays right
+ */
+void reload_metadata(ssfs_t *fs, int *map){
+    int i, changed = 0;
+    for(i=0;i<fs->file_block_num;i++) { if(fs->root_map[i] != map[i]) fs->i_node_block_loaded[i] = 0; }
+    if(!fs->root_dir_loaded) return;
+    for(i=0;i<fs->root_dir_block_num;i++){
+        if(fs->dir_map[i] == map[fs->file_block_num+i]) continue;
+        if( disk_read(fs, map[fs->file_block_num+i], 1, &fs->root_dir[i*dir_entries_per_block]) < 0) exit(EXIT_FAILURE);
+        changed = 1;
+    }
+    if(changed) dir_index_build(fs);
+}
+
+int commit_helper(ssfs_t *fs)
 {
-    int i, j, k;
-    /* copy the root to one of the available shadow roots */
-    for(i=0;i<max_restore_time;i++){ if(sp.shadow[i].size==-1) break;}
+    int i;
+    /* copy the root map to one of the available shadow maps */
+    for(i=0;i<max_restore_time;i++){ if(!fs->sp.shadow_used[i]) break;}
     /* if the shadow list is full */
     if(i==max_restore_time)
     {
-        /* remove the i-node file and root directory associated with the evicted shadow root */
-        /* 1. free all the blocks taken by the root directory */        
-        i_node *buf = (i_node *)malloc(block_size);
-        if( read_blocks(sp.shadow[0].pointer[0], 1, buf) <0 ) return -1;
-        for(k=0;k<root_dir_block_num;k++){ fbm[buf[0].pointer[k]] = unused; }
-        /* 2. free all the blocks taken by the i-node file */
-        for(k=0;k<file_block_num;k++){ fbm[sp.shadow[0].pointer[k]] = unused; }
+        /* free what only the evicted checkpoint holds, reading its i-node file from home */
+        journal_checkpoint(fs);
+        release_map(fs, shadow_map(fs, 0));
         /* evict the first one and shift the rest one spot above */
-        for(k=0;k<max_restore_time-1;k++)
-        {
-            sp.shadow[k].size = sp.shadow[k+1].size;
-            for(j=0;j<15;j++){ sp.shadow[k].pointer[j] = sp.shadow[k+1].pointer[j]; }
-        }
+        memmove(shadow_map(fs, 0), shadow_map(fs, 1), (max_restore_time-1)*fs->map_len*sizeof(int));
         i = max_restore_time-1;
     }
-    // let a j-node to store the current root 
-    sp.shadow[i].size = sp.root.size;
-    for(j=0;j<file_block_num;j++){ sp.shadow[i].pointer[j] = sp.root.pointer[j]; }
-   // commit_i_node_file();commit_root_dir();
+    fs->sp.shadow_used[i] = 1;
+    memcpy(shadow_map(fs, i), fs->root_map, fs->map_len*sizeof(int));
     return i;
 }
 
-int ssfs_commit()
+int checkpoint(ssfs_t *fs)
 {
     //if(commit_return_value == -1) { printf("nothing to commit"); return -1;}
-    int i;
-    for(i=0;i<file_block_num;i++){ wm[sp.root.pointer[i]] = readonly; }
-    for(i=0;i<root_dir_block_num;i++){ wm[i_node_array[0].pointer[i]] = readonly; }
-    return commit_helper();
+    int i, cnum;
+    if( cache_flush(fs) <0 ) return -1;
+    commit_metadata(fs);
+    /* the checkpoint shares the whole file system by referring to its i-node file and root directory */
+    for(i=0;i<fs->map_len;i++){ add_ref(fs, fs->root_map[i]); }
+    cnum = commit_helper(fs);
+    /* the new shadow root and the read-only marks go to the disk, and with them everything logged since the last checkpoint */
+    fs->sp_dirty = 1;
+    commit_metadata(fs);
+    journal_checkpoint(fs);
+    if(fs->disk_backend == SSFS_BACKEND_MMAP && mmap_sync_disk(&fs->disk) <0 ) return -1;
+    return cnum;
+}
+
+int ssfs_commit_r(ssfs_t *fs)
+{
+    long start = stat_now();
+    int r;
+    pthread_rwlock_wrlock(&fs->dir_lock);
+    r = checkpoint(fs);
+    pthread_rwlock_unlock(&fs->dir_lock);
+    return trace_call(fs, SSFS_STAT_COMMIT, start, stat_call(fs, SSFS_STAT_COMMIT, start, r, 0), -1, 0, 0, NULL);
 }
 
-int ssfs_restore(int cnum)
+int restore_helper(ssfs_t *fs, int cnum)
 {
-    if(cnum<0 || cnum>=max_restore_time){ printf("Invalid input\n"); return -1;}
+    if(cnum<0 || cnum>=max_restore_time || !fs->sp.shadow_used[cnum]) return -1;
     int j;
-    /* copy the shadow root to the root */
-    for(j=0;j<file_block_num;j++){ sp.root.pointer[j] = sp.shadow[cnum].pointer[j]; }
-    load_i_node_file(); load_root_dir();
-}
\ No newline at end of file
+    /* the blocks of the live files may be freed below */
+    wait_readahead(fs, -1);
+    /* the metadata being replaced goes home first, its blocks may still be logged */
+    journal_checkpoint(fs);
+    reload_metadata(fs, shadow_map(fs, cnum)); clear_metadata_dirty(fs); journal_forget(fs);
+    /* the live file system refers to what the checkpoint does instead, freeing what only it held */
+    for(j=0;j<fs->map_len;j++){ add_ref(fs, shadow_map(fs, cnum)[j]); }
+    release_map(fs, fs->root_map);
+    /* copy the shadow map to the root map */
+    memcpy(fs->root_map, shadow_map(fs, cnum), fs->map_len*sizeof(int));
+    fs->sp_dirty = 1;
+    commit_metadata(fs);
+    return 0;
+}
+
+int ssfs_restore_r(ssfs_t *fs, int cnum)
+{
+    long start = stat_now();
+    int r;
+    pthread_rwlock_wrlock(&fs->dir_lock);
+    r = restore_helper(fs, cnum);
+    pthread_rwlock_unlock(&fs->dir_lock);
+    return trace_call(fs, SSFS_STAT_RESTORE, start, stat_call(fs, SSFS_STAT_RESTORE, start, r, 0), cnum, 0, 0, NULL);
+}
+
+int ssfs_diff_r(ssfs_t *fs, int from, int to, ssfs_changes *diff)
+{
+    long start = stat_now();
+    int r;
+    pthread_rwlock_wrlock(&fs->dir_lock);
+    r = diff_helper(fs, from, to, diff);
+    pthread_rwlock_unlock(&fs->dir_lock);
+    return trace_call(fs, SSFS_STAT_DIFF, start, stat_call(fs, SSFS_STAT_DIFF, start, r, 0), from, to, 0, NULL);
+}
+
+/* sums the slots; counts made while they are summed may or may not be in it */
+void ssfs_get_stats_r(ssfs_t *fs, ssfs_stats *stats){
+    long *sum = (long *)stats, *slot;
+    int n = sizeof(ssfs_stats)/sizeof(long), i, k;
+    memset(stats, 0, sizeof(ssfs_stats));
+    for(k=0;k<stat_slot_num;k++){
+        slot = (long *)&fs->stats[k];
+        for(i=0;i<n;i++) { sum[i] += __atomic_load_n(&slot[i], __ATOMIC_RELAXED); }
+    }
+    stats->data_blocks_written = stats->block_writes - stats->meta_blocks_written;
+    stats->cache_hits = fs->cache_hits;
+    stats->cache_misses = fs->cache_misses;
+}
+
+void ssfs_reset_stats_r(ssfs_t *fs){
+    long *slot = (long *)fs->stats;
+    int n = stat_slot_num*sizeof(ssfs_stats)/sizeof(long), i;
+    for(i=0;i<n;i++) { __atomic_store_n(&slot[i], 0, __ATOMIC_RELAXED); }
+    ssfs_cache_reset_stats_r(fs);
+}
+
+const char *ssfs_stat_name(int call){
+    static const char *names[SSFS_STAT_CALLS] = {"mkssfs", "fopen", "fclose", "frseek", "fwseek", "fwrite", "fread", "remove",
+                                                 "commit", "restore", "pwrite", "pread", "batch", "fread_view", "diff"};
+    return call >= 0 && call < SSFS_STAT_CALLS ? names[call] : NULL;
+}
+
+long ssfs_stat_percentile(ssfs_call_stats *call, double p){
+    long rank = (long)(p*call->calls), seen = 0;
+    int b;
+    if(call->calls == 0) return 0;
+    if(rank >= call->calls) rank = call->calls-1;
+    for(b=0;b<SSFS_STAT_BUCKETS-1;b++){
+        seen += call->latency[b];
+        if(seen > rank) break;
+    }
+    return (2L << b) - 1;
+}
+
+int ssfs_trace_start_r(ssfs_t *fs, char *path){
+    ssfs_trace_header header;
+    FILE *trace;
+    pthread_mutex_lock(&fs->trace_lock);
+    if(fs->trace != NULL || (trace = fopen(path, "wb")) == NULL) { pthread_mutex_unlock(&fs->trace_lock); return -1; }
+    header.magic = SSFS_TRACE_MAGIC;
+    ssfs_get_geometry_r(fs, &header.geometry);
+    if( fwrite(&header, sizeof(header), 1, trace) != 1 ) { fclose(trace); pthread_mutex_unlock(&fs->trace_lock); return -1; }
+    fs->trace_start = stat_now();
+    __atomic_store_n(&fs->trace, trace, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&fs->trace_lock);
+    return 0;
+}
+
+int ssfs_trace_stop_r(ssfs_t *fs){
+    int r;
+    pthread_mutex_lock(&fs->trace_lock);
+    if(fs->trace == NULL) { pthread_mutex_unlock(&fs->trace_lock); return -1; }
+    r = fclose(fs->trace) == 0 ? 0 : -1;
+    __atomic_store_n(&fs->trace, NULL, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&fs->trace_lock);
+    return r;
+}
+
+void ssfs_free_changes(ssfs_changes *diff)
+{
+    free(diff->i_node); free(diff->block); free(diff->entry);
+    memset(diff, 0, sizeof(ssfs_changes));
+}
+
+/* returns a file system on the image filename, to be mounted by mkssfs_r; NULL if there is no memory for it */
+ssfs_t *ssfs_new(char *filename)
+{
+    ssfs_t *fs = (ssfs_t *)calloc(1, sizeof(ssfs_t));
+    if(fs == NULL || (fs->filename = strdup(filename)) == NULL) { free(fs); return NULL; }
+    fs->next_geometry.block_size = block_size_default;
+    fs->next_geometry.num_blocks = num_blocks_default;
+    fs->next_geometry.max_files = max_file_num_default;
+    fs->commit_return_value = -1;
+    fs->cache_capacity = cache_capacity_default;
+    fs->disk_backend = fs->next_backend = SSFS_BACKEND_EMU;
+    fs->aio_workers = aio_workers_default;
+    fs->aio_running = -1;
+    if((fs->stats = (ssfs_stats *)calloc(stat_slot_num, sizeof(ssfs_stats))) == NULL) { free(fs->filename); free(fs); return NULL; }
+    mmap_disk_init(&fs->disk);
+    aio_pool_init(&fs->aio);
+    init_locks(fs);
+    return fs;
+}
+
+/* writes back what the cache holds, closes the image and frees the file system */
+void ssfs_free(ssfs_t *fs)
+{
+    pthread_rwlock_wrlock(&fs->dir_lock);
+    wait_readahead(fs, -1);
+    if(fs->cache != NULL) cache_flush(fs);
+    if(fs->disk_backend == SSFS_BACKEND_MMAP) mmap_close_disk(&fs->disk);
+    release_emu(fs);
+    pthread_rwlock_unlock(&fs->dir_lock);
+    if(fs->trace != NULL) ssfs_trace_stop_r(fs);
+    aio_pool_destroy(&fs->aio);
+    free_layout(fs);
+    pthread_rwlock_destroy(&fs->dir_lock);
+    pthread_mutex_destroy(&fs->meta_lock);
+    pthread_mutex_destroy(&fs->ind_lock);
+    pthread_mutex_destroy(&fs->i_node_load_lock);
+    pthread_mutex_destroy(&fs->cache_lock);
+    pthread_mutex_destroy(&fs->group_lock);
+    pthread_cond_destroy(&fs->group_done);
+    pthread_mutex_destroy(&fs->trace_lock);
+    free(fs->stats);
+    free(fs->filename);
+    free(fs);
+}
+
+/* the calls without a file system work on this one, made on first use */
+ssfs_t         *default_fs = NULL;
+pthread_once_t  default_fs_once = PTHREAD_ONCE_INIT;
+
+void make_default_fs() { if((default_fs = ssfs_new("yjiang28_disk")) == NULL) exit(EXIT_FAILURE); }
+
+ssfs_t *the_fs()
+{
+    pthread_once(&default_fs_once, make_default_fs);
+    return default_fs;
+}
+
+void mkssfs(int fresh)                                          { if( mkssfs_r(the_fs(), fresh) <0 ) exit(EXIT_FAILURE); }
+int  ssfs_fopen(char *name)                                     { return ssfs_fopen_r(the_fs(), name); }
+int  ssfs_fclose(int fileID)                                    { return ssfs_fclose_r(the_fs(), fileID); }
+int  ssfs_frseek(int fileID, int loc)                           { return ssfs_frseek_r(the_fs(), fileID, loc); }
+int  ssfs_fwseek(int fileID, int loc)                           { return ssfs_fwseek_r(the_fs(), fileID, loc); }
+int  ssfs_fwrite(int fileID, char *buf, int length)             { return ssfs_fwrite_r(the_fs(), fileID, buf, length); }
+int  ssfs_fread(int fileID, char *buf, int length)              { return ssfs_fread_r(the_fs(), fileID, buf, length); }
+int  ssfs_remove(char *file)                                    { return ssfs_remove_r(the_fs(), file); }
+int  ssfs_commit()                                              { return ssfs_commit_r(the_fs()); }
+int  ssfs_restore(int cnum)                                     { return ssfs_restore_r(the_fs(), cnum); }
+int  ssfs_pwrite(int fileID, char *buf, int length, int offset) { return ssfs_pwrite_r(the_fs(), fileID, buf, length, offset); }
+int  ssfs_pread(int fileID, char *buf, int length, int offset)  { return ssfs_pread_r(the_fs(), fileID, buf, length, offset); }
+int  ssfs_batch(ssfs_op *ops, int num_ops)                      { return ssfs_batch_r(the_fs(), ops, num_ops); }
+int  ssfs_set_geometry(ssfs_geometry *geometry)                 { return ssfs_set_geometry_r(the_fs(), geometry); }
+void ssfs_get_geometry(ssfs_geometry *geometry)                 { ssfs_get_geometry_r(the_fs(), geometry); }
+int  ssfs_set_backend(int backend)                              { return ssfs_set_backend_r(the_fs(), backend); }
+int  ssfs_aio_config(int workers)                               { return ssfs_aio_config_r(the_fs(), workers); }
+int  ssfs_cache_config(int capacity)                            { return ssfs_cache_config_r(the_fs(), capacity); }
+void ssfs_cache_stats(long *hits, long *misses)                 { ssfs_cache_stats_r(the_fs(), hits, misses); }
+void ssfs_cache_reset_stats()                                   { ssfs_cache_reset_stats_r(the_fs()); }
+void ssfs_readahead_stats(long *issued, long *hits)             { ssfs_readahead_stats_r(the_fs(), issued, hits); }
+int  ssfs_journal_config(int durable)                           { return ssfs_journal_config_r(the_fs(), durable); }
+void ssfs_metadata_stats(long *bytes_written, long *operations, long *last_op_bytes) { ssfs_metadata_stats_r(the_fs(), bytes_written, operations, last_op_bytes); }
+int  ssfs_fread_view(int fileID, int length, ssfs_view *view)   { return ssfs_fread_view_r(the_fs(), fileID, length, view); }
+void ssfs_release_view(ssfs_view *view)                         { ssfs_release_view_r(the_fs(), view); }
+int  ssfs_diff(int from, int to, ssfs_changes *diff)            { return ssfs_diff_r(the_fs(), from, to, diff); }
+void ssfs_get_stats(ssfs_stats *stats)                          { ssfs_get_stats_r(the_fs(), stats); }
+void ssfs_reset_stats()                                         { ssfs_reset_stats_r(the_fs()); }
+int  ssfs_trace_start(char *path)                               { return ssfs_trace_start_r(the_fs(), path); }
+int  ssfs_trace_stop()                                          { return ssfs_trace_stop_r(the_fs()); }
@@ -0,0 +1,232 @@
+#ifndef SFS_API_EXT_H
+#define SFS_API_EXT_H
+
+/* extensions to the interface in sfs_api.h
+ * every ssfs_ call may be made from several threads; calls on different open files run in parallel,
+ * the others (mkssfs, ssfs_fopen, ssfs_fclose, ssfs_remove, ssfs_batch, ssfs_commit, ssfs_restore, ssfs_diff) one at a time
+ * an open file descriptor is used by one thread at a time, except by ssfs_pread
+ */
+
+/* a file system on an image of its own, see the reentrant calls at the end
+ * the calls of sfs_api.h and this file work on one made on first use over the image "yjiang28_disk"
+ */
+typedef struct ssfs ssfs_t;
+
+/* positional I/O: like ssfs_fwrite and ssfs_fread at byte offset offset, at most the file size,
+ * leaving the read and write pointers alone; reads of one file run in parallel
+ */
+int  ssfs_pwrite(int fileID, char *buf, int length, int offset);
+int  ssfs_pread(int fileID, char *buf, int length, int offset);
+
+/* batched operations on files by name, applied in order under one metadata commit
+ * returns # operations that succeeded; result holds what ssfs_fopen/ssfs_fwrite/ssfs_remove would return,
+ * 0 for a successful create
+ */
+#define SSFS_OP_CREATE 0    // create the file if it does not exist
+#define SSFS_OP_WRITE  1    // append length bytes of buf, creating the file if it does not exist
+#define SSFS_OP_REMOVE 2
+typedef struct ssfs_op{
+    int   type;
+    char *name;
+    char *buf;
+    int   length;
+    int   result;
+}ssfs_op;
+int  ssfs_batch(ssfs_op *ops, int num_ops);
+
+/* geometry of the image the next mkssfs(1) creates; mkssfs(0) takes it from the image
+ * block_size is a power of two from 512 to 65536, max_files counts the root directory's i-node too,
+ * 0 for one per 4 blocks; the default is 1024 byte blocks, 1027 blocks and 200 i-nodes
+ */
+typedef struct ssfs_geometry{
+    int block_size;
+    int num_blocks;
+    int max_files;
+}ssfs_geometry;
+int  ssfs_set_geometry(ssfs_geometry *geometry);
+void ssfs_get_geometry(ssfs_geometry *geometry);    // of the mounted image
+
+/* disk backend used from the next mkssfs on */
+#define SSFS_BACKEND_EMU  0     // read_blocks/write_blocks of disk_emu
+#define SSFS_BACKEND_MMAP 1     // the image mapped into memory, synced on ssfs_commit
+int  ssfs_set_backend(int backend);
+
+/* # threads serving queued block I/O, 0 (the default) to do all I/O in the calling thread
+ * with workers, readahead is queued and a read returns without waiting for it
+ */
+int  ssfs_aio_config(int workers);
+
+/* block cache: capacity in blocks, -1 while a view borrows from the cache; hit/miss counters
+ * data blocks are written back on ssfs_fclose, ssfs_commit and eviction; a crash loses what was written since,
+ * the metadata, indirect blocks included, stays consistent with what reached the image
+ */
+int  ssfs_cache_config(int capacity);
+void ssfs_cache_stats(long *hits, long *misses);
+void ssfs_cache_reset_stats();
+
+/* readahead on sequential reads: # blocks read ahead and # of them read from the cache afterwards,
+ * the hit rate is hits/issued; with the mapped image blocks are only advised and hits are not counted
+ * reset together with the cache counters
+ */
+void ssfs_readahead_stats(long *issued, long *hits);
+
+/* metadata journal: with durable set to 1, a call changing metadata returns once the change is synced to the image;
+ * calls made at the same time share a sync. 0 (the default) leaves syncing to ssfs_commit
+ */
+int  ssfs_journal_config(int durable);
+
+/* metadata written: total bytes, # operations that wrote any, bytes written by the last one */
+void ssfs_metadata_stats(long *bytes_written, long *operations, long *last_op_bytes);
+
+/* zero-copy reads: spans borrowed from the cache or the mapped image, valid until released
+ * a view is a snapshot that may go stale, later writes to what it covers may or may not show in it
+ */
+#define SSFS_VIEW_MAX_SPANS 64
+typedef struct ssfs_span{
+    const char *data;
+    int length;
+}ssfs_span;
+
+typedef struct ssfs_view{
+    int num_spans;
+    ssfs_span span[SSFS_VIEW_MAX_SPANS];
+    int pinned[SSFS_VIEW_MAX_SPANS];    // the cache entry each span keeps in place, -1 if none
+}ssfs_view;
+
+int  ssfs_fread_view(int fileID, int length, ssfs_view *view);
+void ssfs_release_view(ssfs_view *view);
+
+/* what changed from checkpoint from to checkpoint to, numbered as by ssfs_restore; either may be the live file system, SSFS_LIVE
+ * blocks both share are skipped whole, so the cost follows the change, not the size of the file system
+ * the blocks listed are where to read what changed, e.g. for an incremental backup of the live file system
+ */
+#define SSFS_LIVE -1
+typedef struct ssfs_changed_block{
+    int i_node;     // the file's i-node number
+    int index;      // the block's index in the file
+    int block;      // where the block is on the disk in to
+}ssfs_changed_block;
+
+typedef struct ssfs_changes{
+    int num_i_nodes;
+    int *i_node;            // i-nodes created, removed or changed
+    int num_blocks;
+    ssfs_changed_block *block; // data blocks of to that from does not have in the same place; a file small
+                               // enough to be kept in its i-node has none, a change to it lists the i-node only
+    int num_entries;
+    int *entry;             // slots of the root directory whose name or i-node changed
+}ssfs_changes;
+
+int  ssfs_diff(int from, int to, ssfs_changes *diff);
+void ssfs_free_changes(ssfs_changes *diff);
+
+/* statistics: each thread counts in a slot of its own with relaxed atomic adds, cheap enough to leave on,
+ * and reading sums the slots; counted from the first call on, reset by ssfs_reset_stats
+ */
+#define SSFS_STAT_MKSSFS     0  // the public call each ssfs_call_stats is for
+#define SSFS_STAT_FOPEN      1
+#define SSFS_STAT_FCLOSE     2
+#define SSFS_STAT_FRSEEK     3
+#define SSFS_STAT_FWSEEK     4
+#define SSFS_STAT_FWRITE     5
+#define SSFS_STAT_FREAD      6
+#define SSFS_STAT_REMOVE     7
+#define SSFS_STAT_COMMIT     8
+#define SSFS_STAT_RESTORE    9
+#define SSFS_STAT_PWRITE     10
+#define SSFS_STAT_PREAD      11
+#define SSFS_STAT_BATCH      12
+#define SSFS_STAT_FREAD_VIEW 13
+#define SSFS_STAT_DIFF       14
+#define SSFS_STAT_CALLS      15
+#define SSFS_STAT_BUCKETS    32 // latency[b] counts calls taking 2^b to 2^(b+1)-1 ns, the last one every longer call too
+
+typedef struct ssfs_call_stats{
+    long calls;
+    long errors;        // calls that returned -1
+    long bytes;         // bytes read or written
+    long latency[SSFS_STAT_BUCKETS];
+}ssfs_call_stats;
+
+typedef struct ssfs_stats{
+    ssfs_call_stats call[SSFS_STAT_CALLS];
+    long block_reads,           // blocks read from the disk backend
+         block_writes,          // blocks written to it; blocks of a mapped image changed in place are not counted
+         meta_blocks_written,   // of block_writes, metadata and the journal
+         data_blocks_written,   // the rest
+         alloc_scans,           // searches for unused blocks
+         alloc_words,           // words of the free block map they looked at
+         cache_hits,            // as ssfs_cache_stats
+         cache_misses;
+}ssfs_stats;
+
+void ssfs_get_stats(ssfs_stats *stats);
+void ssfs_reset_stats();                        // the cache and readahead counters too
+const char *ssfs_stat_name(int call);           // "fopen" for SSFS_STAT_FOPEN..., NULL past SSFS_STAT_CALLS
+long ssfs_stat_percentile(ssfs_call_stats *call, double p); // ns within which a fraction p of the calls returned, to the bucket
+
+/* tracing: from ssfs_trace_start to ssfs_trace_stop every call of ssfs_fopen, ssfs_fclose, ssfs_fwrite, ssfs_fread,
+ * ssfs_pwrite, ssfs_pread, ssfs_fread_view, ssfs_frseek, ssfs_fwseek, ssfs_remove, ssfs_batch, ssfs_commit, ssfs_restore
+ * and ssfs_diff is recorded to a file, sizes and offsets but not the data; sfs_replay drives a fresh image with it
+ * the file is an ssfs_trace_header, then an ssfs_trace_record per call in the order the calls returned,
+ * for ssfs_batch one per operation, those of a batch one after another
+ */
+#define SSFS_TRACE_MAGIC 0x53545243
+typedef struct ssfs_trace_header{
+    int magic;
+    ssfs_geometry geometry;     // of the image mounted when the trace started
+}ssfs_trace_header;
+
+typedef struct ssfs_trace_record{
+    long long time;     // ns from the start of the trace to the call
+    int  latency;       // ns the call took
+    int  call;          // SSFS_STAT_FOPEN...
+    int  file;          // the fileID, the checkpoint for ssfs_restore, from for ssfs_diff, the operation's type for ssfs_batch,
+                        // -1 for the other calls by name and ssfs_commit
+    int  arg;           // length or seek location, to for ssfs_diff
+    int  offset;        // of ssfs_pwrite and ssfs_pread; for ssfs_batch the # operations of the batch after this one
+    int  result;        // what the call returned, the operation's result for ssfs_batch
+    char name[12];      // of ssfs_fopen, ssfs_remove and the operation of ssfs_batch
+}ssfs_trace_record;
+
+int  ssfs_trace_start(char *path);  // -1 if a trace is already being recorded or path cannot be written
+int  ssfs_trace_stop();
+
+/* reentrant calls: each is the call without _r on the file system fs, and file systems share no state
+ * only one file system at a time mounts through SSFS_BACKEND_EMU, disk_emu holds a single image;
+ * mkssfs_r returns -1 if another one holds it
+ */
+ssfs_t *ssfs_new(char *filename);   // NULL if there is no memory for it
+void ssfs_free(ssfs_t *fs);         // writes back what is cached and closes the image
+int  mkssfs_r(ssfs_t *fs, int fresh);
+int  ssfs_fopen_r(ssfs_t *fs, char *name);
+int  ssfs_fclose_r(ssfs_t *fs, int fileID);
+int  ssfs_frseek_r(ssfs_t *fs, int fileID, int loc);
+int  ssfs_fwseek_r(ssfs_t *fs, int fileID, int loc);
+int  ssfs_fwrite_r(ssfs_t *fs, int fileID, char *buf, int length);
+int  ssfs_fread_r(ssfs_t *fs, int fileID, char *buf, int length);
+int  ssfs_remove_r(ssfs_t *fs, char *file);
+int  ssfs_commit_r(ssfs_t *fs);
+int  ssfs_restore_r(ssfs_t *fs, int cnum);
+int  ssfs_pwrite_r(ssfs_t *fs, int fileID, char *buf, int length, int offset);
+int  ssfs_pread_r(ssfs_t *fs, int fileID, char *buf, int length, int offset);
+int  ssfs_batch_r(ssfs_t *fs, ssfs_op *ops, int num_ops);
+int  ssfs_set_geometry_r(ssfs_t *fs, ssfs_geometry *geometry);
+void ssfs_get_geometry_r(ssfs_t *fs, ssfs_geometry *geometry);
+int  ssfs_set_backend_r(ssfs_t *fs, int backend);
+int  ssfs_aio_config_r(ssfs_t *fs, int workers);
+int  ssfs_cache_config_r(ssfs_t *fs, int capacity);
+void ssfs_cache_stats_r(ssfs_t *fs, long *hits, long *misses);
+void ssfs_cache_reset_stats_r(ssfs_t *fs);
+void ssfs_readahead_stats_r(ssfs_t *fs, long *issued, long *hits);
+int  ssfs_journal_config_r(ssfs_t *fs, int durable);
+void ssfs_metadata_stats_r(ssfs_t *fs, long *bytes_written, long *operations, long *last_op_bytes);
+int  ssfs_fread_view_r(ssfs_t *fs, int fileID, int length, ssfs_view *view);
+void ssfs_release_view_r(ssfs_t *fs, ssfs_view *view);
+int  ssfs_diff_r(ssfs_t *fs, int from, int to, ssfs_changes *diff);
+void ssfs_get_stats_r(ssfs_t *fs, ssfs_stats *stats);
+void ssfs_reset_stats_r(ssfs_t *fs);
+int  ssfs_trace_start_r(ssfs_t *fs, char *path);
+int  ssfs_trace_stop_r(ssfs_t *fs);
+
+#endif
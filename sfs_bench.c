@@ -0,0 +1,731 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "sfs_api.h"
+#include "sfs_api_ext.h"
+#include "disk_emu.h"
+/*
+Benchmarks for the file system, built from the same sources as the tests:
+  gcc -o sfs_bench sfs_bench.c sfs_api.c disk_mmap.c disk_aio.c disk_emu.c -lpthread
+Each benchmark prints one line per configuration.
+Run it as "sfs_bench mmap" to measure the memory-mapped backend instead of disk_emu,
+and as "sfs_bench json" (or "sfs_bench mmap json") to run only the latency suite, printed as JSON.
+*/
+#define BENCH_BLOCK 1024
+
+int backend = SSFS_BACKEND_EMU;
+int json = 0;
+
+double now_us(){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec*1e6 + ts.tv_nsec/1e3;
+}
+
+//The suites with threads print the # cores next to the # threads, more threads than cores cannot run at once
+long online_cores(){
+  return sysconf(_SC_NPROCESSORS_ONLN);
+}
+
+/*
+Sequential read cost per block for growing file sizes.
+With the radix block map the cost per block should stay flat as the file grows.
+*/
+int bench_seq_read(){
+  int sizes[] = {8, 32, 128, 256, 512, 900};
+  int num_sizes = sizeof(sizes)/sizeof(int);
+  char *buf = calloc(BENCH_BLOCK, sizeof(char));
+  printf("seq_read,file_blocks,us_per_block\n");
+  for(int s = 0; s < num_sizes; s++){
+    ssfs_cache_config(64);
+    mkssfs(1);
+    int fd = ssfs_fopen("seq");
+    if(fd < 0) return -1;
+    for(int i = 0; i < sizes[s]; i++)
+      ssfs_fwrite(fd, buf, BENCH_BLOCK);
+    //Keep the data out of the cache so every block is fetched from the disk
+    ssfs_cache_config(4);
+    ssfs_frseek(fd, 0);
+    double start = now_us();
+    for(int i = 0; i < sizes[s]; i++)
+      ssfs_fread(fd, buf, BENCH_BLOCK);
+    double elapsed = now_us() - start;
+    printf("seq_read,%d,%.3f\n", sizes[s], elapsed/sizes[s]);
+    ssfs_fclose(fd);
+  }
+  free(buf);
+  return 0;
+}
+
+/*
+Cost of a seek followed by a one byte read at random offsets, for growing file sizes.
+A seek only looks up the block it lands in; what grows with the file is the chance
+that the block is not in the cache.
+*/
+int bench_random_seek(){
+  int sizes[] = {8, 128, 900};
+  int num_sizes = sizeof(sizes)/sizeof(int);
+  int seeks = 10000;
+  char *buf = calloc(BENCH_BLOCK, sizeof(char));
+  printf("random_seek,file_blocks,us_per_seek\n");
+  for(int s = 0; s < num_sizes; s++){
+    mkssfs(1);
+    int fd = ssfs_fopen("seek");
+    for(int i = 0; i < sizes[s]; i++)
+      ssfs_fwrite(fd, buf, BENCH_BLOCK);
+    srand(1);
+    double start = now_us();
+    for(int i = 0; i < seeks; i++){
+      ssfs_frseek(fd, rand()%(sizes[s]*BENCH_BLOCK));
+      ssfs_fread(fd, buf, 1);
+    }
+    double elapsed = now_us() - start;
+    printf("random_seek,%d,%.3f\n", sizes[s], elapsed/seeks);
+    ssfs_fclose(fd);
+  }
+  free(buf);
+  return 0;
+}
+
+/*
+Throughput of large transfers through the file system next to the raw disk.
+Block aligned transfers should come close to the raw numbers.
+*/
+int bench_large_transfer(){
+  int sizes[] = {64*1024, 256*1024};
+  int num_sizes = sizeof(sizes)/sizeof(int);
+  int rounds = 8;
+  char *buf = calloc(256*1024, sizeof(char));
+  printf("transfer,bytes,fs_write_MBps,fs_read_MBps,raw_write_MBps,raw_read_MBps\n");
+  for(int s = 0; s < num_sizes; s++){
+    double fs_w = 0, fs_r = 0, raw_w = 0, raw_r = 0, start;
+    for(int r = 0; r < rounds; r++){
+      mkssfs(1);
+      int fd = ssfs_fopen("big");
+      start = now_us();
+      ssfs_fwrite(fd, buf, sizes[s]);
+      fs_w += now_us() - start;
+      ssfs_frseek(fd, 0);
+      start = now_us();
+      ssfs_fread(fd, buf, sizes[s]);
+      fs_r += now_us() - start;
+      ssfs_fclose(fd);
+      //The same # blocks straight through the disk emulator, past the metadata
+      if(backend != SSFS_BACKEND_EMU) continue;
+      start = now_us();
+      write_blocks(100, sizes[s]/BENCH_BLOCK, buf);
+      raw_w += now_us() - start;
+      start = now_us();
+      read_blocks(100, sizes[s]/BENCH_BLOCK, buf);
+      raw_r += now_us() - start;
+    }
+    double mb = (double)sizes[s]*rounds/(1024*1024);
+    //The raw columns are 0 when the raw disk was not measured
+    printf("transfer,%d,%.1f,%.1f,%.1f,%.1f\n", sizes[s], mb/(fs_w/1e6), mb/(fs_r/1e6),
+           raw_w > 0 ? mb/(raw_w/1e6) : 0, raw_r > 0 ? mb/(raw_r/1e6) : 0);
+  }
+  free(buf);
+  return 0;
+}
+
+/*
+Streaming a file front to back in small and large reads.
+Readahead should keep the hit rate close to 1 and the cost per block low.
+*/
+int bench_readahead(){
+  int chunks[] = {100, 1024, 4096};
+  int num_chunks = sizeof(chunks)/sizeof(int);
+  int file_blocks = 512;
+  char *buf = calloc(4096, sizeof(char));
+  printf("readahead,chunk_bytes,us_per_block,hit_rate\n");
+  for(int c = 0; c < num_chunks; c++){
+    ssfs_cache_config(64);
+    mkssfs(1);
+    int fd = ssfs_fopen("log");
+    for(int i = 0; i < file_blocks; i++)
+      ssfs_fwrite(fd, buf, BENCH_BLOCK);
+    //Start from an empty cache
+    ssfs_cache_config(64);
+    ssfs_cache_reset_stats();
+    ssfs_frseek(fd, 0);
+    double start = now_us();
+    while(ssfs_fread(fd, buf, chunks[c]) > 0);
+    double elapsed = now_us() - start;
+    long issued, hits;
+    ssfs_readahead_stats(&issued, &hits);
+    printf("readahead,%d,%.3f,%.2f\n", chunks[c], elapsed/file_blocks, issued > 0 ? (double)hits/issued : 0);
+    ssfs_fclose(fd);
+  }
+  free(buf);
+  return 0;
+}
+
+/*
+Large transfers with the block I/O queued to a pool of workers next to doing it inline.
+Scattered runs let the file system queue several requests per call.
+*/
+int bench_aio(){
+  int workers[] = {0, 1, 2, 4};
+  int num_workers = sizeof(workers)/sizeof(int);
+  int rounds = 8, bytes = 256*1024;
+  char *buf = calloc(bytes, sizeof(char));
+  printf("aio,workers,fs_write_MBps,fs_read_MBps\n");
+  for(int w = 0; w < num_workers; w++){
+    double fs_w = 0, fs_r = 0, start;
+    ssfs_aio_config(workers[w]);
+    for(int r = 0; r < rounds; r++){
+      mkssfs(1);
+      //Two files written a block at a time interleave their blocks, so the runs are short
+      int fd = ssfs_fopen("big"), other = ssfs_fopen("other");
+      for(int i = 0; i < bytes/BENCH_BLOCK; i++){
+        ssfs_fwrite(fd, buf, BENCH_BLOCK);
+        if(i%2) ssfs_fwrite(other, buf, BENCH_BLOCK);
+      }
+      ssfs_fwseek(fd, 0);
+      start = now_us();
+      ssfs_fwrite(fd, buf, bytes);
+      fs_w += now_us() - start;
+      ssfs_frseek(fd, 0);
+      start = now_us();
+      ssfs_fread(fd, buf, bytes);
+      fs_r += now_us() - start;
+      ssfs_fclose(fd);
+      ssfs_fclose(other);
+    }
+    double mb = (double)bytes*rounds/(1024*1024);
+    printf("aio,%d,%.1f,%.1f\n", workers[w], mb/(fs_w/1e6), mb/(fs_r/1e6));
+  }
+  ssfs_aio_config(0);
+  free(buf);
+  return 0;
+}
+
+/*
+Ingesting many small files one call at a time next to one ssfs_batch.
+The batch should write a fraction of the metadata.
+*/
+int bench_batch(){
+  int num_files = 150, bytes = 512;
+  char *buf = calloc(bytes, sizeof(char));
+  char names[150][8];
+  ssfs_op ops[150];
+  long meta_before, meta_after;
+  double start, elapsed;
+  for(int i = 0; i < num_files; i++)
+    sprintf(names[i], "s%d", i);
+  printf("ingest,method,us_per_file,meta_bytes_per_file\n");
+  mkssfs(1);
+  ssfs_metadata_stats(&meta_before, NULL, NULL);
+  start = now_us();
+  for(int i = 0; i < num_files; i++){
+    int fd = ssfs_fopen(names[i]);
+    ssfs_fwrite(fd, buf, bytes);
+    ssfs_fclose(fd);
+  }
+  elapsed = now_us() - start;
+  ssfs_metadata_stats(&meta_after, NULL, NULL);
+  printf("ingest,calls,%.2f,%ld\n", elapsed/num_files, (meta_after-meta_before)/num_files);
+  mkssfs(1);
+  for(int i = 0; i < num_files; i++){
+    ops[i].type = SSFS_OP_WRITE;
+    ops[i].name = names[i];
+    ops[i].buf = buf;
+    ops[i].length = bytes;
+  }
+  ssfs_metadata_stats(&meta_before, NULL, NULL);
+  start = now_us();
+  ssfs_batch(ops, num_files);
+  elapsed = now_us() - start;
+  ssfs_metadata_stats(&meta_after, NULL, NULL);
+  printf("ingest,batch,%.2f,%ld\n", elapsed/num_files, (meta_after-meta_before)/num_files);
+  free(buf);
+  return 0;
+}
+
+#define THREAD_BYTES (128*1024)
+
+/*
+Each thread writes a file of its own and reads it back, 16 blocks per call.
+*/
+void *bench_thread_worker(void *arg){
+  char name[8], *buf = calloc(16*BENCH_BLOCK, sizeof(char));
+  sprintf(name, "t%ld", (long)arg);
+  int fd = ssfs_fopen(name);
+  for(int acc = 0; fd >= 0 && acc < THREAD_BYTES; acc += 16*BENCH_BLOCK)
+    ssfs_fwrite(fd, buf, 16*BENCH_BLOCK);
+  ssfs_frseek(fd, 0);
+  for(int acc = 0; fd >= 0 && acc < THREAD_BYTES; acc += 16*BENCH_BLOCK)
+    ssfs_fread(fd, buf, 16*BENCH_BLOCK);
+  ssfs_fclose(fd);
+  free(buf);
+  return NULL;
+}
+
+/*
+Aggregate throughput with several threads working on different files at once.
+Operations on different files only share the allocator, the cache and the disk,
+but disk_emu I/O goes through one lock (emu_lock in sfs_api.c), so on the default backend
+this measures the cost of the threads contending, not how the file system scales.
+*/
+int bench_threads(){
+  int counts[] = {1, 2, 4, 8};
+  int num_counts = sizeof(counts)/sizeof(int);
+  pthread_t threads[8];
+  printf("threads,count,cores,MBps\n");
+  for(int c = 0; c < num_counts; c++){
+    mkssfs(1);
+    double start = now_us();
+    for(long t = 0; t < counts[c]; t++)
+      pthread_create(&threads[t], NULL, bench_thread_worker, (void *)t);
+    for(int t = 0; t < counts[c]; t++)
+      pthread_join(threads[t], NULL);
+    double elapsed = now_us() - start;
+    //Every thread both writes and reads its file
+    double mb = 2.0*THREAD_BYTES*counts[c]/(1024*1024);
+    printf("threads,%d,%ld,%.1f\n", counts[c], online_cores(), mb/(elapsed/1e6));
+  }
+  return 0;
+}
+
+/*
+Each thread writes and reads back a file of its own on a file system of its own.
+*/
+void *bench_context_worker(void *arg){
+  char name[24], *buf = calloc(16*BENCH_BLOCK, sizeof(char));
+  sprintf(name, "bench_ctx%ld", (long)arg);
+  ssfs_t *fs = ssfs_new(name);
+  ssfs_set_backend_r(fs, SSFS_BACKEND_MMAP);
+  if(mkssfs_r(fs, 1) == 0){
+    int fd = ssfs_fopen_r(fs, "c");
+    for(int acc = 0; fd >= 0 && acc < THREAD_BYTES; acc += 16*BENCH_BLOCK)
+      ssfs_fwrite_r(fs, fd, buf, 16*BENCH_BLOCK);
+    ssfs_frseek_r(fs, fd, 0);
+    for(int acc = 0; fd >= 0 && acc < THREAD_BYTES; acc += 16*BENCH_BLOCK)
+      ssfs_fread_r(fs, fd, buf, 16*BENCH_BLOCK);
+    ssfs_fclose_r(fs, fd);
+  }
+  ssfs_free(fs);
+  free(buf);
+  return NULL;
+}
+
+/*
+The same work as bench_threads, with every thread on an image of its own through the reentrant calls.
+The threads share no lock, cache or allocator, only the cores, so it can only grow up to the # cores;
+the images are mapped, disk_emu holds one image only. Includes making and closing each image.
+*/
+int bench_contexts(){
+  int counts[] = {1, 2, 4, 8};
+  int num_counts = sizeof(counts)/sizeof(int);
+  pthread_t threads[8];
+  printf("contexts,count,cores,MBps\n");
+  for(int c = 0; c < num_counts; c++){
+    double start = now_us();
+    for(long t = 0; t < counts[c]; t++)
+      pthread_create(&threads[t], NULL, bench_context_worker, (void *)t);
+    for(int t = 0; t < counts[c]; t++)
+      pthread_join(threads[t], NULL);
+    double elapsed = now_us() - start;
+    double mb = 2.0*THREAD_BYTES*counts[c]/(1024*1024);
+    printf("contexts,%d,%ld,%.1f\n", counts[c], online_cores(), mb/(elapsed/1e6));
+  }
+  return 0;
+}
+
+#define PREAD_FILE_BYTES (512*1024)
+#define PREAD_CALLS 2000
+
+int pread_fd;
+
+/*
+Each thread reads 4KB at random offsets of one shared file.
+*/
+void *bench_pread_worker(void *arg){
+  char *buf = calloc(4096, sizeof(char));
+  unsigned int seed = (unsigned int)(long)arg + 1;
+  for(int i = 0; i < PREAD_CALLS; i++)
+    ssfs_pread(pread_fd, buf, 4096, rand_r(&seed)%(PREAD_FILE_BYTES-4096));
+  free(buf);
+  return NULL;
+}
+
+/*
+Random reads of one file from several threads through the same descriptor.
+Positional reads hold the file only for reading, so they do not wait for each other;
+with disk_emu the disk lock still serializes them.
+*/
+int bench_pread(){
+  int counts[] = {1, 2, 4, 8};
+  int num_counts = sizeof(counts)/sizeof(int);
+  pthread_t threads[8];
+  char *buf = calloc(PREAD_FILE_BYTES, sizeof(char));
+  mkssfs(1);
+  pread_fd = ssfs_fopen("shared");
+  ssfs_fwrite(pread_fd, buf, PREAD_FILE_BYTES);
+  printf("pread,threads,cores,MBps\n");
+  for(int c = 0; c < num_counts; c++){
+    double start = now_us();
+    for(long t = 0; t < counts[c]; t++)
+      pthread_create(&threads[t], NULL, bench_pread_worker, (void *)t);
+    for(int t = 0; t < counts[c]; t++)
+      pthread_join(threads[t], NULL);
+    double elapsed = now_us() - start;
+    double mb = 4096.0*PREAD_CALLS*counts[c]/(1024*1024);
+    printf("pread,%d,%ld,%.1f\n", counts[c], online_cores(), mb/(elapsed/1e6));
+  }
+  ssfs_fclose(pread_fd);
+  free(buf);
+  return 0;
+}
+
+#define APPENDS 200
+
+/*
+Each thread appends small records to a file of its own, each append committing metadata.
+*/
+void *bench_append_worker(void *arg){
+  char name[8], record[64] = {0};
+  sprintf(name, "a%ld", (long)arg);
+  int fd = ssfs_fopen(name);
+  for(int i = 0; fd >= 0 && i < APPENDS; i++)
+    ssfs_fwrite(fd, record, sizeof(record));
+  ssfs_fclose(fd);
+  return NULL;
+}
+
+/*
+Latency of small appends, dominated by committing the metadata they change,
+without and with syncing every commit. Threads committing at the same time share journal writes.
+*/
+int bench_commit(){
+  int counts[] = {1, 4, 8};
+  int num_counts = sizeof(counts)/sizeof(int);
+  pthread_t threads[8];
+  long meta_before, meta_after, ops_before, ops_after;
+  printf("commit,durable,threads,us_per_append,meta_bytes_per_append,appends_per_commit\n");
+  for(int c = 0; c < 2*num_counts; c++){
+    int durable = c/num_counts;
+    ssfs_journal_config(durable);
+    mkssfs(1);
+    ssfs_metadata_stats(&meta_before, &ops_before, NULL);
+    double start = now_us();
+    for(long t = 0; t < counts[c%num_counts]; t++)
+      pthread_create(&threads[t], NULL, bench_append_worker, (void *)t);
+    for(int t = 0; t < counts[c%num_counts]; t++)
+      pthread_join(threads[t], NULL);
+    double elapsed = now_us() - start;
+    ssfs_metadata_stats(&meta_after, &ops_after, NULL);
+    int appends = APPENDS*counts[c%num_counts];
+    printf("commit,%d,%d,%.2f,%ld,%.2f\n", durable, counts[c%num_counts], elapsed/appends,
+           (meta_after-meta_before)/appends, (double)appends/(ops_after-ops_before));
+  }
+  ssfs_journal_config(0);
+  return 0;
+}
+
+/*
+Time to mount an image with every i-node in use, for growing i-node tables, and to open one of the files afterwards.
+Mounting reads the superblock and bitmaps only; the i-node file and the root directory
+are read when first used, so the mount time should not grow with the table.
+The first open reads the whole root directory though: the cost is deferred, not saved,
+and mount plus first open still grows with the table.
+*/
+#define MOUNTS 200
+int bench_mount(){
+  int sizes[] = {200, 2000, 20000};
+  int num_sizes = sizeof(sizes)/sizeof(int);
+  char (*names)[12] = malloc(20000*sizeof(*names));
+  ssfs_op *ops = malloc(20000*sizeof(ssfs_op));
+  ssfs_geometry geometry = {BENCH_BLOCK, 32768, 0}, normal = {BENCH_BLOCK, 1027, 200};
+  printf("mount,max_files,us_per_mount,us_first_open,us_mount_and_first_open\n");
+  for(int s = 0; s < num_sizes; s++){
+    geometry.max_files = sizes[s];
+    ssfs_set_geometry(&geometry);
+    mkssfs(1);
+    //The root directory takes one i-node
+    int files = sizes[s]-1;
+    for(int i = 0; i < files; i++){
+      sprintf(names[i], "m%d", i);
+      ops[i].type = SSFS_OP_WRITE;
+      ops[i].name = names[i];
+      ops[i].buf = names[i];
+      ops[i].length = strlen(names[i]);
+    }
+    ssfs_batch(ops, files);
+    double elapsed = 0, open = 0;
+    for(int m = 0; m < MOUNTS; m++){
+      double start = now_us();
+      mkssfs(0);
+      double mounted = now_us();
+      int fd = ssfs_fopen(names[files-1]);
+      open += now_us() - mounted;
+      elapsed += mounted - start;
+      ssfs_fclose(fd);
+    }
+    printf("mount,%d,%.2f,%.2f,%.2f\n", sizes[s], elapsed/MOUNTS, open/MOUNTS, (elapsed+open)/MOUNTS);
+  }
+  ssfs_set_geometry(&normal);
+  free(names);
+  free(ops);
+  return 0;
+}
+
+/*
+Small files written and read back whole, one call each.
+Files of up to 56 bytes are kept in their i-nodes and cost no data block I/O.
+*/
+int bench_tiny(){
+  int sizes[] = {16, 56, 200};
+  int num_sizes = sizeof(sizes)/sizeof(int);
+  int files = 150;
+  char name[8], buf[200] = {0};
+  ssfs_stats stats;
+  printf("tiny,bytes,us_per_file,data_blocks_per_file,block_reads_per_file\n");
+  for(int s = 0; s < num_sizes; s++){
+    mkssfs(1);
+    ssfs_reset_stats();
+    double start = now_us();
+    for(int i = 0; i < files; i++){
+      sprintf(name, "t%d", i);
+      int fd = ssfs_fopen(name);
+      ssfs_fwrite(fd, buf, sizes[s]);
+      ssfs_frseek(fd, 0);
+      ssfs_fread(fd, buf, sizes[s]);
+      ssfs_fclose(fd);
+    }
+    double elapsed = now_us() - start;
+    ssfs_get_stats(&stats);
+    printf("tiny,%d,%.2f,%.2f,%.2f\n", sizes[s], elapsed/files,
+           (double)stats.data_blocks_written/files, (double)stats.block_reads/files);
+  }
+  return 0;
+}
+
+/*
+Latency suite: every operation is timed one call at a time and reported with the rate the calls ran at
+and the p50/p99 latency in us, one CSV line or JSON object per operation and parameter.
+MBps is 0 for operations that move no data.
+*/
+#define SUITE_SAMPLES 4096
+#define SUITE_FILE_BYTES (256*1024)
+
+double samples[SUITE_SAMPLES];
+int num_samples;
+int num_reported;
+
+int compare_samples(const void *a, const void *b){
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+/* the sample below which a fraction p of the sorted samples lie */
+double percentile(double p){
+  int i = (int)(p*num_samples);
+  return samples[i < num_samples ? i : num_samples-1];
+}
+
+void sample(double start){
+  if(num_samples < SUITE_SAMPLES)
+    samples[num_samples++] = now_us() - start;
+}
+
+/* reports the samples taken since the last report, bytes_per_op moved by each */
+void report(char *op, int param, int bytes_per_op){
+  double total = 0;
+  for(int i = 0; i < num_samples; i++)
+    total += samples[i];
+  qsort(samples, num_samples, sizeof(double), compare_samples);
+  double ops = total > 0 ? num_samples/(total/1e6) : 0;
+  double mbps = ops*bytes_per_op/(1024*1024);
+  if(json)
+    printf("%s\n  {\"op\": \"%s\", \"param\": %d, \"samples\": %d, \"ops_per_s\": %.1f, \"MBps\": %.1f, \"p50_us\": %.2f, \"p99_us\": %.2f}",
+           num_reported ? "," : "", op, param, num_samples, ops, mbps, percentile(0.5), percentile(0.99));
+  else
+    printf("latency,%s,%d,%d,%.1f,%.1f,%.2f,%.2f\n", op, param, num_samples, ops, mbps, percentile(0.5), percentile(0.99));
+  num_reported++;
+  num_samples = 0;
+}
+
+/*
+Creating files, and opening and closing ones that exist.
+*/
+void suite_files(){
+  char name[8];
+  int files = 150, rounds = 10;
+  mkssfs(1);
+  for(int i = 0; i < files; i++){
+    sprintf(name, "f%d", i);
+    double start = now_us();
+    int fd = ssfs_fopen(name);
+    sample(start);
+    ssfs_fclose(fd);
+  }
+  report("create", files, 0);
+  for(int r = 0; r < rounds; r++)
+    for(int i = 0; i < files; i++){
+      sprintf(name, "f%d", i);
+      double start = now_us();
+      ssfs_fclose(ssfs_fopen(name));
+      sample(start);
+    }
+  report("open_close", files, 0);
+}
+
+/*
+Appending a file and reading it back front to back, transfer bytes per call,
+on enough files for 256 calls of each size. The reads start from an empty cache.
+*/
+void suite_sequential(){
+  int transfers[] = {1024, 4096, 65536};
+  int num_transfers = sizeof(transfers)/sizeof(int);
+  char *buf = calloc(65536, sizeof(char));
+  for(int t = 0; t < num_transfers; t++){
+    int per_file = SUITE_FILE_BYTES/transfers[t];
+    int rounds = (256+per_file-1)/per_file;
+    double read_samples[256];
+    int num_read = 0;
+    for(int r = 0; r < rounds; r++){
+      mkssfs(1);
+      int fd = ssfs_fopen("seq");
+      for(int i = 0; i < per_file; i++){
+        double start = now_us();
+        ssfs_fwrite(fd, buf, transfers[t]);
+        sample(start);
+      }
+      ssfs_cache_config(64);
+      ssfs_frseek(fd, 0);
+      for(int i = 0; i < per_file && num_read < 256; i++){
+        double start = now_us();
+        ssfs_fread(fd, buf, transfers[t]);
+        read_samples[num_read++] = now_us() - start;
+      }
+      ssfs_fclose(fd);
+    }
+    report("seq_write", transfers[t], transfers[t]);
+    memcpy(samples, read_samples, num_read*sizeof(double));
+    num_samples = num_read;
+    report("seq_read", transfers[t], transfers[t]);
+  }
+  free(buf);
+}
+
+/*
+4KB reads and writes at random 4KB aligned offsets of one file, and seeks to random offsets
+each followed by a one byte read. The rate of the 4KB calls is their IOPS.
+*/
+void suite_random(){
+  int calls = 2000;
+  unsigned int seed = 1;
+  char *buf = calloc(4096, sizeof(char));
+  mkssfs(1);
+  int fd = ssfs_fopen("rand");
+  for(int acc = 0; acc < SUITE_FILE_BYTES; acc += 4096)
+    ssfs_fwrite(fd, buf, 4096);
+  for(int i = 0; i < calls; i++){
+    int offset = rand_r(&seed)%(SUITE_FILE_BYTES/4096)*4096;
+    double start = now_us();
+    ssfs_pread(fd, buf, 4096, offset);
+    sample(start);
+  }
+  report("rand_read", 4096, 4096);
+  for(int i = 0; i < calls; i++){
+    int offset = rand_r(&seed)%(SUITE_FILE_BYTES/4096)*4096;
+    double start = now_us();
+    ssfs_pwrite(fd, buf, 4096, offset);
+    sample(start);
+  }
+  report("rand_write", 4096, 4096);
+  for(int i = 0; i < calls; i++){
+    int offset = rand_r(&seed)%SUITE_FILE_BYTES;
+    double start = now_us();
+    ssfs_frseek(fd, offset);
+    ssfs_fread(fd, buf, 1);
+    sample(start);
+  }
+  report("seek", SUITE_FILE_BYTES, 0);
+  ssfs_fclose(fd);
+  free(buf);
+}
+
+/*
+Taking a checkpoint after a small change, restoring one, and mounting the image,
+on a file system holding a few files. Param is the # files.
+*/
+void suite_checkpoints(){
+  char name[8], record[64] = {0};
+  int files = 20, rounds = 50, mounts = 100;
+  int cnum[50];
+  mkssfs(1);
+  for(int i = 0; i < files; i++){
+    sprintf(name, "c%d", i);
+    int fd = ssfs_fopen(name);
+    ssfs_fwrite(fd, record, sizeof(record));
+    ssfs_fclose(fd);
+  }
+  int fd = ssfs_fopen("c0");
+  for(int r = 0; r < rounds; r++){
+    ssfs_fwrite(fd, record, sizeof(record));
+    double start = now_us();
+    cnum[r] = ssfs_commit();
+    sample(start);
+  }
+  ssfs_fclose(fd);
+  report("commit", files, 0);
+  //Only the last checkpoints are kept, restore the ones still held
+  for(int r = 0; r < rounds; r++){
+    double start = now_us();
+    ssfs_restore(cnum[rounds-1-r%5]);
+    sample(start);
+  }
+  report("restore", files, 0);
+  for(int m = 0; m < mounts; m++){
+    double start = now_us();
+    mkssfs(0);
+    sample(start);
+  }
+  report("mount", files, 0);
+}
+
+int bench_latency(){
+  num_reported = 0;
+  if(json)
+    printf("{\"backend\": \"%s\", \"results\": [", backend == SSFS_BACKEND_MMAP ? "mmap" : "emu");
+  else
+    printf("latency,op,param,samples,ops_per_s,MBps,p50_us,p99_us\n");
+  suite_files();
+  suite_sequential();
+  suite_random();
+  suite_checkpoints();
+  if(json)
+    printf("\n]}\n");
+  return 0;
+}
+
+int main(int argc, char **argv){
+  for(int i = 1; i < argc; i++){
+    if(strcmp(argv[i], "mmap") == 0)
+      backend = SSFS_BACKEND_MMAP;
+    else if(strcmp(argv[i], "json") == 0)
+      json = 1;
+  }
+  ssfs_set_backend(backend);
+  if(json)
+    return bench_latency();
+  bench_seq_read();
+  bench_random_seek();
+  bench_large_transfer();
+  bench_readahead();
+  bench_aio();
+  bench_batch();
+  bench_threads();
+  bench_pread();
+  bench_commit();
+  bench_mount();
+  bench_contexts();
+  bench_tiny();
+  bench_latency();
+  return 0;
+}
@@ -0,0 +1,169 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "sfs_api.h"
+#include "sfs_api_ext.h"
+/*
+Replays a trace recorded with ssfs_trace_start against a fresh image of the recorded geometry:
+  gcc -o sfs_replay sfs_replay.c sfs_api.c disk_mmap.c disk_aio.c disk_emu.c -lpthread
+  sfs_replay trace [paced] [mmap]
+The calls are made one at a time in the order they returned, as fast as possible,
+or with "paced" each no earlier than it was made in the trace. The trace holds no data, writes write zeros.
+The operations recorded for a batch are applied as one batch again.
+Prints the throughput, the # calls and batch operations whose outcome differed from the recorded one,
+and per call the recorded and replayed p50/p99 latency in ns, to the latency bucket.
+*/
+#define REPLAY_IMAGE "replay_disk"
+
+double now_us(){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec*1e6 + ts.tv_nsec/1e3;
+}
+
+void wait_until(double due_us){
+  double left = due_us - now_us();
+  if(left <= 0) return;
+  struct timespec ts = {(time_t)(left/1e6), (long)((left - (long)(left/1e6)*1e6)*1e3)};
+  nanosleep(&ts, NULL);
+}
+
+/* counts a recorded latency into the bucket ssfs_get_stats would */
+void count_recorded(ssfs_call_stats *call, int ns){
+  int bucket = ns < 2 ? 0 : 31 - __builtin_clz(ns);
+  if(bucket >= SSFS_STAT_BUCKETS) bucket = SSFS_STAT_BUCKETS-1;
+  call->calls++;
+  call->latency[bucket]++;
+}
+
+int main(int argc, char **argv){
+  int paced = 0, backend = SSFS_BACKEND_EMU;
+  if(argc < 2){
+    fprintf(stderr, "usage: %s trace [paced] [mmap]\n", argv[0]);
+    return 1;
+  }
+  for(int i = 2; i < argc; i++){
+    if(strcmp(argv[i], "paced") == 0) paced = 1;
+    else if(strcmp(argv[i], "mmap") == 0) backend = SSFS_BACKEND_MMAP;
+  }
+  FILE *trace = fopen(argv[1], "rb");
+  ssfs_trace_header header;
+  if(trace == NULL || fread(&header, sizeof(header), 1, trace) != 1 || header.magic != SSFS_TRACE_MAGIC){
+    fprintf(stderr, "%s is not a trace\n", argv[1]);
+    return 1;
+  }
+  ssfs_t *fs = ssfs_new(REPLAY_IMAGE);
+  if(fs == NULL) return 1;
+  //A trace started before the first mount has no geometry, the default one is used then
+  if(header.geometry.block_size > 0) ssfs_set_geometry_r(fs, &header.geometry);
+  ssfs_set_backend_r(fs, backend);
+  if(mkssfs_r(fs, 1) < 0){
+    fprintf(stderr, "cannot make %s\n", REPLAY_IMAGE);
+    return 1;
+  }
+  ssfs_geometry geometry;
+  ssfs_get_geometry_r(fs, &geometry);
+  //The fileID each recorded one is in the replay, -1 if it is not open
+  int *file = malloc(geometry.max_files*sizeof(int));
+  for(int i = 0; i < geometry.max_files; i++)
+    file[i] = -1;
+  ssfs_call_stats recorded[SSFS_STAT_CALLS];
+  memset(recorded, 0, sizeof(recorded));
+  char *buf = NULL;
+  int buf_size = 0;
+  //The operations of the batch being read, applied once its last one is
+  ssfs_trace_record *batch = NULL;
+  ssfs_op *ops = NULL;
+  int num_ops = 0, ops_size = 0;
+  ssfs_view view;
+  ssfs_changes changes;
+  long calls = 0, mismatches = 0, bytes = 0;
+  ssfs_trace_record rec;
+  ssfs_reset_stats_r(fs);
+  double start = now_us();
+  while(fread(&rec, sizeof(rec), 1, trace) == 1){
+    if(rec.call < 0 || rec.call >= SSFS_STAT_CALLS) continue;
+    if(rec.arg > buf_size){
+      buf_size = rec.arg;
+      buf = realloc(buf, buf_size);
+      memset(buf, 0, buf_size);
+    }
+    if(paced) wait_until(start + rec.time/1e3);
+    int fd = rec.file >= 0 && rec.file < geometry.max_files ? file[rec.file] : -1, r = -1;
+    switch(rec.call){
+      case SSFS_STAT_FOPEN:
+        r = ssfs_fopen_r(fs, rec.name);
+        if(rec.result >= 0 && rec.result < geometry.max_files) file[rec.result] = r;
+        break;
+      case SSFS_STAT_FCLOSE:
+        r = ssfs_fclose_r(fs, fd);
+        if(rec.result == 0 && rec.file < geometry.max_files) file[rec.file] = -1;
+        break;
+      case SSFS_STAT_FWRITE:  r = ssfs_fwrite_r(fs, fd, buf, rec.arg); break;
+      case SSFS_STAT_FREAD:   r = ssfs_fread_r(fs, fd, buf, rec.arg); break;
+      case SSFS_STAT_FREAD_VIEW:
+        r = ssfs_fread_view_r(fs, fd, rec.arg, &view);
+        ssfs_release_view_r(fs, &view);
+        break;
+      case SSFS_STAT_PWRITE:  r = ssfs_pwrite_r(fs, fd, buf, rec.arg, rec.offset); break;
+      case SSFS_STAT_PREAD:   r = ssfs_pread_r(fs, fd, buf, rec.arg, rec.offset); break;
+      case SSFS_STAT_FRSEEK:  r = ssfs_frseek_r(fs, fd, rec.arg); break;
+      case SSFS_STAT_FWSEEK:  r = ssfs_fwseek_r(fs, fd, rec.arg); break;
+      case SSFS_STAT_REMOVE:  r = ssfs_remove_r(fs, rec.name); break;
+      case SSFS_STAT_COMMIT:  r = ssfs_commit_r(fs); break;
+      //From a fresh image the checkpoints are numbered as they were when recorded
+      case SSFS_STAT_RESTORE: r = ssfs_restore_r(fs, rec.file); break;
+      case SSFS_STAT_DIFF:
+        r = ssfs_diff_r(fs, rec.file, rec.arg, &changes);
+        if(r == 0) ssfs_free_changes(&changes);
+        break;
+      //The last operation of a batch is checked and counted as the call, the others here
+      case SSFS_STAT_BATCH:
+        if(num_ops == ops_size){
+          ops_size = 2*ops_size+8;
+          batch = realloc(batch, ops_size*sizeof(ssfs_trace_record));
+          ops = realloc(ops, ops_size*sizeof(ssfs_op));
+        }
+        batch[num_ops++] = rec;
+        if(rec.offset > 0) continue;
+        for(int k = 0; k < num_ops; k++){
+          ssfs_op op = {batch[k].file, batch[k].name, buf, batch[k].arg, 0};
+          ops[k] = op;
+        }
+        ssfs_batch_r(fs, ops, num_ops);
+        for(int k = 0; k < num_ops-1; k++){
+          if((ops[k].result < 0) != (batch[k].result < 0)) mismatches++;
+          if(ops[k].type == SSFS_OP_WRITE && ops[k].result > 0) bytes += ops[k].result;
+        }
+        r = ops[num_ops-1].result;
+        num_ops = 0;
+        break;
+      default: continue;
+    }
+    if((r < 0) != (rec.result < 0)) mismatches++;
+    if(r > 0 && rec.call != SSFS_STAT_FOPEN && rec.call != SSFS_STAT_COMMIT) bytes += r;
+    count_recorded(&recorded[rec.call], rec.latency);
+    calls++;
+  }
+  double elapsed = now_us() - start;
+  ssfs_stats replayed;
+  ssfs_get_stats_r(fs, &replayed);
+  printf("replay,calls,seconds,calls_per_s,MBps,mismatches\n");
+  printf("replay,%ld,%.3f,%.1f,%.1f,%ld\n", calls, elapsed/1e6, calls/(elapsed/1e6),
+         bytes/(1024.0*1024)/(elapsed/1e6), mismatches);
+  printf("call,name,count,recorded_p50_ns,recorded_p99_ns,replay_p50_ns,replay_p99_ns\n");
+  for(int c = 0; c < SSFS_STAT_CALLS; c++){
+    if(recorded[c].calls == 0) continue;
+    printf("call,%s,%ld,%ld,%ld,%ld,%ld\n", ssfs_stat_name(c), recorded[c].calls,
+           ssfs_stat_percentile(&recorded[c], 0.5), ssfs_stat_percentile(&recorded[c], 0.99),
+           ssfs_stat_percentile(&replayed.call[c], 0.5), ssfs_stat_percentile(&replayed.call[c], 0.99));
+  }
+  fclose(trace);
+  ssfs_free(fs);
+  free(file);
+  free(buf);
+  free(batch);
+  free(ops);
+  return mismatches > 0;
+}
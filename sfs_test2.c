@@ -0,0 +1,1259 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <pthread.h>
+#include "sfs_api.h"
+#include "sfs_api_ext.h"
+/*
+Behavioral tests of the extensions beyond sfs_api.h, built from the same sources as sfs_test1.c:
+  gcc -o sfs_test2 sfs_test2.c sfs_api.c disk_mmap.c disk_aio.c disk_emu.c -lpthread
+Each test starts from a fresh image and adds the checks that failed to err_no.
+A crash is simulated by a child process that ends with _exit, so that nothing it still held in memory reaches the image.
+*/
+#define TEST_BLOCK 1024
+
+int backend = SSFS_BACKEND_EMU;   // of every test but those that choose one
+
+/* counts a failed check */
+void check(int ok, char *what, int *err_no){
+  if(ok) return;
+  printf("ERROR: %s\n", what);
+  (*err_no)++;
+}
+
+/* fills buf with bytes that depend on seed and the offset */
+void fill(char *buf, int length, int seed){
+  for(int i = 0; i < length; i++)
+    buf[i] = (char)(seed*31 + i*7 + i/TEST_BLOCK);
+}
+
+/* 1 if the file holds exactly length bytes equal to buf */
+int file_matches(char *name, char *buf, int length){
+  char *read_buf = malloc(length+1);
+  int fd = ssfs_fopen(name), ok;
+  ok = fd >= 0 && ssfs_fread(fd, read_buf, length+1) == length && memcmp(read_buf, buf, length) == 0;
+  if(fd >= 0) ssfs_fclose(fd);
+  free(read_buf);
+  return ok;
+}
+
+/* runs crash in a child process, on the image the caller mounted, and waits for it */
+void run_crashed(void (*crash)()){
+  pid_t child = fork();
+  if(child == 0){
+    crash();
+    _exit(0);
+  }
+  waitpid(child, NULL, 0);
+}
+
+/*
+Write-back cache: a cache of a few blocks is cycled through by several files,
+and what was written is read back from the cache and again after a remount.
+*/
+int test_cache_remount(){
+  printf("\n-------------------------------\nInitializing cache test.\n--------------------------------\n\n");
+  char *names[] = {"c0", "c1", "c2"};
+  int num_file = 3, length = 20*TEST_BLOCK, err_no = 0, fd[3];
+  char *buf[3];
+  long hits, misses;
+  ssfs_cache_config(8);
+  mkssfs(1);
+  for(int i = 0; i < num_file; i++){
+    buf[i] = malloc(length);
+    fill(buf[i], length, i);
+    fd[i] = ssfs_fopen(names[i]);
+    check(fd[i] >= 0, "cannot open a new file", &err_no);
+  }
+  //Interleaved partial blocks, so that each one goes through the cache and is evicted dirty
+  for(int off = 0; off < length; off += 100)
+    for(int i = 0; i < num_file; i++){
+      int n = length-off < 100 ? length-off : 100;
+      check(ssfs_fwrite(fd[i], buf[i]+off, n) == n, "short write", &err_no);
+    }
+  //A block just written is read from the cache
+  ssfs_cache_reset_stats();
+  char small[100];
+  check(ssfs_frseek(fd[0], length-100) == 0 && ssfs_fread(fd[0], small, 100) == 100, "cannot read back the last block", &err_no);
+  ssfs_cache_stats(&hits, &misses);
+  check(hits > 0 && misses == 0, "the last block written is not in the cache", &err_no);
+  for(int i = 0; i < num_file; i++){
+    check(ssfs_fclose(fd[i]) == 0, "cannot close a file", &err_no);
+    check(file_matches(names[i], buf[i], length), "a file reads back differently before the remount", &err_no);
+  }
+  //What the cache held reached the image
+  mkssfs(0);
+  for(int i = 0; i < num_file; i++){
+    check(file_matches(names[i], buf[i], length), "a file reads back differently after the remount", &err_no);
+    free(buf[i]);
+  }
+  ssfs_cache_config(64);
+  printf("\n-------------------------------\nCache test Finished.\nCurrent Error Num: %d\n--------------------------------\n\n", err_no);
+  return err_no;
+}
+
+/*
+Batched operations: each op's result is what the call it stands for returns,
+and the batch returns how many of them succeeded.
+*/
+int test_batch_results(){
+  printf("\n-------------------------------\nInitializing batch test.\n--------------------------------\n\n");
+  int err_no = 0, length = 3*TEST_BLOCK+10;
+  char *buf = malloc(2*length);
+  fill(buf, 2*length, 4);
+  mkssfs(1);
+  ssfs_op ops[] = {
+    {SSFS_OP_CREATE, "b0", NULL, 0, 0},
+    {SSFS_OP_CREATE, "b0", NULL, 0, 0},       //exists already
+    {SSFS_OP_WRITE,  "b1", buf, length, 0},    //creates it
+    {SSFS_OP_WRITE,  "b1", buf+length, length, 0},
+    {SSFS_OP_WRITE,  "b0", buf, 0, 0},
+    {SSFS_OP_WRITE,  "b2", buf, -1, 0},
+    {SSFS_OP_REMOVE, "none", NULL, 0, 0},
+    {SSFS_OP_WRITE,  "b3", buf, 10, 0},
+    {SSFS_OP_REMOVE, "b3", NULL, 0, 0},
+    {7,              "b4", NULL, 0, 0}          //no such op
+  };
+  int expected[] = {0, 0, length, length, 0, -1, -1, 10, 0, -1};
+  int num_ops = sizeof(ops)/sizeof(ssfs_op);
+  check(ssfs_batch(ops, num_ops) == 7, "the batch does not count the ops that succeeded", &err_no);
+  for(int k = 0; k < num_ops; k++)
+    check(ops[k].result == expected[k], "an op of the batch has the wrong result", &err_no);
+  check(file_matches("b0", buf, 0), "b0 is not empty", &err_no);
+  check(file_matches("b1", buf, 2*length), "b1 does not hold both writes", &err_no);
+  check(ssfs_remove("b3") == -1, "b3 was not removed", &err_no);
+  check(ssfs_remove("b2") == -1, "b2 was created by a failed write", &err_no);
+  //What the batch did is on the image
+  mkssfs(0);
+  check(file_matches("b1", buf, 2*length), "b1 reads back differently after the remount", &err_no);
+  free(buf);
+  printf("\n-------------------------------\nBatch test Finished.\nCurrent Error Num: %d\n--------------------------------\n\n", err_no);
+  return err_no;
+}
+
+/*
+Blocks freed by a batch: a remove in a batch does not give its blocks to a later write of the same batch,
+which on a full disk fails and leaves no file behind; the blocks are free once the batch returns.
+*/
+int test_batch_frees(){
+  printf("\n-------------------------------\nInitializing batch free test.\n--------------------------------\n\n");
+  int err_no = 0, fd;
+  char block[TEST_BLOCK];
+  memset(block, 'a', TEST_BLOCK);
+  mkssfs(1);
+  fd = ssfs_fopen("full");
+  while(ssfs_fwrite(fd, block, TEST_BLOCK) == TEST_BLOCK);
+  ssfs_fclose(fd);
+  ssfs_op ops[] = {
+    {SSFS_OP_REMOVE, "full", NULL, 0, 0},
+    {SSFS_OP_WRITE,  "late", block, TEST_BLOCK, 0}
+  };
+  check(ssfs_batch(ops, 2) == 1 && ops[0].result == 0 && ops[1].result == -1, "a write in a batch took the blocks a remove of the batch freed", &err_no);
+  check(ssfs_remove("late") == -1, "the failed write of the batch left its file behind", &err_no);
+  fd = ssfs_fopen("after");
+  check(ssfs_fwrite(fd, block, TEST_BLOCK) == TEST_BLOCK, "the blocks freed by the batch are not free after it", &err_no);
+  ssfs_fclose(fd);
+  printf("\n-------------------------------\nBatch free test Finished.\nCurrent Error Num: %d\n--------------------------------\n\n", err_no);
+  return err_no;
+}
+
+#define CRASH_BLOCKS 30
+
+/* writes past the direct pointers and stops before the file is closed, leaving the data blocks in the cache */
+void crash_unflushed_indirect(){
+  char buf[TEST_BLOCK];
+  int fd = ssfs_fopen("big");
+  for(int k = 0; k < CRASH_BLOCKS; k++){
+    fill(buf, TEST_BLOCK, k);
+    ssfs_fwrite(fd, buf, TEST_BLOCK);
+  }
+}
+
+/*
+Crash with an indirect block whose data blocks were never written back:
+the file reads back as far as its size was committed, each block as written or as the fresh image left it,
+never as some other block, and it can be written and remounted again.
+*/
+int test_crash_indirect(){
+  printf("\n-------------------------------\nInitializing indirect block crash test.\n--------------------------------\n\n");
+  int err_no = 0, fd, size, bad = 0;
+  char *buf = malloc(CRASH_BLOCKS*TEST_BLOCK), expected[TEST_BLOCK], zeros[TEST_BLOCK];
+  memset(zeros, 0, TEST_BLOCK);
+  mkssfs(1);
+  run_crashed(crash_unflushed_indirect);
+  mkssfs(0);
+  fd = ssfs_fopen("big");
+  check(fd >= 0, "the file written before the crash is gone", &err_no);
+  size = ssfs_fread(fd, buf, CRASH_BLOCKS*TEST_BLOCK);
+  check(size > 12*TEST_BLOCK, "the file does not reach its indirect block", &err_no);
+  for(int k = 0; k*TEST_BLOCK < size; k++){
+    int n = size-k*TEST_BLOCK < TEST_BLOCK ? size-k*TEST_BLOCK : TEST_BLOCK;
+    fill(expected, TEST_BLOCK, k);
+    if(memcmp(buf+k*TEST_BLOCK, expected, n) != 0 && memcmp(buf+k*TEST_BLOCK, zeros, n) != 0) bad++;
+  }
+  check(bad == 0, "a block of the file reads back as another block", &err_no);
+  //The file and the file system are still usable
+  memset(buf, 'x', TEST_BLOCK);
+  check(ssfs_fwseek(fd, 20*TEST_BLOCK) == 0 && ssfs_fwrite(fd, buf, TEST_BLOCK) == TEST_BLOCK, "cannot write after the crash", &err_no);
+  check(ssfs_fclose(fd) == 0, "cannot close the file", &err_no);
+  mkssfs(0);
+  fd = ssfs_fopen("big");
+  check(fd >= 0 && ssfs_frseek(fd, 20*TEST_BLOCK) == 0 && ssfs_fread(fd, expected, TEST_BLOCK) == TEST_BLOCK
+        && memcmp(expected, buf, TEST_BLOCK) == 0, "the write after the crash is lost", &err_no);
+  ssfs_fclose(fd);
+  free(buf);
+  printf("\n-------------------------------\nIndirect block crash test Finished.\nCurrent Error Num: %d\n--------------------------------\n\n", err_no);
+  return err_no;
+}
+
+#define JOURNAL_FILES 20
+
+/* creates files and removes every fourth one, closing each written file, then stops without a commit */
+void crash_before_checkpoint(){
+  char name[8], buf[2000];
+  for(int i = 0; i < JOURNAL_FILES; i++){
+    sprintf(name, "j%d", i);
+    fill(buf, sizeof(buf), i);
+    int fd = ssfs_fopen(name);
+    ssfs_fwrite(fd, buf, i*100);
+    ssfs_fclose(fd);
+  }
+  for(int i = 0; i < JOURNAL_FILES; i += 4){
+    sprintf(name, "j%d", i);
+    ssfs_remove(name);
+  }
+}
+
+/*
+Journal replay: the metadata changes made since the last commit are in the journal when the crash comes,
+and mounting the image replays them, down to the blocks freed by the removes.
+*/
+int test_journal_replay(){
+  printf("\n-------------------------------\nInitializing journal replay test.\n--------------------------------\n\n");
+  int err_no = 0, fd;
+  char name[8], buf[2000], *fresh = malloc(JOURNAL_FILES*2000);
+  mkssfs(1);
+  run_crashed(crash_before_checkpoint);
+  mkssfs(0);
+  for(int i = 0; i < JOURNAL_FILES; i++){
+    sprintf(name, "j%d", i);
+    fill(buf, sizeof(buf), i);
+    if(i%4 == 0) check(ssfs_remove(name) == -1, "a file removed before the crash is back", &err_no);
+    else check(file_matches(name, buf, i*100), "a file closed before the crash reads back differently", &err_no);
+  }
+  //A new file takes the blocks the removes freed without overwriting those still in use
+  fill(fresh, JOURNAL_FILES*2000, 99);
+  fd = ssfs_fopen("new");
+  check(ssfs_fwrite(fd, fresh, JOURNAL_FILES*2000) == JOURNAL_FILES*2000, "cannot write after the replay", &err_no);
+  ssfs_fclose(fd);
+  mkssfs(0);
+  check(file_matches("new", fresh, JOURNAL_FILES*2000), "the file written after the replay reads back differently", &err_no);
+  for(int i = 1; i < JOURNAL_FILES; i++){
+    sprintf(name, "j%d", i);
+    fill(buf, sizeof(buf), i);
+    if(i%4 != 0) check(file_matches(name, buf, i*100), "a file was overwritten after the replay", &err_no);
+  }
+  free(fresh);
+  printf("\n-------------------------------\nJournal replay test Finished.\nCurrent Error Num: %d\n--------------------------------\n\n", err_no);
+  return err_no;
+}
+
+#define CHECKPOINTS 10    // max_restore_time of sfs_api.c
+#define COW_FILES 4
+#define COW_LENGTH (15*TEST_BLOCK+300)
+
+/* # blocks a new file gets before the disk is full; the file is removed again */
+int count_free_blocks(){
+  char buf[TEST_BLOCK];
+  int fd = ssfs_fopen("free"), n = 0;
+  memset(buf, 'f', TEST_BLOCK);
+  while(ssfs_fwrite(fd, buf, TEST_BLOCK) == TEST_BLOCK)
+    n++;
+  ssfs_fclose(fd);
+  ssfs_remove("free");
+  return n;
+}
+
+/* # free blocks with every checkpoint evicted by one of the file system as it is
+ * but the first, each checkpoint is taken after a count_free_blocks, which copies the blocks of the i-node file and root directory it changes;
+ * the last one evicts the first, so that the checkpoints hold the same # copies however the file system got there
+ */
+int free_blocks_after_checkpoints(){
+  int n = 0;
+  for(int k = 0; k <= CHECKPOINTS; k++){
+    ssfs_commit();
+    n = count_free_blocks();
+  }
+  return n;
+}
+
+/*
+Checkpoints sharing blocks: the files are changed after a checkpoint, in place and past their end,
+and a restore brings back what the checkpoint held, across a remount too.
+Once every checkpoint holding them is evicted, the blocks of the removed files are free again.
+*/
+int test_cow_checkpoints(){
+  printf("\n-------------------------------\nInitializing checkpoint test.\n--------------------------------\n\n");
+  int err_no = 0, fd, cnum, free_before, free_after;
+  char name[8], *buf = malloc(2*COW_LENGTH), *changed = malloc(2*COW_LENGTH);
+  mkssfs(1);
+  free_before = free_blocks_after_checkpoints();
+  for(int i = 0; i < COW_FILES; i++){
+    sprintf(name, "w%d", i);
+    fill(buf, COW_LENGTH, i);
+    fd = ssfs_fopen(name);
+    check(ssfs_fwrite(fd, buf, COW_LENGTH) == COW_LENGTH, "cannot write a file", &err_no);
+    ssfs_fclose(fd);
+  }
+  cnum = ssfs_commit();
+  check(cnum >= 0, "cannot commit", &err_no);
+  //The first blocks are written over and the file grows, the checkpoint keeps the old content
+  for(int i = 0; i < COW_FILES; i++){
+    sprintf(name, "w%d", i);
+    fill(changed, 2*COW_LENGTH, i+COW_FILES);
+    fd = ssfs_fopen(name);
+    check(ssfs_fwseek(fd, 0) == 0 && ssfs_fwrite(fd, changed, 2*COW_LENGTH) == 2*COW_LENGTH, "cannot write over a file", &err_no);
+    ssfs_fclose(fd);
+    check(file_matches(name, changed, 2*COW_LENGTH), "a file reads back differently after it is written over", &err_no);
+  }
+  ssfs_remove("w0");
+  check(ssfs_restore(cnum) == 0, "cannot restore the checkpoint", &err_no);
+  for(int i = 0; i < COW_FILES; i++){
+    sprintf(name, "w%d", i);
+    fill(buf, COW_LENGTH, i);
+    check(file_matches(name, buf, COW_LENGTH), "a file reads back differently after the restore", &err_no);
+  }
+  mkssfs(0);
+  for(int i = 0; i < COW_FILES; i++){
+    sprintf(name, "w%d", i);
+    fill(buf, COW_LENGTH, i);
+    check(file_matches(name, buf, COW_LENGTH), "a restored file reads back differently after the remount", &err_no);
+  }
+  check(ssfs_restore(CHECKPOINTS) == -1 && ssfs_restore(cnum+1) == -1, "a checkpoint that was never taken is restored", &err_no);
+  //Each checkpoint holding the files is evicted by newer ones of the file system without them
+  for(int i = 0; i < COW_FILES; i++){
+    sprintf(name, "w%d", i);
+    check(ssfs_remove(name) == 0, "cannot remove a file", &err_no);
+  }
+  free_after = free_blocks_after_checkpoints();
+  check(free_after == free_before, "blocks leaked once the checkpoints holding them were evicted", &err_no);
+  mkssfs(0);
+  check(free_blocks_after_checkpoints() == free_before, "blocks leaked after the remount", &err_no);
+  free(buf); free(changed);
+  printf("\n-------------------------------\nCheckpoint test Finished.\nCurrent Error Num: %d\n--------------------------------\n\n", err_no);
+  return err_no;
+}
+
+/* writes length bytes of seed at loc of the file */
+int write_at_loc(char *name, int loc, int length, int seed){
+  char *buf = malloc(length);
+  int fd = ssfs_fopen(name), r;
+  fill(buf, length, seed);
+  r = ssfs_fwseek(fd, loc) == 0 && ssfs_fwrite(fd, buf, length) == length;
+  ssfs_fclose(fd);
+  free(buf);
+  return r;
+}
+
+/* # blocks of diff with index in a file, and the i-node of the last one */
+int changed_blocks_at(ssfs_changes *diff, int index, int *i_node){
+  int n = 0;
+  for(int k = 0; k < diff->num_blocks; k++)
+    if(diff->block[k].index == index){
+      n++;
+      *i_node = diff->block[k].i_node;
+    }
+  return n;
+}
+
+/*
+Checkpoint diff: between two checkpoints a block of one file is written over, a small file changes in its i-node,
+a file is created and another removed; the diff lists those i-nodes and blocks and the directory slots touched, nothing else.
+*/
+int test_diff(){
+  printf("\n-------------------------------\nInitializing diff test.\n--------------------------------\n\n");
+  int err_no = 0, from, to, big = -1, created = -1, other = -1;
+  ssfs_changes diff;
+  mkssfs(1);
+  check(write_at_loc("d0", 0, 5*TEST_BLOCK, 0) && write_at_loc("d1", 0, 20, 1) && write_at_loc("d2", 0, 3*TEST_BLOCK, 2),
+        "cannot write the files", &err_no);
+  from = ssfs_commit();
+  check(write_at_loc("d0", 2*TEST_BLOCK, TEST_BLOCK, 3) && write_at_loc("d1", 10, 20, 4) && write_at_loc("d3", 0, 2*TEST_BLOCK, 5),
+        "cannot change the files", &err_no);
+  check(ssfs_remove("d2") == 0, "cannot remove a file", &err_no);
+  to = ssfs_commit();
+  check(ssfs_diff(from, to, &diff) == 0, "cannot diff two checkpoints", &err_no);
+  check(diff.num_i_nodes == 4, "the diff does not list the four files changed", &err_no);
+  check(diff.num_blocks == 3, "the diff does not list the three blocks written", &err_no);
+  check(changed_blocks_at(&diff, 2, &big) == 1 && changed_blocks_at(&diff, 0, &created) == 1 && changed_blocks_at(&diff, 1, &other) == 1
+        && created == other && big != created, "the diff lists other blocks than those written", &err_no);
+  check(diff.num_entries == 2, "the diff does not list the directory slots of the created and removed files", &err_no);
+  ssfs_free_changes(&diff);
+  //Nothing changed since the last checkpoint, then only a file kept in its i-node
+  check(ssfs_diff(to, SSFS_LIVE, &diff) == 0 && diff.num_i_nodes == 0 && diff.num_blocks == 0 && diff.num_entries == 0,
+        "the diff of an unchanged file system is not empty", &err_no);
+  ssfs_free_changes(&diff);
+  check(write_at_loc("d1", 0, 5, 6), "cannot change a small file", &err_no);
+  check(ssfs_diff(to, SSFS_LIVE, &diff) == 0 && diff.num_i_nodes == 1 && diff.num_blocks == 0 && diff.num_entries == 0,
+        "the diff of a small file lists more than its i-node", &err_no);
+  ssfs_free_changes(&diff);
+  check(ssfs_diff(from, CHECKPOINTS, &diff) == -1 && ssfs_diff(to+1, to, &diff) == -1, "a checkpoint that was never taken is diffed", &err_no);
+  printf("\n-------------------------------\nDiff test Finished.\nCurrent Error Num: %d\n--------------------------------\n\n", err_no);
+  return err_no;
+}
+
+#define INLINE_MAX 56   // inline_max of sfs_api.c: 14 pointers
+
+/*
+Small files in their i-nodes: a file of up to 56 bytes takes no data block, written at once or in pieces,
+and the byte past that moves it to one; a checkpoint taken before keeps it as it was.
+*/
+int test_inline_boundary(){
+  printf("\n-------------------------------\nInitializing inline file test.\n--------------------------------\n\n");
+  int err_no = 0, fd, cnum, free_before;
+  char buf[2*INLINE_MAX], changed[2*INLINE_MAX];
+  fill(buf, 2*INLINE_MAX, 7);
+  mkssfs(1);
+  free_before = count_free_blocks();
+  fd = ssfs_fopen("s0");
+  check(ssfs_fwrite(fd, buf, INLINE_MAX-6) == INLINE_MAX-6 && ssfs_fwrite(fd, buf+INLINE_MAX-6, 6) == 6, "cannot write a small file", &err_no);
+  ssfs_fclose(fd);
+  check(write_at_loc("s1", 0, INLINE_MAX, 7), "cannot write a small file", &err_no);
+  check(count_free_blocks() == free_before, "a file of 56 bytes took a data block", &err_no);
+  check(file_matches("s0", buf, INLINE_MAX) && file_matches("s1", buf, INLINE_MAX), "a small file reads back differently", &err_no);
+  //One byte more, appended or written over the end
+  fd = ssfs_fopen("s0");
+  check(ssfs_fwrite(fd, buf+INLINE_MAX, 1) == 1, "cannot grow a small file", &err_no);
+  ssfs_fclose(fd);
+  check(write_at_loc("s1", 10, INLINE_MAX-9, 8), "cannot write over the end of a small file", &err_no);
+  memcpy(changed, buf, 10);
+  fill(changed+10, INLINE_MAX-9, 8);
+  check(count_free_blocks() == free_before-2, "a file of 57 bytes did not take one data block", &err_no);
+  check(file_matches("s0", buf, INLINE_MAX+1), "a file moved to a block reads back differently", &err_no);
+  check(file_matches("s1", changed, INLINE_MAX+1), "a file written over its end reads back differently", &err_no);
+  mkssfs(0);
+  check(file_matches("s0", buf, INLINE_MAX+1) && file_matches("s1", changed, INLINE_MAX+1), "a file moved to a block reads back differently after the remount", &err_no);
+  //Moved to a block after a checkpoint
+  check(write_at_loc("s2", 0, INLINE_MAX, 7), "cannot write a small file", &err_no);
+  cnum = ssfs_commit();
+  check(write_at_loc("s2", INLINE_MAX, INLINE_MAX, 9), "cannot grow a small file after a checkpoint", &err_no);
+  check(ssfs_restore(cnum) == 0 && file_matches("s2", buf, INLINE_MAX), "the checkpoint does not keep the small file", &err_no);
+  printf("\n-------------------------------\nInline file test Finished.\nCurrent Error Num: %d\n--------------------------------\n\n", err_no);
+  return err_no;
+}
+
+#define FRAGMENT_BLOCKS 8
+
+/*
+Fragmented free space: two files take every other block until the disk is full, and one of them is removed,
+leaving one-block holes only; a write of several whole blocks still goes through, a block at a time.
+*/
+int test_fragmented_write(){
+  printf("\n-------------------------------\nInitializing fragmented write test.\n--------------------------------\n\n");
+  int err_no = 0, fd[2], full = 0, written = 0;
+  char block[TEST_BLOCK], *buf = malloc(FRAGMENT_BLOCKS*TEST_BLOCK);
+  mkssfs(1);
+  fd[0] = ssfs_fopen("h0");
+  fd[1] = ssfs_fopen("h1");
+  memset(block, 'h', TEST_BLOCK);
+  while(!full)
+    for(int i = 0; i < 2; i++)
+      if(ssfs_fwrite(fd[i], block, TEST_BLOCK) != TEST_BLOCK) full = 1;
+      else if(i == 1) written++;
+  ssfs_fclose(fd[0]);
+  ssfs_fclose(fd[1]);
+  check(written > FRAGMENT_BLOCKS, "the disk is full before the files take enough blocks", &err_no);
+  check(ssfs_remove("h1") == 0, "cannot remove a file", &err_no);
+  fill(buf, FRAGMENT_BLOCKS*TEST_BLOCK, 11);
+  fd[0] = ssfs_fopen("f0");
+  check(ssfs_fwrite(fd[0], buf, FRAGMENT_BLOCKS*TEST_BLOCK) == FRAGMENT_BLOCKS*TEST_BLOCK, "a write of whole blocks fails on fragmented free space", &err_no);
+  ssfs_fclose(fd[0]);
+  check(file_matches("f0", buf, FRAGMENT_BLOCKS*TEST_BLOCK), "a file written into the holes reads back differently", &err_no);
+  mkssfs(0);
+  check(file_matches("f0", buf, FRAGMENT_BLOCKS*TEST_BLOCK), "a file written into the holes reads back differently after the remount", &err_no);
+  free(buf);
+  printf("\n-------------------------------\nFragmented write test Finished.\nCurrent Error Num: %d\n--------------------------------\n\n", err_no);
+  return err_no;
+}
+
+#define VIEW_LENGTH (3*TEST_BLOCK+200)
+
+/*
+Zero-copy reads: a view from the middle of a block across the next ones has a span per block
+that together hold what ssfs_fread returns; the cache cannot be resized while it borrows from it.
+*/
+int test_view(){
+  printf("\n-------------------------------\nInitializing view test.\n--------------------------------\n\n");
+  int err_no = 0, fd, covered, pinned = 0, pos = 0;
+  char *buf = malloc(VIEW_LENGTH), *joined = malloc(VIEW_LENGTH);
+  ssfs_view view;
+  fill(buf, VIEW_LENGTH, 12);
+  mkssfs(1);
+  fd = ssfs_fopen("v0");
+  check(ssfs_fwrite(fd, buf, VIEW_LENGTH) == VIEW_LENGTH, "cannot write a file", &err_no);
+  check(ssfs_frseek(fd, 500) == 0, "cannot seek", &err_no);
+  covered = ssfs_fread_view(fd, 2*TEST_BLOCK, &view);
+  check(covered == 2*TEST_BLOCK, "the view does not cover what was asked", &err_no);
+  check(view.num_spans == 3, "the view does not have a span per block", &err_no);
+  for(int k = 0; k < view.num_spans && pos+view.span[k].length <= VIEW_LENGTH; k++){
+    memcpy(joined+pos, view.span[k].data, view.span[k].length);
+    pos += view.span[k].length;
+    if(view.pinned[k] != -1) pinned = 1;
+  }
+  check(pos == covered && memcmp(joined, buf+500, covered) == 0, "the spans hold other bytes than the file", &err_no);
+  if(pinned) check(ssfs_cache_config(16) == -1, "the cache was resized under a view", &err_no);
+  ssfs_release_view(&view);
+  check(ssfs_cache_config(64) == 0, "cannot resize the cache once the view is released", &err_no);
+  //The read pointer moved past what the view covered
+  check(ssfs_fread(fd, joined, TEST_BLOCK) == VIEW_LENGTH-500-covered && memcmp(joined, buf+500+covered, VIEW_LENGTH-500-covered) == 0,
+        "the view did not move the read pointer", &err_no);
+  ssfs_fclose(fd);
+  free(buf); free(joined);
+  printf("\n-------------------------------\nView test Finished.\nCurrent Error Num: %d\n--------------------------------\n\n", err_no);
+  return err_no;
+}
+
+#define RA_BLOCKS 400
+#define RA_ROUNDS 10
+
+/*
+Readahead on the aio workers: a file is read sequentially over and over while blocks ahead of the reader,
+that readahead may have queued already, are written over after a seek of the write pointer;
+every read returns what was last written, never a block read ahead before the write.
+*/
+int test_async_readahead(){
+  printf("\n-------------------------------\nInitializing readahead test.\n--------------------------------\n\n");
+  int err_no = 0, fd, length = RA_BLOCKS*TEST_BLOCK, stale = 0;
+  long issued;
+  char *buf = malloc(length), *read_buf = malloc(length);
+  fill(buf, length, 13);
+  check(ssfs_aio_config(4) == 0, "cannot start the aio workers", &err_no);
+  ssfs_cache_config(128);
+  mkssfs(1);
+  fd = ssfs_fopen("ra");
+  check(ssfs_fwrite(fd, buf, length) == length, "cannot write a file", &err_no);
+  ssfs_cache_reset_stats();
+  for(int round = 0; round < RA_ROUNDS; round++){
+    ssfs_frseek(fd, 0);
+    for(int off = 0; off < length; off += TEST_BLOCK){
+      check(ssfs_fread(fd, read_buf+off, TEST_BLOCK) == TEST_BLOCK, "a sequential read comes back short", &err_no);
+      if(off % (8*TEST_BLOCK) == 0 && off+16*TEST_BLOCK < length){
+        fill(buf+off+16*TEST_BLOCK, TEST_BLOCK, round*RA_BLOCKS+off/TEST_BLOCK);
+        ssfs_fwseek(fd, off+16*TEST_BLOCK);
+        ssfs_fwrite(fd, buf+off+16*TEST_BLOCK, TEST_BLOCK);
+      }
+    }
+    if(memcmp(read_buf, buf, length) != 0) stale++;
+  }
+  check(stale == 0, "a block read ahead hides the write over it", &err_no);
+  ssfs_readahead_stats(&issued, NULL);
+  check(issued > 0, "sequential reads issued no readahead", &err_no);
+  ssfs_fclose(fd);
+  check(file_matches("ra", buf, length), "the file reads back differently", &err_no);
+  ssfs_aio_config(0);
+  ssfs_cache_config(64);
+  free(buf); free(read_buf);
+  printf("\n-------------------------------\nReadahead test Finished.\nCurrent Error Num: %d\n--------------------------------\n\n", err_no);
+  return err_no;
+}
+
+#define DOUBLE_BLOCKS (12+TEST_BLOCK/4+20)   // past the 12 direct blocks and the single indirect block's
+
+/*
+Radix block map: a file reaching into the double indirect block reads back whole, from across the boundary
+of the single and double indirect blocks and after a remount; removing it frees its data and indirect blocks.
+*/
+int test_double_indirect(){
+  printf("\n-------------------------------\nInitializing double indirect test.\n--------------------------------\n\n");
+  int err_no = 0, fd, free_before, length = DOUBLE_BLOCKS*TEST_BLOCK+100, boundary = (12+TEST_BLOCK/4)*TEST_BLOCK;
+  char *buf = malloc(length), *read_buf = malloc(2*TEST_BLOCK);
+  fill(buf, length, 14);
+  mkssfs(1);
+  free_before = count_free_blocks();
+  fd = ssfs_fopen("r0");
+  check(ssfs_fwrite(fd, buf, length) == length, "cannot write a file into the double indirect block", &err_no);
+  check(ssfs_frseek(fd, boundary-500) == 0 && ssfs_fread(fd, read_buf, 2*TEST_BLOCK) == 2*TEST_BLOCK
+        && memcmp(read_buf, buf+boundary-500, 2*TEST_BLOCK) == 0, "a read across the double indirect boundary differs", &err_no);
+  ssfs_fclose(fd);
+  check(file_matches("r0", buf, length), "the file reads back differently", &err_no);
+  mkssfs(0);
+  check(file_matches("r0", buf, length), "the file reads back differently after the remount", &err_no);
+  check(ssfs_remove("r0") == 0, "cannot remove the file", &err_no);
+  check(count_free_blocks() == free_before, "blocks of the removed file are still in use", &err_no);
+  free(buf); free(read_buf);
+  printf("\n-------------------------------\nDouble indirect test Finished.\nCurrent Error Num: %d\n--------------------------------\n\n", err_no);
+  return err_no;
+}
+
+#define ALLOC_BLOCKS 6
+
+/* writes a new file of blocks whole blocks and fills block[index] with where each is on the disk, as ssfs_diff lists them */
+int write_and_locate(char *name, int blocks, int *block){
+  char *buf = calloc(blocks, TEST_BLOCK);
+  ssfs_changes diff;
+  int from = ssfs_commit(), fd = ssfs_fopen(name), n = 0;
+  if(ssfs_fwrite(fd, buf, blocks*TEST_BLOCK) != blocks*TEST_BLOCK) n = -1;
+  ssfs_fclose(fd);
+  if(n == 0 && ssfs_diff(from, SSFS_LIVE, &diff) == 0){
+    for(int k = 0; k < diff.num_blocks; k++)
+      if(diff.block[k].index < blocks){
+        block[diff.block[k].index] = diff.block[k].block;
+        n++;
+      }
+    ssfs_free_changes(&diff);
+  }
+  free(buf);
+  return n;
+}
+
+/*
+Next-fit allocation: a write of several blocks gets a run of them, and a later file goes after the last block allocated
+rather than into the hole a removed file left; once the disk is full, writes fail until a remove frees blocks.
+*/
+int test_allocator(){
+  printf("\n-------------------------------\nInitializing allocator test.\n--------------------------------\n\n");
+  int err_no = 0, fd, run = 1, full, refilled, a0[ALLOC_BLOCKS], a1[ALLOC_BLOCKS];
+  char block[TEST_BLOCK];
+  mkssfs(1);
+  //a0 is removed before a checkpoint holds it, so its blocks are free again when a1 is written
+  check(write_and_locate("a0", ALLOC_BLOCKS, a0) == ALLOC_BLOCKS && ssfs_remove("a0") == 0
+        && write_and_locate("a1", ALLOC_BLOCKS, a1) == ALLOC_BLOCKS, "cannot locate the blocks of new files", &err_no);
+  for(int k = 1; k < ALLOC_BLOCKS; k++)
+    if(a0[k] != a0[k-1]+1 || a1[k] != a1[k-1]+1) run = 0;
+  check(run, "a write of several blocks does not get a run of them", &err_no);
+  check(a1[0] > a0[ALLOC_BLOCKS-1], "the allocator went back to a hole before its cursor", &err_no);
+  //Fill the disk, then free a file no checkpoint holds and fill what it gave back
+  memset(block, 'a', TEST_BLOCK);
+  fd = ssfs_fopen("a2");
+  for(int k = 0; k < ALLOC_BLOCKS; k++)
+    ssfs_fwrite(fd, block, TEST_BLOCK);
+  ssfs_fclose(fd);
+  full = count_free_blocks();
+  check(full > 0, "the disk is full already", &err_no);
+  fd = ssfs_fopen("a_full");
+  for(int k = 0; k < full; k++)
+    ssfs_fwrite(fd, block, TEST_BLOCK);
+  check(ssfs_fwrite(fd, block, TEST_BLOCK) <= 0, "a write on a full disk went through", &err_no);
+  check(ssfs_remove("a2") == 0, "cannot remove a file on a full disk", &err_no);
+  for(refilled = 0; ssfs_fwrite(fd, block, TEST_BLOCK) == TEST_BLOCK; refilled++);
+  check(refilled == ALLOC_BLOCKS, "the blocks of a file removed on a full disk are not reused", &err_no);
+  ssfs_fclose(fd);
+  printf("\n-------------------------------\nAllocator test Finished.\nCurrent Error Num: %d\n--------------------------------\n\n", err_no);
+  return err_no;
+}
+
+#define DIR_FILES 199   // the default max_files but the root directory's i-node
+
+/*
+Directory index: a full directory of files is found by name, before and after a remount,
+removed names are no longer found while their neighbours still are, and their slots are reused.
+*/
+int test_directory_index(){
+  printf("\n-------------------------------\nInitializing directory test.\n--------------------------------\n\n");
+  int err_no = 0, created = 0, found = 0, removed = 0, fd;
+  char name[8], buf[8];
+  mkssfs(1);
+  for(int i = 0; i < DIR_FILES; i++){
+    sprintf(name, "dir%d", i);
+    fill(buf, 8, i);
+    fd = ssfs_fopen(name);
+    if(fd >= 0 && ssfs_fwrite(fd, buf, 8) == 8) created++;
+    ssfs_fclose(fd);
+  }
+  check(created == DIR_FILES, "cannot fill the directory", &err_no);
+  check(ssfs_fopen("one_more") == -1, "a file was created past max_files", &err_no);
+  mkssfs(0);
+  for(int i = 0; i < DIR_FILES; i++){
+    sprintf(name, "dir%d", i);
+    fill(buf, 8, i);
+    found += file_matches(name, buf, 8);
+    if(i%2 == 1) removed += ssfs_remove(name) == 0;
+  }
+  check(found == DIR_FILES, "a file is not found by name after the remount", &err_no);
+  check(removed == DIR_FILES/2 && ssfs_remove("dir1") == -1, "a removed file is still found", &err_no);
+  //The removed slots take new files, and the files left are found among them
+  for(int i = 1; i < DIR_FILES; i += 2){
+    sprintf(name, "new%d", i);
+    fd = ssfs_fopen(name);
+    check(fd >= 0, "a removed file's slot is not reused", &err_no);
+    ssfs_fclose(fd);
+  }
+  found = 0;
+  for(int i = 0; i < DIR_FILES; i += 2){
+    sprintf(name, "dir%d", i);
+    fill(buf, 8, i);
+    found += file_matches(name, buf, 8);
+  }
+  check(found == (DIR_FILES+1)/2, "a file is not found by name among the new ones", &err_no);
+  printf("\n-------------------------------\nDirectory test Finished.\nCurrent Error Num: %d\n--------------------------------\n\n", err_no);
+  return err_no;
+}
+
+#define META_FILES 150
+
+/* metadata bytes written by appending a byte to the file name, which changes its size */
+long append_meta_bytes(char *name){
+  long last_op_bytes = -1;
+  int fd = ssfs_fopen(name);
+  ssfs_fwrite(fd, "m", 1);
+  ssfs_metadata_stats(NULL, NULL, &last_op_bytes);
+  ssfs_fclose(fd);
+  return last_op_bytes;
+}
+
+/*
+Incremental commit: a small change writes the metadata blocks it dirtied only,
+as many bytes with one file as with many, far less than the whole i-node file and directory; a read writes none.
+*/
+int test_metadata_commit(){
+  printf("\n-------------------------------\nInitializing metadata commit test.\n--------------------------------\n\n");
+  int err_no = 0, fd;
+  long one_file, many_files, bytes, operations, bytes_after, operations_after;
+  char name[8], buf[4];
+  mkssfs(1);
+  write_at_loc("m0", 0, 3*TEST_BLOCK, 15);
+  one_file = append_meta_bytes("m0");
+  for(int i = 1; i < META_FILES; i++){
+    sprintf(name, "m%d", i);
+    write_at_loc(name, 0, 3*TEST_BLOCK, 15);
+  }
+  many_files = append_meta_bytes("m0");
+  check(one_file > 0 && many_files == one_file, "the metadata written by a change grows with the # files", &err_no);
+  check(many_files <= 2*TEST_BLOCK, "a small change writes more than a few metadata blocks", &err_no);
+  fd = ssfs_fopen("m1");
+  ssfs_metadata_stats(&bytes, &operations, NULL);
+  check(ssfs_fread(fd, buf, 4) == 4, "cannot read a file", &err_no);
+  ssfs_metadata_stats(&bytes_after, &operations_after, NULL);
+  check(bytes_after == bytes && operations_after == operations, "a read wrote metadata", &err_no);
+  ssfs_fclose(fd);
+  printf("\n-------------------------------\nMetadata commit test Finished.\nCurrent Error Num: %d\n--------------------------------\n\n", err_no);
+  return err_no;
+}
+
+#define MMAP_LENGTH (30*TEST_BLOCK+77)
+
+/*
+Mapped image backend: a file written through the mapped image reads back after a remount through it
+and through disk_emu, and one written through disk_emu reads back through the mapped image; both see the same image.
+*/
+int test_mmap_backend(){
+  printf("\n-------------------------------\nInitializing mmap backend test.\n--------------------------------\n\n");
+  int err_no = 0, fd;
+  char *buf = malloc(2*MMAP_LENGTH);
+  fill(buf, 2*MMAP_LENGTH, 16);
+  check(ssfs_set_backend(SSFS_BACKEND_MMAP) == 0, "cannot select the mapped image", &err_no);
+  mkssfs(1);
+  fd = ssfs_fopen("mm");
+  check(ssfs_fwrite(fd, buf, MMAP_LENGTH) == MMAP_LENGTH, "cannot write through the mapped image", &err_no);
+  ssfs_fclose(fd);
+  check(file_matches("mm", buf, MMAP_LENGTH), "the file reads back differently", &err_no);
+  mkssfs(0);
+  check(file_matches("mm", buf, MMAP_LENGTH), "the file reads back differently after a remount of the mapped image", &err_no);
+  ssfs_set_backend(SSFS_BACKEND_EMU);
+  mkssfs(0);
+  check(file_matches("mm", buf, MMAP_LENGTH), "disk_emu reads the mapped image's file differently", &err_no);
+  fd = ssfs_fopen("mm");
+  check(ssfs_fwrite(fd, buf+MMAP_LENGTH, MMAP_LENGTH) == MMAP_LENGTH, "cannot write through disk_emu", &err_no);
+  ssfs_fclose(fd);
+  ssfs_set_backend(SSFS_BACKEND_MMAP);
+  mkssfs(0);
+  check(file_matches("mm", buf, 2*MMAP_LENGTH), "the mapped image reads disk_emu's write differently", &err_no);
+  ssfs_set_backend(backend);
+  free(buf);
+  printf("\n-------------------------------\nMmap backend test Finished.\nCurrent Error Num: %d\n--------------------------------\n\n", err_no);
+  return err_no;
+}
+
+#define SEQ_BLOCKS 64
+
+/*
+Readahead: reading a file a block at a time from the start reads ahead, and the blocks read ahead are hit
+(counted on disk_emu only, the mapped image is advised); reading it backwards reads nothing ahead.
+*/
+int test_readahead_stats(){
+  printf("\n-------------------------------\nInitializing readahead stats test.\n--------------------------------\n\n");
+  int err_no = 0, fd, length = SEQ_BLOCKS*TEST_BLOCK, same = 1;
+  long issued, hits;
+  char *buf = malloc(length), block[TEST_BLOCK];
+  fill(buf, length, 17);
+  mkssfs(1);
+  check(write_at_loc("seq", 0, length, 17), "cannot write a file", &err_no);
+  //A remount starts with an empty cache
+  mkssfs(0);
+  ssfs_cache_reset_stats();
+  fd = ssfs_fopen("seq");
+  for(int off = 0; off < length; off += TEST_BLOCK)
+    if(ssfs_fread(fd, block, TEST_BLOCK) != TEST_BLOCK || memcmp(block, buf+off, TEST_BLOCK) != 0) same = 0;
+  check(same, "a sequential read returns other bytes than the file", &err_no);
+  ssfs_readahead_stats(&issued, &hits);
+  check(issued > 0, "sequential reads issued no readahead", &err_no);
+  if(backend == SSFS_BACKEND_EMU)
+    check(hits > 0 && hits <= issued, "the blocks read ahead were not hit", &err_no);
+  ssfs_fclose(fd);
+  mkssfs(0);
+  ssfs_cache_reset_stats();
+  fd = ssfs_fopen("seq");
+  for(int off = length-TEST_BLOCK; off >= 0; off -= TEST_BLOCK)
+    if(ssfs_frseek(fd, off) != 0 || ssfs_fread(fd, block, TEST_BLOCK) != TEST_BLOCK || memcmp(block, buf+off, TEST_BLOCK) != 0) same = 0;
+  check(same, "a backward read returns other bytes than the file", &err_no);
+  ssfs_readahead_stats(&issued, &hits);
+  check(issued == 0, "backward reads issued readahead", &err_no);
+  ssfs_fclose(fd);
+  free(buf);
+  printf("\n-------------------------------\nReadahead stats test Finished.\nCurrent Error Num: %d\n--------------------------------\n\n", err_no);
+  return err_no;
+}
+
+#define SEEK_BLOCKS 40
+#define SEEKS 200
+
+/*
+Seeks: the read pointer jumps to random offsets back and forth across blocks and the indirect boundary,
+reading what is there, while the write pointer, moved on its own, writes over bytes in place;
+a seek to the end of the file is allowed, one past it is not.
+*/
+int test_seek(){
+  printf("\n-------------------------------\nInitializing seek test.\n--------------------------------\n\n");
+  int err_no = 0, fd, length = SEEK_BLOCKS*TEST_BLOCK, same = 1, loc;
+  unsigned int seed = 18;
+  char *buf = malloc(length), read_buf[300], patch[100];
+  fill(buf, length, 18);
+  mkssfs(1);
+  fd = ssfs_fopen("sk");
+  check(ssfs_fwrite(fd, buf, length) == length, "cannot write a file", &err_no);
+  for(int k = 0; k < SEEKS; k++){
+    loc = rand_r(&seed)%(length-300);
+    if(ssfs_frseek(fd, loc) != 0 || ssfs_fread(fd, read_buf, 300) != 300 || memcmp(read_buf, buf+loc, 300) != 0) same = 0;
+    //Every few reads, write over 100 bytes somewhere else
+    if(k%4 == 0){
+      loc = rand_r(&seed)%(length-100);
+      fill(patch, 100, k);
+      memcpy(buf+loc, patch, 100);
+      if(ssfs_fwseek(fd, loc) != 0 || ssfs_fwrite(fd, patch, 100) != 100) same = 0;
+    }
+  }
+  check(same, "a read after a seek returns other bytes than the file holds there", &err_no);
+  check(ssfs_frseek(fd, length) == 0 && ssfs_fread(fd, read_buf, 1) == 0, "cannot seek to the end of the file", &err_no);
+  check(ssfs_frseek(fd, length+1) == -1 && ssfs_fwseek(fd, length+1) == -1, "a seek past the end of the file went through", &err_no);
+  ssfs_fclose(fd);
+  check(file_matches("sk", buf, length), "the writes after seeks did not land where they were made", &err_no);
+  free(buf);
+  printf("\n-------------------------------\nSeek test Finished.\nCurrent Error Num: %d\n--------------------------------\n\n", err_no);
+  return err_no;
+}
+
+#define P_LENGTH (3*TEST_BLOCK+50)
+
+/*
+Positional I/O: a pwrite across a block boundary reads back with pread, one at the end of the file appends,
+a pread running past the end returns what is there; neither goes past the end nor moves the file's pointers.
+*/
+int test_positional(){
+  printf("\n-------------------------------\nInitializing positional I/O test.\n--------------------------------\n\n");
+  int err_no = 0, fd;
+  char *buf = malloc(P_LENGTH+TEST_BLOCK), *read_buf = malloc(P_LENGTH+TEST_BLOCK);
+  fill(buf, P_LENGTH+TEST_BLOCK, 19);
+  mkssfs(1);
+  fd = ssfs_fopen("p0");
+  check(ssfs_fwrite(fd, buf, P_LENGTH) == P_LENGTH, "cannot write a file", &err_no);
+  //Across the first block boundary
+  fill(buf+TEST_BLOCK-200, 500, 20);
+  check(ssfs_pwrite(fd, buf+TEST_BLOCK-200, 500, TEST_BLOCK-200) == 500, "a pwrite across blocks is short", &err_no);
+  check(ssfs_pread(fd, read_buf, 700, TEST_BLOCK-300) == 700 && memcmp(read_buf, buf+TEST_BLOCK-300, 700) == 0,
+        "a pread across blocks returns other bytes than pwrite wrote", &err_no);
+  //At and past the end
+  check(ssfs_pwrite(fd, buf+P_LENGTH, TEST_BLOCK, P_LENGTH) == TEST_BLOCK, "a pwrite at the end of the file does not append", &err_no);
+  check(ssfs_pread(fd, read_buf, 2*TEST_BLOCK, P_LENGTH) == TEST_BLOCK && memcmp(read_buf, buf+P_LENGTH, TEST_BLOCK) == 0,
+        "a pread past the end of the file does not stop at it", &err_no);
+  check(ssfs_pread(fd, read_buf, 10, P_LENGTH+TEST_BLOCK) == 0, "a pread at the end of the file returns bytes", &err_no);
+  check(ssfs_pwrite(fd, buf, 10, P_LENGTH+TEST_BLOCK+1) == -1 && ssfs_pread(fd, read_buf, 10, P_LENGTH+TEST_BLOCK+1) == -1,
+        "positional I/O went past the end of the file", &err_no);
+  //The read pointer is still at the start of the file, the write pointer where the first write left it
+  check(ssfs_fread(fd, read_buf, TEST_BLOCK) == TEST_BLOCK && memcmp(read_buf, buf, TEST_BLOCK) == 0, "positional I/O moved the read pointer", &err_no);
+  fill(buf+P_LENGTH, 10, 21);
+  check(ssfs_fwrite(fd, buf+P_LENGTH, 10) == 10, "cannot write after positional I/O", &err_no);
+  ssfs_fclose(fd);
+  check(file_matches("p0", buf, P_LENGTH+TEST_BLOCK), "the file reads back differently, or positional I/O moved the write pointer", &err_no);
+  free(buf); free(read_buf);
+  printf("\n-------------------------------\nPositional I/O test Finished.\nCurrent Error Num: %d\n--------------------------------\n\n", err_no);
+  return err_no;
+}
+
+/*
+Geometry: an image made with larger blocks and fewer i-nodes than the default is mounted with its own geometry
+even once the next one is the default again, and holds as many files as it was made for; bad geometries are refused.
+*/
+int test_geometry(){
+  printf("\n-------------------------------\nInitializing geometry test.\n--------------------------------\n\n");
+  ssfs_geometry wide = {4096, 600, 40}, standard = {1024, 1027, 200}, bad = {1000, 1027, 200}, tiny = {1024, 10, 200}, mounted;
+  int err_no = 0, fd, length = 10*4096+17, files = 0;
+  char name[8], *buf = malloc(length);
+  fill(buf, length, 22);
+  check(ssfs_set_geometry(&bad) == -1 && ssfs_set_geometry(&tiny) == -1, "a bad geometry was accepted", &err_no);
+  check(ssfs_set_geometry(&wide) == 0, "cannot set a geometry", &err_no);
+  mkssfs(1);
+  ssfs_get_geometry(&mounted);
+  check(memcmp(&mounted, &wide, sizeof(mounted)) == 0, "the image was not made with the geometry set", &err_no);
+  fd = ssfs_fopen("g0");
+  check(ssfs_fwrite(fd, buf, length) == length, "cannot write a file", &err_no);
+  ssfs_fclose(fd);
+  ssfs_set_geometry(&standard);
+  mkssfs(0);
+  ssfs_get_geometry(&mounted);
+  check(memcmp(&mounted, &wide, sizeof(mounted)) == 0, "the remount did not take the geometry from the image", &err_no);
+  check(file_matches("g0", buf, length), "the file reads back differently after the remount", &err_no);
+  //g0 and the root directory take two of the 40 i-nodes
+  for(int i = 0; i < 40; i++){
+    sprintf(name, "g%d", i+1);
+    if((fd = ssfs_fopen(name)) >= 0) files++;
+    ssfs_fclose(fd);
+  }
+  check(files == 38, "the image does not hold the # files it was made for", &err_no);
+  mkssfs(1);
+  ssfs_get_geometry(&mounted);
+  check(memcmp(&mounted, &standard, sizeof(mounted)) == 0, "cannot go back to the default geometry", &err_no);
+  free(buf);
+  printf("\n-------------------------------\nGeometry test Finished.\nCurrent Error Num: %d\n--------------------------------\n\n", err_no);
+  return err_no;
+}
+
+#define SMALL_BLOCK 512
+#define TRIPLE_INDEX (12+SMALL_BLOCK/4+(SMALL_BLOCK/4)*(SMALL_BLOCK/4))   // the first block the triple indirect block maps
+
+/*
+Triple indirect block: with 512 byte blocks a file of 8MB reaches past the double indirect block;
+it reads back across that boundary and after a remount, and removing it frees every block it took.
+*/
+int test_triple_indirect(){
+  printf("\n-------------------------------\nInitializing triple indirect test.\n--------------------------------\n\n");
+  ssfs_geometry small = {SMALL_BLOCK, TRIPLE_INDEX+400, 16}, standard = {1024, 1027, 200};
+  int err_no = 0, fd, free_before, length = (TRIPLE_INDEX+40)*SMALL_BLOCK, boundary = TRIPLE_INDEX*SMALL_BLOCK;
+  char *buf = malloc(length), *read_buf = malloc(2*SMALL_BLOCK);
+  fill(buf, length, 23);
+  check(ssfs_set_geometry(&small) == 0, "cannot set a geometry with small blocks", &err_no);
+  mkssfs(1);
+  free_before = count_free_blocks();
+  fd = ssfs_fopen("r3");
+  check(ssfs_fwrite(fd, buf, length) == length, "cannot write a file into the triple indirect block", &err_no);
+  check(ssfs_pread(fd, read_buf, 2*SMALL_BLOCK, boundary-SMALL_BLOCK/2) == 2*SMALL_BLOCK
+        && memcmp(read_buf, buf+boundary-SMALL_BLOCK/2, 2*SMALL_BLOCK) == 0, "a read across the triple indirect boundary differs", &err_no);
+  ssfs_fclose(fd);
+  mkssfs(0);
+  check(file_matches("r3", buf, length), "the file reads back differently after the remount", &err_no);
+  check(ssfs_remove("r3") == 0, "cannot remove the file", &err_no);
+  check(count_free_blocks() == free_before, "blocks of the removed file are still in use", &err_no);
+  ssfs_set_geometry(&standard);
+  free(buf); free(read_buf);
+  printf("\n-------------------------------\nTriple indirect test Finished.\nCurrent Error Num: %d\n--------------------------------\n\n", err_no);
+  return err_no;
+}
+
+#define CTX_LENGTH (5*TEST_BLOCK+33)
+
+/* file_matches on the file system fs */
+int file_matches_r(ssfs_t *fs, char *name, char *buf, int length){
+  char *read_buf = malloc(length+1);
+  int fd = ssfs_fopen_r(fs, name), ok;
+  ok = fd >= 0 && ssfs_fread_r(fs, fd, read_buf, length+1) == length && memcmp(read_buf, buf, length) == 0;
+  if(fd >= 0) ssfs_fclose_r(fs, fd);
+  free(read_buf);
+  return ok;
+}
+
+/*
+Contexts: two file systems open at once on mapped images of their own, and the default one,
+each keep their own file of the same name, also after the two are freed and mounted again.
+*/
+int test_contexts(){
+  printf("\n-------------------------------\nInitializing context test.\n--------------------------------\n\n");
+  char *images[] = {"ctx_test_a", "ctx_test_b"}, *buf = malloc(3*CTX_LENGTH);
+  ssfs_t *fs[2];
+  int err_no = 0, fd[2];
+  fill(buf, 3*CTX_LENGTH, 24);
+  mkssfs(1);
+  check(write_at_loc("same", 0, CTX_LENGTH, 25), "cannot write a file", &err_no);
+  for(int i = 0; i < 2; i++){
+    fs[i] = ssfs_new(images[i]);
+    check(fs[i] != NULL && ssfs_set_backend_r(fs[i], SSFS_BACKEND_MMAP) == 0 && mkssfs_r(fs[i], 1) == 0, "cannot make a second file system", &err_no);
+    fd[i] = ssfs_fopen_r(fs[i], "same");
+  }
+  //Interleaved writes of different bytes to the file of the same name
+  for(int off = 0; off < CTX_LENGTH; off += 1000)
+    for(int i = 0; i < 2; i++){
+      int n = CTX_LENGTH-off < 1000 ? CTX_LENGTH-off : 1000;
+      check(ssfs_fwrite_r(fs[i], fd[i], buf+i*CTX_LENGTH+off, n) == n, "a write to one of two file systems is short", &err_no);
+    }
+  for(int i = 0; i < 2; i++){
+    ssfs_fclose_r(fs[i], fd[i]);
+    check(file_matches_r(fs[i], "same", buf+i*CTX_LENGTH, CTX_LENGTH), "a file system holds what was written to the other", &err_no);
+    ssfs_free(fs[i]);
+  }
+  fill(buf+2*CTX_LENGTH, CTX_LENGTH, 25);
+  check(file_matches("same", buf+2*CTX_LENGTH, CTX_LENGTH), "the default file system holds what was written to another", &err_no);
+  for(int i = 0; i < 2; i++){
+    fs[i] = ssfs_new(images[i]);
+    ssfs_set_backend_r(fs[i], SSFS_BACKEND_MMAP);
+    check(mkssfs_r(fs[i], 0) == 0 && file_matches_r(fs[i], "same", buf+i*CTX_LENGTH, CTX_LENGTH),
+          "a file system reads back differently after it was freed", &err_no);
+  }
+  //disk_emu holds one image, the default file system's when it mounted through it
+  if(backend == SSFS_BACKEND_EMU){
+    ssfs_set_backend_r(fs[0], SSFS_BACKEND_EMU);
+    check(mkssfs_r(fs[0], 0) == -1, "a second file system mounted through disk_emu", &err_no);
+  }
+  for(int i = 0; i < 2; i++){
+    ssfs_free(fs[i]);
+    unlink(images[i]);
+  }
+  free(buf);
+  printf("\n-------------------------------\nContext test Finished.\nCurrent Error Num: %d\n--------------------------------\n\n", err_no);
+  return err_no;
+}
+
+#define SUITE_FILE_BYTES (256*1024)   // of the latency suite of sfs_bench.c
+#define SUITE_CALLS 500
+
+/*
+The calls the latency suite of sfs_bench times succeed, so that it does not report how fast calls fail:
+4KB reads and writes at random aligned offsets, seeks each followed by a one byte read,
+restores of the last checkpoints of many, and remounts.
+*/
+int test_latency_workload(){
+  printf("\n-------------------------------\nInitializing latency workload test.\n--------------------------------\n\n");
+  int err_no = 0, fd, failed = 0, rounds = 50, cnum[50];
+  unsigned int seed = 26;
+  char *buf = calloc(4096, sizeof(char)), record[64] = {0};
+  mkssfs(1);
+  fd = ssfs_fopen("rand");
+  for(int acc = 0; acc < SUITE_FILE_BYTES; acc += 4096)
+    ssfs_fwrite(fd, buf, 4096);
+  for(int i = 0; i < SUITE_CALLS; i++){
+    int offset = rand_r(&seed)%(SUITE_FILE_BYTES/4096)*4096;
+    if(ssfs_pread(fd, buf, 4096, offset) != 4096 || ssfs_pwrite(fd, buf, 4096, offset) != 4096) failed++;
+    offset = rand_r(&seed)%SUITE_FILE_BYTES;
+    if(ssfs_frseek(fd, offset) != 0 || ssfs_fread(fd, buf, 1) != 1) failed++;
+  }
+  check(failed == 0, "a random read, write or seek of the suite fails", &err_no);
+  ssfs_fclose(fd);
+  fd = ssfs_fopen("c0");
+  for(int r = 0; r < rounds; r++){
+    ssfs_fwrite(fd, record, sizeof(record));
+    cnum[r] = ssfs_commit();
+  }
+  ssfs_fclose(fd);
+  failed = 0;
+  for(int r = 0; r < rounds; r++)
+    if(ssfs_restore(cnum[rounds-1-r%5]) != 0) failed++;
+  check(failed == 0, "a restore of the suite fails", &err_no);
+  for(int m = 0; m < 10; m++)
+    mkssfs(0);
+  check(ssfs_remove("c0") == 0 && ssfs_remove("rand") == 0, "the files are gone after the remounts", &err_no);
+  free(buf);
+  printf("\n-------------------------------\nLatency workload test Finished.\nCurrent Error Num: %d\n--------------------------------\n\n", err_no);
+  return err_no;
+}
+
+#define STAT_THREADS 4
+#define STAT_WRITES 100
+
+/* appends STAT_WRITES bytes to a file of the thread's own, a byte per call */
+void *stat_worker(void *arg){
+  char name[8];
+  sprintf(name, "st%ld", (long)arg);
+  int fd = ssfs_fopen(name);
+  for(int i = 0; i < STAT_WRITES; i++)
+    ssfs_fwrite(fd, "s", 1);
+  ssfs_fclose(fd);
+  return NULL;
+}
+
+/* 1 if the latency histogram of call counts each of its calls once */
+int histogram_counts_calls(ssfs_call_stats *call){
+  long n = 0;
+  for(int b = 0; b < SSFS_STAT_BUCKETS; b++)
+    n += call->latency[b];
+  return n == call->calls;
+}
+
+/*
+Statistics: calls, errors and bytes are counted per call, from several threads too, each call once in its histogram,
+and reset by ssfs_reset_stats; percentiles are read off the histogram to the bucket.
+*/
+int test_stats(){
+  printf("\n-------------------------------\nInitializing stats test.\n--------------------------------\n\n");
+  int err_no = 0, fd, counted = 1;
+  char buf[100];
+  pthread_t threads[STAT_THREADS];
+  ssfs_stats stats;
+  ssfs_call_stats made_up = {100, 0, 0, {0}}, none = {0, 0, 0, {0}};
+  fill(buf, 100, 27);
+  mkssfs(1);
+  ssfs_reset_stats();
+  fd = ssfs_fopen("s0");
+  for(int i = 0; i < 3; i++)
+    ssfs_fwrite(fd, buf, 100);
+  ssfs_frseek(fd, 0);
+  for(int i = 0; i < 2; i++)
+    ssfs_fread(fd, buf, 50);
+  ssfs_remove("none");
+  ssfs_fclose(fd);
+  ssfs_get_stats(&stats);
+  check(stats.call[SSFS_STAT_FOPEN].calls == 1 && stats.call[SSFS_STAT_FCLOSE].calls == 1 && stats.call[SSFS_STAT_FRSEEK].calls == 1,
+        "the calls are not counted", &err_no);
+  check(stats.call[SSFS_STAT_FWRITE].calls == 3 && stats.call[SSFS_STAT_FWRITE].bytes == 300 && stats.call[SSFS_STAT_FWRITE].errors == 0,
+        "the writes are not counted with their bytes", &err_no);
+  check(stats.call[SSFS_STAT_FREAD].calls == 2 && stats.call[SSFS_STAT_FREAD].bytes == 100, "the reads are not counted with their bytes", &err_no);
+  check(stats.call[SSFS_STAT_REMOVE].calls == 1 && stats.call[SSFS_STAT_REMOVE].errors == 1, "a failed remove is not counted as an error", &err_no);
+  for(int c = 0; c < SSFS_STAT_CALLS; c++)
+    counted &= histogram_counts_calls(&stats.call[c]);
+  check(counted, "a histogram does not count each call once", &err_no);
+  //Counts from several threads at once add up
+  ssfs_reset_stats();
+  for(long t = 0; t < STAT_THREADS; t++)
+    pthread_create(&threads[t], NULL, stat_worker, (void *)t);
+  for(int t = 0; t < STAT_THREADS; t++)
+    pthread_join(threads[t], NULL);
+  ssfs_get_stats(&stats);
+  check(stats.call[SSFS_STAT_FWRITE].calls == STAT_THREADS*STAT_WRITES && stats.call[SSFS_STAT_FREAD].calls == 0
+        && histogram_counts_calls(&stats.call[SSFS_STAT_FWRITE]), "the counts of several threads do not add up", &err_no);
+  check(strcmp(ssfs_stat_name(SSFS_STAT_FOPEN), "fopen") == 0 && ssfs_stat_name(SSFS_STAT_CALLS) == NULL, "the call names are wrong", &err_no);
+  //Half the calls in the 8-15ns bucket, all but one of the rest in 1024-2047ns, the last one in the last bucket
+  made_up.latency[3] = 50;
+  made_up.latency[10] = 49;
+  made_up.latency[SSFS_STAT_BUCKETS-1] = 1;
+  check(ssfs_stat_percentile(&made_up, 0.49) == 15 && ssfs_stat_percentile(&made_up, 0.5) == 2047
+        && ssfs_stat_percentile(&made_up, 0.99) == (2L << (SSFS_STAT_BUCKETS-1))-1 && ssfs_stat_percentile(&none, 0.5) == 0,
+        "a percentile is not read off its bucket", &err_no);
+  printf("\n-------------------------------\nStats test Finished.\nCurrent Error Num: %d\n--------------------------------\n\n", err_no);
+  return err_no;
+}
+
+#define TRACE_FILE "sfs_test2_trace"
+#define TRACE_CALLS 17
+#define TRACE_MAX_FILES 200   // the default max_files
+
+/* replays the records of trace on fs, a fresh file system, as sfs_replay does
+ * returns # calls whose result differs from the recorded one, -1 if the trace holds a call this does not replay
+ */
+int replay_trace(ssfs_t *fs, FILE *trace, int *calls){
+  ssfs_trace_record rec;
+  int file[TRACE_MAX_FILES], mismatches = 0, r, fd;
+  char *buf = calloc(4096, sizeof(char));
+  for(int i = 0; i < TRACE_MAX_FILES; i++)
+    file[i] = -1;
+  for(*calls = 0; fread(&rec, sizeof(rec), 1, trace) == 1; (*calls)++){
+    fd = rec.file >= 0 && rec.file < TRACE_MAX_FILES ? file[rec.file] : -1;
+    switch(rec.call){
+      case SSFS_STAT_FOPEN:
+        r = ssfs_fopen_r(fs, rec.name);
+        if(rec.result >= 0) file[rec.result] = r;
+        break;
+      case SSFS_STAT_FCLOSE:  r = ssfs_fclose_r(fs, fd); break;
+      case SSFS_STAT_FWRITE:  r = ssfs_fwrite_r(fs, fd, buf, rec.arg); break;
+      case SSFS_STAT_FREAD:   r = ssfs_fread_r(fs, fd, buf, rec.arg); break;
+      case SSFS_STAT_PWRITE:  r = ssfs_pwrite_r(fs, fd, buf, rec.arg, rec.offset); break;
+      case SSFS_STAT_PREAD:   r = ssfs_pread_r(fs, fd, buf, rec.arg, rec.offset); break;
+      case SSFS_STAT_FRSEEK:  r = ssfs_frseek_r(fs, fd, rec.arg); break;
+      case SSFS_STAT_FWSEEK:  r = ssfs_fwseek_r(fs, fd, rec.arg); break;
+      case SSFS_STAT_REMOVE:  r = ssfs_remove_r(fs, rec.name); break;
+      case SSFS_STAT_COMMIT:  r = ssfs_commit_r(fs); break;
+      case SSFS_STAT_RESTORE: r = ssfs_restore_r(fs, rec.file); break;
+      default: free(buf); return -1;
+    }
+    if(r != rec.result) mismatches++;
+  }
+  free(buf);
+  return mismatches;
+}
+
+/*
+Tracing: every call made while tracing is recorded with its arguments and result, after a header with the geometry,
+and replaying the trace on a fresh file system gives every call the result it had.
+*/
+int test_trace(){
+  printf("\n-------------------------------\nInitializing trace test.\n--------------------------------\n\n");
+  int err_no = 0, fd, fd1, cnum, calls, mismatches;
+  char *buf = malloc(4000);
+  ssfs_geometry mounted;
+  ssfs_trace_header header;
+  fill(buf, 4000, 28);
+  mkssfs(1);
+  check(ssfs_trace_start(TRACE_FILE) == 0, "cannot start a trace", &err_no);
+  check(ssfs_trace_start(TRACE_FILE) == -1, "a second trace was started", &err_no);
+  fd = ssfs_fopen("t0");
+  ssfs_fwrite(fd, buf, 3000);
+  ssfs_frseek(fd, 100);
+  ssfs_fread(fd, buf, 500);
+  ssfs_fwseek(fd, 10);
+  ssfs_fwrite(fd, buf, 20);
+  ssfs_pwrite(fd, buf, 100, 2000);
+  ssfs_pread(fd, buf, 4000, 0);
+  ssfs_fread(fd+1, buf, 10);    //not open
+  cnum = ssfs_commit();
+  fd1 = ssfs_fopen("t1");
+  ssfs_fwrite(fd1, buf, 10);
+  ssfs_fclose(fd1);
+  ssfs_remove("t1");
+  ssfs_remove("none");
+  ssfs_restore(cnum);
+  ssfs_fclose(fd);
+  check(ssfs_trace_stop() == 0, "cannot stop the trace", &err_no);
+  FILE *trace = fopen(TRACE_FILE, "rb");
+  ssfs_get_geometry(&mounted);
+  check(trace != NULL && fread(&header, sizeof(header), 1, trace) == 1 && header.magic == SSFS_TRACE_MAGIC
+        && memcmp(&header.geometry, &mounted, sizeof(mounted)) == 0, "the trace does not start with a header of the geometry", &err_no);
+  if(trace != NULL){
+    ssfs_t *fs = ssfs_new("trace_replay_test");
+    ssfs_set_geometry_r(fs, &header.geometry);
+    ssfs_set_backend_r(fs, SSFS_BACKEND_MMAP);
+    check(mkssfs_r(fs, 1) == 0, "cannot make an image to replay on", &err_no);
+    mismatches = replay_trace(fs, trace, &calls);
+    check(calls == TRACE_CALLS, "the trace does not hold a record per call", &err_no);
+    check(mismatches == 0, "a call replayed with another result than recorded", &err_no);
+    ssfs_free(fs);
+    fclose(trace);
+    unlink("trace_replay_test");
+  }
+  unlink(TRACE_FILE);
+  free(buf);
+  printf("\n-------------------------------\nTrace test Finished.\nCurrent Error Num: %d\n--------------------------------\n\n", err_no);
+  return err_no;
+}
+
+/* The main testing program
+ */
+int main(int argc, char **argv){
+  int err_no = 0;
+  if(argc > 1 && strcmp(argv[1], "mmap") == 0)
+    backend = SSFS_BACKEND_MMAP;
+  ssfs_set_backend(backend);
+  err_no += test_cache_remount();
+  err_no += test_batch_results();
+  err_no += test_batch_frees();
+  err_no += test_crash_indirect();
+  err_no += test_journal_replay();
+  err_no += test_cow_checkpoints();
+  err_no += test_diff();
+  err_no += test_inline_boundary();
+  err_no += test_fragmented_write();
+  err_no += test_view();
+  err_no += test_async_readahead();
+  err_no += test_double_indirect();
+  err_no += test_allocator();
+  err_no += test_directory_index();
+  err_no += test_metadata_commit();
+  err_no += test_mmap_backend();
+  err_no += test_readahead_stats();
+  err_no += test_seek();
+  err_no += test_positional();
+  err_no += test_geometry();
+  err_no += test_triple_indirect();
+  err_no += test_contexts();
+  err_no += test_latency_workload();
+  err_no += test_stats();
+  err_no += test_trace();
+  printf("Total Error Num: %d\n", err_no);
+  return err_no != 0;
+}